@@ -14,8 +14,20 @@ static void init_config(config_t* cfg)
 {
     memset(cfg, 0, sizeof(config_t));
     cfg->remote_port = 22;
+    cfg->sftp_window = 2048;
+    cfg->parallel_sessions = 1;
+    cfg->split_size = 64;
+    cfg->watch_delay = 200;
+    cfg->scan_threads = 1;
     // cfg->follow_link = 0;
     // cfg->use_compress = 0;
+    // cfg->bwlimit = 0;
+    // cfg->resume_transfer = 0;
+    // cfg->delta_transfer = 0;
+    // cfg->sync_manifest = 0;
+    // cfg->manifest_verify = 0;
+    // cfg->memory_limit = 0;
+    // cfg->transfer_order = ORDER_PATH;
 }
 
 static void destroy_config(void* v)
@@ -31,12 +43,20 @@ static void destroy_config(void* v)
     free(cfg->remote_path);
     free(cfg->local_path);
 
+    ignore_free(cfg->ignores);
     if (cfg->ignore_files && cfg->ignore_files != &__dummy_ignoref) {
         for (int i = 0; cfg->ignore_files[i]; ++i) {
             free(cfg->ignore_files[i]);
         }
         free(cfg->ignore_files);
     }
+    ignore_free(cfg->priorities);
+    if (cfg->priority_files && cfg->priority_files != &__dummy_ignoref) {
+        for (int i = 0; cfg->priority_files[i]; ++i) {
+            free(cfg->priority_files[i]);
+        }
+        free(cfg->priority_files);
+    }
 }
 
 static char* jstrdup(const json_value* js)
@@ -46,21 +66,22 @@ static char* jstrdup(const json_value* js)
     return str;
 }
 
-static int set_ignore_files(config_t* cfg, json_value* jarr)
+/* set the patterns of the config key <name> ending with NULL. */
+static int set_patterns(char*** patterns, json_value* jarr, const char* name)
 {
     const unsigned n = json_get_array_length(jarr);
 
-    cfg->ignore_files = malloc((n + 1) * sizeof(char*));
-    memset(cfg->ignore_files, 0, (n + 1) * sizeof(char*));
+    *patterns = malloc((n + 1) * sizeof(char*));
+    memset(*patterns, 0, (n + 1) * sizeof(char*));
 
     for (unsigned i = 0; i < n; ++i) {
         json_value* jval = json_get_array_value(jarr, i);
 
         if (json_get_type(jval) != json_string) {
-            fprintf(stderr, "invalid config value in <ignore_files>.\n");
+            fprintf(stderr, "invalid config value in <%s>.\n", name);
             return -1;
         }
-        cfg->ignore_files[i] = jstrdup(jval);
+        (*patterns)[i] = jstrdup(jval);
     }
     return 0;
 }
@@ -112,7 +133,7 @@ static int set_config(config_t* cfg, json_value* jobj)
                 fprintf(stderr, "invalid config value for <ignore_files>.\n");
                 return -1;
             }
-            if (set_ignore_files(cfg, value) != 0) {
+            if (set_patterns(&cfg->ignore_files, value, "ignore_files") != 0) {
                 return -1;
             }
         } else if (!strcmp(name, "local_path")) {
@@ -133,6 +154,108 @@ static int set_config(config_t* cfg, json_value* jobj)
                 return -1;
             }
             cfg->use_compress = json_get_bool(value);
+        } else if (!strcmp(name, "sftp_window")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) <= 0
+                    || json_get_int(value) > 1024 * 1024) {
+                fprintf(stderr, "invalid config value for <sftp_window>.\n");
+                return -1;
+            }
+            cfg->sftp_window = (int)json_get_int(value);
+        } else if (!strcmp(name, "bwlimit")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) < 0
+                    || json_get_int(value) > 1024 * 1024 * 1024) {
+                fprintf(stderr, "invalid config value for <bwlimit>.\n");
+                return -1;
+            }
+            cfg->bwlimit = (int)json_get_int(value);
+        } else if (!strcmp(name, "parallel_sessions")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) <= 0
+                    || json_get_int(value) > 64) {
+                fprintf(stderr, "invalid config value for <parallel_sessions>.\n");
+                return -1;
+            }
+            cfg->parallel_sessions = (int)json_get_int(value);
+        } else if (!strcmp(name, "split_size")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) < 0
+                    || json_get_int(value) > 1024 * 1024) {
+                fprintf(stderr, "invalid config value for <split_size>.\n");
+                return -1;
+            }
+            cfg->split_size = (int)json_get_int(value);
+        } else if (!strcmp(name, "resume_transfer")) {
+            if (json_get_type(value) != json_boolean) {
+                fprintf(stderr, "invalid config value for <resume_transfer>.\n");
+                return -1;
+            }
+            cfg->resume_transfer = json_get_bool(value);
+        } else if (!strcmp(name, "delta_transfer")) {
+            if (json_get_type(value) != json_boolean) {
+                fprintf(stderr, "invalid config value for <delta_transfer>.\n");
+                return -1;
+            }
+            cfg->delta_transfer = json_get_bool(value);
+        } else if (!strcmp(name, "tar_threshold")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) < 0
+                    || json_get_int(value) > 1024 * 1024) {
+                fprintf(stderr, "invalid config value for <tar_threshold>.\n");
+                return -1;
+            }
+            cfg->tar_threshold = (int)json_get_int(value);
+        } else if (!strcmp(name, "sync_manifest")) {
+            if (json_get_type(value) != json_boolean) {
+                fprintf(stderr, "invalid config value for <sync_manifest>.\n");
+                return -1;
+            }
+            cfg->sync_manifest = json_get_bool(value);
+        } else if (!strcmp(name, "manifest_verify")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) < 0
+                    || json_get_int(value) > 100) {
+                fprintf(stderr, "invalid config value for <manifest_verify>.\n");
+                return -1;
+            }
+            cfg->manifest_verify = (int)json_get_int(value);
+        } else if (!strcmp(name, "watch_delay")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) < 0
+                    || json_get_int(value) > 60 * 1000) {
+                fprintf(stderr, "invalid config value for <watch_delay>.\n");
+                return -1;
+            }
+            cfg->watch_delay = (int)json_get_int(value);
+        } else if (!strcmp(name, "scan_threads")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) < 1
+                    || json_get_int(value) > 64) {
+                fprintf(stderr, "invalid config value for <scan_threads>.\n");
+                return -1;
+            }
+            cfg->scan_threads = (int)json_get_int(value);
+        } else if (!strcmp(name, "memory_limit")) {
+            if (json_get_type(value) != json_integer || json_get_int(value) < 0
+                    || json_get_int(value) > 1024 * 1024) {
+                fprintf(stderr, "invalid config value for <memory_limit>.\n");
+                return -1;
+            }
+            cfg->memory_limit = (int)json_get_int(value);
+        } else if (!strcmp(name, "transfer_order")) {
+            const char* order = json_get_type(value) == json_string ? json_get_string(value) : "";
+
+            if (!strcmp(order, "path")) {
+                cfg->transfer_order = ORDER_PATH;
+            } else if (!strcmp(order, "small_first")) {
+                cfg->transfer_order = ORDER_SMALL_FIRST;
+            } else if (!strcmp(order, "large_first")) {
+                cfg->transfer_order = ORDER_LARGE_FIRST;
+            } else {
+                fprintf(stderr, "invalid config value for <transfer_order>.\n");
+                return -1;
+            }
+        } else if (!strcmp(name, "priority_files")) {
+            if (json_get_type(value) != json_array) {
+                fprintf(stderr, "invalid config value for <priority_files>.\n");
+                return -1;
+            }
+            if (set_patterns(&cfg->priority_files, value, "priority_files") != 0) {
+                return -1;
+            }
         } else {
             fprintf(stderr, "unkown config key <%s>.\n", name);
             return -1;
@@ -151,6 +274,11 @@ static int set_config(config_t* cfg, json_value* jobj)
     if (!cfg->ignore_files) {
         cfg->ignore_files = &__dummy_ignoref;
     }
+    if (!cfg->priority_files) {
+        cfg->priority_files = &__dummy_ignoref;
+    }
+    cfg->ignores = ignore_compile(cfg->ignore_files);
+    cfg->priorities = ignore_compile(cfg->priority_files);
     return 0;
 }
 
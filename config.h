@@ -1,8 +1,14 @@
 #ifndef _CONFIG_H_
 #define _CONFIG_H_
 
+#include "ignore.h"
 #include "xlist.h"
 
+/* the order of the files to transfer, directories go first */
+#define ORDER_PATH          0
+#define ORDER_SMALL_FIRST   1
+#define ORDER_LARGE_FIRST   2
+
 typedef struct {
     char* label;
     char* remote_host;
@@ -12,8 +18,24 @@ typedef struct {
     char* remote_path;
     char* local_path;
     char** ignore_files; // End with <NULL>
+    ignore_t* ignores; // compiled <ignore_files>
     int follow_link;
     int use_compress;
+    int sftp_window; // KiB
+    int bwlimit; // KiB per second of all the sessions, 0 to disable
+    int parallel_sessions;
+    int split_size; // MiB, 0 to disable
+    int resume_transfer;
+    int delta_transfer;
+    int tar_threshold; // KiB, 0 to disable
+    int sync_manifest;
+    int manifest_verify; // percent of the files checked
+    int watch_delay; // ms
+    int scan_threads;
+    int memory_limit; // MiB of the listing, 0 to keep it all in memory
+    int transfer_order; // ORDER_*
+    char** priority_files; // End with <NULL>, transferred first
+    ignore_t* priorities; // compiled <priority_files>
 } config_t;
 
 xlist_t* configs_load(const char* file);
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mbedtls/sha256.h>
+
+#include "delta.h"
+
+#define DELTA_MIN_BLOCK     (64 * 1024)
+#define DELTA_MAX_BLOCKS    1024
+#define DELTA_BUCKETS       2048
+#define CRC32_POLY          0x04c11db7u
+
+typedef struct {
+    uint32_t sum;               /* POSIX cksum of the block */
+    unsigned char hash[32];     /* SHA-256 of the block */
+    int next;                   /* next block in the same bucket, -1 if none */
+} block_t;
+
+/* <count> old blocks from <block> are found at <offset> of the new file */
+typedef struct {
+    uint64_t offset;
+    int block;
+    int count;
+} match_t;
+
+typedef struct {
+    size_t bs;
+    uint32_t crc_table[256];
+    uint32_t out_table[256];    /* crc of a byte followed by <bs> zero bytes */
+    block_t* blocks;
+    int nblocks;
+    int buckets[DELTA_BUCKETS];
+    match_t* matches;
+    size_t nmatches;
+} delta_t;
+
+static inline uint32_t crc_update(const uint32_t* table, uint32_t crc, unsigned char ch)
+{
+    return (crc << 8) ^ table[(crc >> 24) ^ ch];
+}
+
+/* <a> * <b> mod CRC32_POLY in GF(2) */
+static uint32_t crc_mulmod(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+
+    for (int i = 31; i >= 0; --i) {
+        r = r & 0x80000000u ? (r << 1) ^ CRC32_POLY : r << 1;
+        if ((b >> i) & 1) {
+            r ^= a;
+        }
+    }
+    return r;
+}
+
+/* the result of cksum(1) from the crc of <len> bytes of data */
+static uint32_t crc_final(const uint32_t* table, uint32_t crc, uint64_t len)
+{
+    for (; len; len >>= 8) {
+        crc = crc_update(table, crc, len & 0xff);
+    }
+    return ~crc;
+}
+
+/* the crc of cksum(1) starts from 0, so it is linear in the data and can
+ * be rolled: crc(w[1..n]) = update(crc(w[0..n-1]), w[n]) ^ out_table[w[0]].
+ */
+static void crc_init(delta_t* d)
+{
+    uint32_t xpow = 1;
+
+    for (int i = 0; i < 256; ++i) {
+        uint32_t c = (uint32_t)i << 24;
+
+        for (int j = 0; j < 8; ++j) {
+            c = c & 0x80000000u ? (c << 1) ^ CRC32_POLY : c << 1;
+        }
+        d->crc_table[i] = c;
+    }
+    for (size_t i = 0; i < d->bs; ++i) {
+        xpow = crc_update(d->crc_table, xpow, 0);
+    }
+    for (int i = 0; i < 256; ++i) {
+        d->out_table[i] = crc_mulmod(d->crc_table[i], xpow);
+    }
+}
+
+static int hex2bin(const char* hex, unsigned char* bin, size_t size)
+{
+    for (size_t i = 0; i < size * 2; ++i) {
+        int v;
+
+        if (hex[i] >= '0' && hex[i] <= '9') {
+            v = hex[i] - '0';
+        } else if (hex[i] >= 'a' && hex[i] <= 'f') {
+            v = hex[i] - 'a' + 10;
+        } else {
+            return -1;
+        }
+        bin[i / 2] = (unsigned char)(i % 2 ? bin[i / 2] << 4 | v : v);
+    }
+    return 0;
+}
+
+/* get cksum and SHA-256 of each whole block of <remote>. */
+static int get_signatures(delta_t* d, ssh_t* ssh, const char* remote)
+{
+    ssh_exec_t* e;
+    xstr_t cmd;
+    char line[256];
+    int n = 0;
+
+    xstr_init_ex(&cmd, 256);
+    snprintf(line, sizeof(line), "n=%d; i=0; while [ $i -lt $n ]; do f=", d->nblocks);
+    xstr_append(&cmd, line);
+    ssh_quote_arg(&cmd, remote);
+    snprintf(line, sizeof(line), "; dd if=\"$f\" bs=%d skip=$i count=1 2>/dev/null | cksum"
+        " && dd if=\"$f\" bs=%d skip=$i count=1 2>/dev/null | sha256sum"
+        " || exit 1; i=$((i+1)); done", (int)d->bs, (int)d->bs);
+    xstr_append(&cmd, line);
+
+    e = ssh_exec_open(ssh, xstr_data(&cmd));
+    xstr_destroy(&cmd);
+    if (!e) {
+        return -1;
+    }
+
+    for (int i = 0; i < DELTA_BUCKETS; ++i) {
+        d->buckets[i] = -1;
+    }
+    for (; n < d->nblocks; ++n) {
+        block_t* b = &d->blocks[n];
+        char* end;
+
+        /* "<crc> <size>" and "<sha256>  -" */
+        if (ssh_exec_gets(e, line, sizeof(line)) != 0) {
+            break;
+        }
+        b->sum = (uint32_t)strtoul(line, &end, 10);
+        if (end == line || strtoul(end, NULL, 10) != d->bs) {
+            break;
+        }
+        if (ssh_exec_gets(e, line, sizeof(line)) != 0
+                || hex2bin(line, b->hash, sizeof(b->hash)) != 0) {
+            break;
+        }
+        b->next = d->buckets[b->sum % DELTA_BUCKETS];
+        d->buckets[b->sum % DELTA_BUCKETS] = n;
+    }
+
+    if (n < d->nblocks) {
+        ssh_exec_abort(e);
+        return -1;
+    }
+    return ssh_exec_close(e) == 0 ? 0 : -1;
+}
+
+static void add_match(delta_t* d, uint64_t offset, int block)
+{
+    match_t* m = d->nmatches ? &d->matches[d->nmatches - 1] : NULL;
+
+    /* continue the last run if it is the next block at the next offset */
+    if (m && m->offset + m->count * d->bs == offset && m->block + m->count == block) {
+        ++m->count;
+        return;
+    }
+    /* every match takes at least one block of the new file */
+    m = &d->matches[d->nmatches++];
+    m->offset = offset;
+    m->block = block;
+    m->count = 1;
+}
+
+/* find the old blocks in the new file, rolls a window of <bs> bytes over
+ * the file and skips the whole window if it matches a block.
+ */
+static int find_matches(delta_t* d, FILE* fp, uint64_t size)
+{
+    const size_t bs = d->bs;
+    const size_t cap = bs * 2;
+    char* buf = malloc(cap);
+    uint64_t base = 0;      /* file offset of <buf> */
+    size_t len = 0;
+    uint64_t off = 0;       /* file offset of the window */
+    uint32_t crc = 0;
+    int fresh = 1;
+    int ret = 0;
+
+    d->matches = malloc((size / bs + 1) * sizeof(match_t));
+    d->nmatches = 0;
+
+    while (off + bs <= size) {
+        uint64_t need = off + bs < size ? off + bs + 1 : size;
+        unsigned char* win;
+        unsigned char hash[32];
+        int hashed = 0;
+        uint32_t sum;
+        int k;
+
+        /* keep the window and the byte after it in <buf> */
+        if (need > base + len) {
+            size_t keep = (size_t)(base + len - off);
+
+            memmove(buf, buf + (off - base), keep);
+            base = off;
+            len = keep + fread(buf + keep, 1, cap - keep, fp);
+            if (need > base + len) {
+                ret = -1; /* changed or failed to read */
+                break;
+            }
+        }
+        win = (unsigned char*)buf + (off - base);
+
+        if (fresh) {
+            crc = 0;
+            for (size_t i = 0; i < bs; ++i) {
+                crc = crc_update(d->crc_table, crc, win[i]);
+            }
+            fresh = 0;
+        }
+        sum = crc_final(d->crc_table, crc, bs);
+
+        for (k = d->buckets[sum % DELTA_BUCKETS]; k >= 0; k = d->blocks[k].next) {
+            if (d->blocks[k].sum != sum) {
+                continue;
+            }
+            if (!hashed) {
+                mbedtls_sha256_ret(win, bs, hash, 0);
+                hashed = 1;
+            }
+            if (memcmp(d->blocks[k].hash, hash, sizeof(hash)) == 0) {
+                break;
+            }
+        }
+        if (k >= 0) {
+            add_match(d, off, k);
+            off += bs;
+            fresh = 1;
+            continue;
+        }
+        if (off + bs == size) {
+            break;
+        }
+        crc = crc_update(d->crc_table, crc, win[bs]) ^ d->out_table[win[0]];
+        ++off;
+    }
+
+    free(buf);
+    return ret;
+}
+
+/* build <tmp> on the remote host with the matched blocks of <remote>. */
+static int copy_blocks(delta_t* d, ssh_t* ssh, const char* remote, const char* tmp, int mode)
+{
+    ssh_exec_t* e = ssh_exec_open(ssh, "sh");
+    xstr_t script;
+    char line[256];
+    int ret = 0;
+
+    if (!e) {
+        return -1;
+    }
+
+    xstr_init_ex(&script, 4096);
+    xstr_append(&script, "f=");
+    ssh_quote_arg(&script, remote);
+    xstr_append(&script, "; t=");
+    ssh_quote_arg(&script, tmp);
+    snprintf(line, sizeof(line), "\n: > \"$t\" && chmod %o \"$t\" || exit 1\n", mode & 0777);
+    xstr_append(&script, line);
+
+    /* seek_bytes is for the unaligned offset in the new file */
+    for (size_t i = 0; i < d->nmatches; ++i) {
+        match_t* m = &d->matches[i];
+
+        snprintf(line, sizeof(line), "dd if=\"$f\" of=\"$t\" bs=%d skip=%d count=%d"
+            " seek=%llu oflag=seek_bytes conv=notrunc 2>/dev/null"
+            " || { rm -f \"$t\"; exit 1; }\n",
+            (int)d->bs, m->block, m->count, (unsigned long long)m->offset);
+        xstr_append(&script, line);
+
+        if (xstr_size(&script) > 3072 || i + 1 == d->nmatches) {
+            if (ssh_exec_write(e, xstr_data(&script), xstr_size(&script)) != 0) {
+                ret = -1;
+                break;
+            }
+            xstr_clear(&script);
+        }
+    }
+    xstr_destroy(&script);
+
+    if (ssh_exec_close(e) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static int rename_remote(ssh_t* ssh, const char* from, const char* to)
+{
+    ssh_exec_t* e;
+    xstr_t cmd;
+
+    xstr_init_ex(&cmd, 256);
+    xstr_append(&cmd, "mv -f ");
+    ssh_quote_arg(&cmd, from);
+    xstr_push_back(&cmd, ' ');
+    ssh_quote_arg(&cmd, to);
+
+    e = ssh_exec_open(ssh, xstr_data(&cmd));
+    xstr_destroy(&cmd);
+
+    return e && ssh_exec_close(e) == 0 ? 0 : -1;
+}
+
+int delta_send_file(sftp_t* s, const char* local, const char* remote,
+        int mode, time_t mtime, uint64_t size, uint64_t old_size)
+{
+    delta_t d;
+    FILE* fp;
+    xstr_t tmp;
+    uint64_t* ranges;
+    size_t nranges = 0;
+    uint64_t last = 0;
+    int progress = s->progress;
+    int ret;
+
+    if (!LIBSSH2_SFTP_S_ISREG(mode) || old_size < DELTA_MIN_SIZE) {
+        return sftp_send_file(s, local, remote, mode, 1, mtime, size);
+    }
+
+    d.bs = (size_t)((old_size + DELTA_MAX_BLOCKS - 1) / DELTA_MAX_BLOCKS);
+    if (d.bs < DELTA_MIN_BLOCK) {
+        d.bs = DELTA_MIN_BLOCK;
+    }
+    d.nblocks = (int)(old_size / d.bs);
+    d.blocks = malloc(d.nblocks * sizeof(block_t));
+    d.matches = NULL;
+    d.nmatches = 0;
+    crc_init(&d);
+
+    fp = fopen(local, "rb");
+    if (!fp || get_signatures(&d, s->ssh, remote) != 0
+            || find_matches(&d, fp, size) != 0 || d.nmatches == 0) {
+        /* nothing to reuse or the remote shell can not help */
+        if (fp) {
+            fclose(fp);
+        }
+        free(d.blocks);
+        free(d.matches);
+        return sftp_send_file(s, local, remote, mode, 1, mtime, size);
+    }
+    fclose(fp);
+
+    /* the data between the matches is sent */
+    ranges = malloc((d.nmatches + 1) * 2 * sizeof(uint64_t));
+    for (size_t i = 0; i < d.nmatches; ++i) {
+        if (d.matches[i].offset > last) {
+            ranges[nranges * 2] = last;
+            ranges[nranges++ * 2 + 1] = d.matches[i].offset - last;
+        }
+        last = d.matches[i].offset + d.matches[i].count * d.bs;
+    }
+    if (size > last) {
+        ranges[nranges * 2] = last;
+        ranges[nranges++ * 2 + 1] = size - last;
+    }
+
+    xstr_init_ex(&tmp, 512);
+    xstr_append(&tmp, remote);
+    xstr_append(&tmp, ".sshul-delta");
+
+    s->error[0] = '\0';
+    s->progress = 0;
+
+    if (copy_blocks(&d, s->ssh, remote, xstr_data(&tmp), mode) != 0) {
+        ret = sftp_send_file(s, local, remote, mode, 1, mtime, size);
+    } else {
+        ret = nranges ? sftp_send_ranges(s, local, xstr_data(&tmp), mode, ranges, nranges) : 0;
+        if (ret == 0) {
+            ret = sftp_send_finish(s, xstr_data(&tmp), size);
+        }
+        if (ret == 0 && rename_remote(s->ssh, xstr_data(&tmp), remote) != 0) {
+            snprintf(s->error, sizeof(s->error), "rename remote file failed");
+            ret = -1;
+        }
+        if (ret != 0) {
+            libssh2_sftp_unlink(s->sftp, xstr_data(&tmp));
+        }
+    }
+
+    s->progress = progress;
+    xstr_destroy(&tmp);
+    free(ranges);
+    free(d.blocks);
+    free(d.matches);
+    return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include <stdint.h>
+
+#include "ssh_session.h"
+
+/* smaller existing files are sent as a whole */
+#define DELTA_MIN_SIZE  (1024 * 1024)
+
+/* upload <local> over the existing <remote> file of <old_size> bytes like
+ * rsync. the remote shell reports the checksums of the blocks of <remote>,
+ * the blocks found in <local> by rolling checksum are copied on the remote
+ * host, only the rest is sent. <remote> is replaced after it is rebuilt
+ * beside. fall back to <sftp_send_file> if the remote shell can not help.
+ * <s->error> is set if it fails.
+ */
+int delta_send_file(sftp_t* s, const char* local, const char* remote,
+        int mode, time_t mtime, uint64_t size, uint64_t old_size);
+
+#endif // _DELTA_H_
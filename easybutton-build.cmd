@@ -146,7 +146,7 @@ if not exist build\CMakeCache.txt (
     mkdir build
     cd build
     cmake -G %cmakegen% -DCMAKE_BUILD_TYPE=%build_type% -DLIBSSH2_INCPATH=%ssh2_inc% ^
-        -DLIBSSH2_LIBPATH=%libssh2%\build\src -DLIBMBED_LIBPATH=%libmbed%\build\library ^
+        -DLIBSSH2_LIBPATH=%libssh2%\build\src -DLIBMBED_INCPATH=%mbed_inc% -DLIBMBED_LIBPATH=%libmbed%\build\library ^
         -DLIBZLIB_LIBPATH=%libzlib%\build\lib ..
     cd ..
 )
@@ -66,7 +66,7 @@ if [ $LIBMBED_VER ]; then
         fi
     fi
 
-    SSHUL_CMAKE_EXTARGS="-DLIBMBED_LIBPATH=$MBED_ROOT/build/library $SSHUL_CMAKE_EXTARGS"
+    SSHUL_CMAKE_EXTARGS="-DLIBMBED_INCPATH=$MBED_INC -DLIBMBED_LIBPATH=$MBED_ROOT/build/library $SSHUL_CMAKE_EXTARGS"
     SSH2_CMAKE_EXTARGS="-DMBEDTLS_INCLUDE_DIR=$MBED_INC -DMBEDTLS_LIBRARY=$MBEDTLS_LIB \
 -DMBEDX509_LIBRARY=$MBEDX509_LIB -DMBEDCRYPTO_LIBRARY=$MBEDCRYPTO_LIB $SSH2_CMAKE_EXTARGS"
 fi
@@ -0,0 +1,841 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ignore.h"
+
+/* the other patterns are matched one by one if the DFA needs more states */
+#define IGNORE_MAX_STATES   4096
+#define IGNORE_MAP_SIZE     (IGNORE_MAX_STATES * 2)
+
+#define STATE_ACCEPT    0x1     /* the path matches if it ends here */
+#define STATE_ALL       0x2     /* the path matches whatever follows */
+#define STATE_BELOW     0x4     /* any longer path matches */
+
+#define PAT_EXACT       0       /* no metacharacter */
+#define PAT_SUFFIX      1       /* "*" and a literal */
+#define PAT_PREFIX      2       /* a literal and "*" */
+#define PAT_OTHER       3
+
+#define POS_STAR        -1
+#define POS_END         -2
+
+/* a set of strings by open addressing */
+typedef struct {
+    char** keys;
+    size_t size;
+    size_t count;
+} strset_t;
+
+typedef struct {
+    int child;              /* the first child, 0 if none */
+    int next;               /* the next sibling, 0 if none */
+    unsigned char c;
+    unsigned char end;      /* a prefix ends here */
+} trie_node_t;
+
+struct ignore {
+    /* the simple patterns are looked up without the DFA */
+    strset_t exact;             /* no metacharacter */
+    strset_t suffixes;          /* "*" and a literal */
+    size_t* lens;               /* the lengths of <suffixes>, ascending */
+    size_t nlens;
+    trie_node_t* trie;          /* a literal and "*", node 0 is the root */
+    int ntrie;
+    /* the other patterns, in the DFA */
+    char** rest;
+    unsigned char cls[256];     /* the class of each byte */
+    int nclasses;
+    int start;
+    int nstates;                /* state 0 matches nothing */
+    uint16_t* trans;            /* [state * nclasses + class], NULL if too many */
+    unsigned char* flags;
+};
+
+/* the NFA while compiling, a position of a pattern is its next token, which
+ * is '*', a set of bytes or the end. a state of the DFA is a set of the
+ * positions.
+ */
+typedef struct {
+    int* kind;              /* POS_STAR, POS_END or the index of the set */
+    unsigned char* tail;    /* only '*' from here to the end */
+    int npos;
+    uint8_t (*sets)[32];
+    int nsets;
+    size_t words;           /* of a position set */
+    uint64_t* states;       /* the position set of each state */
+    int* map;               /* hash of a position set to its state + 1 */
+} nfa_t;
+
+/* glob_match() is from Linux kernel (lib/glob.c). */
+
+/**
+ * glob_match - Shell-style pattern matching, like !fnmatch(pat, str, 0)
+ * @pat: Shell-style pattern to match, e.g. "*.[ch]".
+ * @str: String to match.  The pattern must match the entire string.
+ *
+ * Perform shell-style glob matching, returning true (1) if the match
+ * succeeds, or false (0) if it fails.  Equivalent to !fnmatch(@pat, @str, 0).
+ *
+ * Pattern metacharacters are ?, *, [ and \.
+ * (And, inside character classes, !, - and ].)
+ *
+ * This is small and simple implementation intended for device blacklists
+ * where a string is matched against a number of patterns.  Thus, it
+ * does not preprocess the patterns.  It is non-recursive, and run-time
+ * is at most quadratic: strlen(@str)*strlen(@pat).
+ *
+ * An example of the worst case is glob_match("*aaaaa", "aaaaaaaaaa");
+ * it takes 6 passes over the pattern before matching the string.
+ *
+ * Like !fnmatch(@pat, @str, 0) and unlike the shell, this does NOT
+ * treat / or leading . specially; it isn't actually used for pathnames.
+ *
+ * Note that according to glob(7) (and unlike bash), character classes
+ * are complemented by a leading !; this does not support the regex-style
+ * [^a-z] syntax.
+ *
+ * An opening bracket without a matching close is matched literally.
+ */
+static int glob_match(char const *pat, char const *str)
+{
+    /*
+     * Backtrack to previous * on mismatch and retry starting one
+     * character later in the string.  Because * matches all characters
+     * (no exception for /), it can be easily proved that there's
+     * never a need to backtrack multiple levels.
+     */
+    char const *back_pat = NULL, *back_str = NULL;
+
+    /*
+     * Loop over each token (character or class) in pat, matching
+     * it against the remaining unmatched tail of str.  Return false
+     * on mismatch, or true after matching the trailing nul bytes.
+     */
+    for (;;) {
+        unsigned char c = *str++;
+        unsigned char d = *pat++;
+
+        switch (d) {
+        case '?':   /* Wildcard: anything but nul */
+            if (c == '\0')
+                return 0;
+            break;
+        case '*':   /* Any-length wildcard */
+            if (*pat == '\0')   /* Optimize trailing * case */
+                return 1;
+            back_pat = pat;
+            back_str = --str;   /* Allow zero-length match */
+            break;
+        case '[': { /* Character class */
+            int match = 0, inverted = (*pat == '!');
+            char const *class = pat + inverted;
+            unsigned char a = *class++;
+
+            /*
+             * Iterate over each span in the character class.
+             * A span is either a single character a, or a
+             * range a-b.  The first span may begin with ']'.
+             */
+            do {
+                unsigned char b = a;
+
+                if (a == '\0')  /* Malformed */
+                    goto literal;
+
+                if (class[0] == '-' && class[1] != ']') {
+                    b = class[1];
+
+                    if (b == '\0')
+                        goto literal;
+
+                    class += 2;
+                    /* Any special action if a > b? */
+                }
+                match |= (a <= c && c <= b);
+            } while ((a = *class++) != ']');
+
+            /* a complemented class does not match the end either */
+            if (match == inverted || c == '\0')
+                goto backtrack;
+            pat = class;
+            }
+            break;
+        case '\\':
+            d = *pat++;
+            /*FALLTHROUGH*/
+        default:    /* Literal character */
+literal:
+            if (c == d) {
+                if (d == '\0')
+                    return 1;
+                break;
+            }
+backtrack:
+            if (c == '\0' || !back_pat)
+                return 0;   /* No point continuing */
+            /* Try again from last *, one character later in str. */
+            pat = back_pat;
+            str = ++back_str;
+            break;
+        }
+    }
+}
+
+static size_t hash_str(const char* s)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    }
+    return (size_t)(h ^ (h >> 32));
+}
+
+static int strset_has(const strset_t* set, const char* s)
+{
+    if (set->count == 0) {
+        return 0;
+    }
+    for (size_t i = hash_str(s) & (set->size - 1); set->keys[i]; i = (i + 1) & (set->size - 1)) {
+        if (!strcmp(set->keys[i], s)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* add <s> which is owned by <set> then, return 0 if it is there already. */
+static int strset_add(strset_t* set, char* s)
+{
+    size_t i;
+
+    if (strset_has(set, s)) {
+        free(s);
+        return 0;
+    }
+    if ((set->count + 1) * 2 > set->size) {
+        strset_t bigger;
+
+        bigger.size = set->size ? set->size * 2 : 16;
+        bigger.count = 0;
+        bigger.keys = calloc(bigger.size, sizeof(char*));
+        for (i = 0; i < set->size; ++i) {
+            if (set->keys[i]) {
+                strset_add(&bigger, set->keys[i]);
+            }
+        }
+        free(set->keys);
+        *set = bigger;
+    }
+    for (i = hash_str(s) & (set->size - 1); set->keys[i]; i = (i + 1) & (set->size - 1)) {
+    }
+    set->keys[i] = s;
+    ++set->count;
+    return 1;
+}
+
+static void strset_destroy(strset_t* set)
+{
+    for (size_t i = 0; i < set->size; ++i) {
+        free(set->keys[i]);
+    }
+    free(set->keys);
+}
+
+static void trie_add(ignore_t* ig, const char* s)
+{
+    int node = 0;
+
+    for (; *s; ++s) {
+        int k = ig->trie[node].child;
+
+        while (k && ig->trie[k].c != (unsigned char)*s) {
+            k = ig->trie[k].next;
+        }
+        if (!k) {
+            k = ig->ntrie++;
+            ig->trie = realloc(ig->trie, ig->ntrie * sizeof(trie_node_t));
+            memset(&ig->trie[k], 0, sizeof(trie_node_t));
+            ig->trie[k].c = (unsigned char)*s;
+            ig->trie[k].next = ig->trie[node].child;
+            ig->trie[node].child = k;
+        }
+        node = k;
+    }
+    ig->trie[node].end = 1;
+}
+
+static int trie_match(const ignore_t* ig, const char* s)
+{
+    int node = 0;
+
+    for (; *s; ++s) {
+        int k = ig->trie[node].child;
+
+        while (k && ig->trie[k].c != (unsigned char)*s) {
+            k = ig->trie[k].next;
+        }
+        if (!k) {
+            return 0;
+        }
+        if (ig->trie[k].end) {
+            return 1;
+        }
+        node = k;
+    }
+    return 0;
+}
+
+/* classify <pat>, the literal part of a simple one is put into <lit>. */
+static int classify_pattern(const char* pat, char* lit)
+{
+    size_t n = 0;
+    int lead = 0, trail = 0;
+
+    for (;;) {
+        unsigned char d = *pat++;
+
+        switch (d) {
+        case '\0':
+            goto end;
+        case '?':
+        case '[':
+            return PAT_OTHER;
+        case '*':
+            if (n == 0) {
+                lead = 1;
+            } else {
+                trail = 1;
+            }
+            break;
+        case '\\':
+            d = *pat++;
+            if (d == '\0') {
+                goto end; /* matches the end as glob_match() */
+            }
+            /* FALLTHROUGH */
+        default:
+            if (trail) {
+                return PAT_OTHER; /* '*' in the middle */
+            }
+            lit[n++] = (char)d;
+            break;
+        }
+    }
+
+end:
+    lit[n] = '\0';
+    if ((n == 0 && lead) || (lead && trail)) {
+        return PAT_OTHER;
+    }
+    return lead ? PAT_SUFFIX : trail ? PAT_PREFIX : PAT_EXACT;
+}
+
+static uint8_t* new_set(nfa_t* n)
+{
+    n->kind[n->npos++] = n->nsets;
+    return memset(n->sets[n->nsets++], 0, 32);
+}
+
+static void set_range(uint8_t* set, unsigned a, unsigned b)
+{
+    for (unsigned c = a; c <= b; ++c) {
+        set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+static inline int in_set(const uint8_t* set, unsigned c)
+{
+    return set[c >> 3] & (1 << (c & 7));
+}
+
+/* parse <pat> into positions in the same way as glob_match(). */
+static void parse_pattern(nfa_t* n, const char* pat)
+{
+    int first = n->npos;
+
+    for (;;) {
+        unsigned char d = *pat++;
+
+        switch (d) {
+        case '\0':
+            goto end;
+        case '?':
+            set_range(new_set(n), 1, 255);
+            break;
+        case '*':
+            if (n->npos == first || n->kind[n->npos - 1] != POS_STAR) {
+                n->kind[n->npos++] = POS_STAR;
+            }
+            break;
+        case '[': {
+            int inverted = (*pat == '!');
+            const char* class = pat + inverted;
+            unsigned char a = *class++;
+            uint8_t set[32];
+
+            memset(set, 0, sizeof(set));
+            do {
+                unsigned char b = a;
+
+                if (a == '\0') {
+                    goto literal;
+                }
+                if (class[0] == '-' && class[1] != ']') {
+                    b = class[1];
+                    if (b == '\0') {
+                        goto literal;
+                    }
+                    class += 2;
+                }
+                set_range(set, a, b);
+            } while ((a = *class++) != ']');
+
+            if (inverted) {
+                for (int i = 0; i < 32; ++i) {
+                    set[i] = ~set[i];
+                }
+            }
+            set[0] &= ~1;
+            memcpy(new_set(n), set, sizeof(set));
+            pat = class;
+            }
+            break;
+        case '\\':
+            d = *pat++;
+            if (d == '\0') {
+                goto end; /* matches the end as glob_match() */
+            }
+            /* FALLTHROUGH */
+        default:
+literal:
+            set_range(new_set(n), d, d);
+            break;
+        }
+    }
+
+end:
+    n->kind[n->npos] = POS_END;
+    n->tail[n->npos] = 0;
+    for (int p = n->npos++ - 1; p >= first; --p) {
+        n->tail[p] = n->kind[p] == POS_STAR && n->kind[p + 1] == POS_END;
+    }
+}
+
+/* split the bytes into the classes which no set tells apart. */
+static void build_classes(ignore_t* ig, const nfa_t* n)
+{
+    int ids[512];
+
+    memset(ig->cls, 0, sizeof(ig->cls));
+    ig->nclasses = 1;
+    for (int i = 0; i < n->nsets; ++i) {
+        int k = 0;
+
+        memset(ids, -1, ig->nclasses * 2 * sizeof(int));
+        for (unsigned c = 1; c < 256; ++c) {
+            int key = ig->cls[c] * 2 + !!in_set(n->sets[i], c);
+
+            if (ids[key] < 0) {
+                ids[key] = k++;
+            }
+            ig->cls[c] = (unsigned char)ids[key];
+        }
+        ig->nclasses = k;
+    }
+}
+
+static inline void add_pos(const nfa_t* n, uint64_t* set, int p)
+{
+    set[p / 64] |= (uint64_t)1 << (p % 64);
+    if (n->kind[p] == POS_STAR) {
+        set[(p + 1) / 64] |= (uint64_t)1 << ((p + 1) % 64);
+    }
+}
+
+static inline int has_pos(const uint64_t* set, int p)
+{
+    return !!(set[p / 64] & ((uint64_t)1 << (p % 64)));
+}
+
+/* return the state of the position <set>, -1 if there are too many. */
+static int add_state(ignore_t* ig, nfa_t* n, const uint64_t* set)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i;
+    unsigned char flags = 0;
+    int s;
+
+    for (size_t w = 0; w < n->words; ++w) {
+        h = (h ^ set[w]) * 1099511628211ULL;
+    }
+    for (i = (size_t)(h ^ (h >> 32)) & (IGNORE_MAP_SIZE - 1); n->map[i];
+            i = (i + 1) & (IGNORE_MAP_SIZE - 1)) {
+        if (!memcmp(n->states + (n->map[i] - 1) * n->words, set, n->words * sizeof(uint64_t))) {
+            return n->map[i] - 1;
+        }
+    }
+    if (ig->nstates == IGNORE_MAX_STATES) {
+        return -1;
+    }
+
+    for (int p = 0; p < n->npos; ++p) {
+        if (has_pos(set, p)) {
+            if (n->kind[p] == POS_END) {
+                flags |= STATE_ACCEPT;
+            } else if (n->tail[p]) {
+                flags |= STATE_ACCEPT | STATE_ALL;
+            }
+        }
+    }
+
+    s = ig->nstates++;
+    if ((s & (s - 1)) == 0) {
+        size_t cap = s ? (size_t)s * 2 : 1;
+
+        n->states = realloc(n->states, cap * n->words * sizeof(uint64_t));
+        ig->trans = realloc(ig->trans, cap * ig->nclasses * sizeof(uint16_t));
+        ig->flags = realloc(ig->flags, cap);
+    }
+    memcpy(n->states + s * n->words, set, n->words * sizeof(uint64_t));
+    ig->flags[s] = flags;
+    n->map[i] = s + 1;
+    return s;
+}
+
+/* build all states from the start, return -1 if there are too many. */
+static int build_states(ignore_t* ig, nfa_t* n)
+{
+    uint64_t* set = malloc(n->words * sizeof(uint64_t));
+    unsigned char reps[256];
+    int ret = 0;
+
+    for (int c = 255; c > 0; --c) {
+        reps[ig->cls[c]] = (unsigned char)c;
+    }
+
+    memset(set, 0, n->words * sizeof(uint64_t));
+    add_state(ig, n, set);
+    for (int p = 0; p < n->npos; ++p) {
+        if (p == 0 || n->kind[p - 1] == POS_END) {
+            add_pos(n, set, p);
+        }
+    }
+    ig->start = add_state(ig, n, set);
+
+    for (int s = 0; s < ig->nstates && ret == 0; ++s) {
+        if (s == 0 || (ig->flags[s] & STATE_ALL)) {
+            for (int k = 0; k < ig->nclasses; ++k) {
+                ig->trans[(size_t)s * ig->nclasses + k] = (uint16_t)s;
+            }
+            continue;
+        }
+        for (int k = 0; k < ig->nclasses; ++k) {
+            const uint64_t* from = n->states + (size_t)s * n->words;
+            int t;
+
+            memset(set, 0, n->words * sizeof(uint64_t));
+            for (int p = 0; p < n->npos; ++p) {
+                if (!has_pos(from, p)) {
+                    continue;
+                }
+                if (n->kind[p] == POS_STAR) {
+                    add_pos(n, set, p);
+                } else if (n->kind[p] >= 0 && in_set(n->sets[n->kind[p]], reps[k])) {
+                    add_pos(n, set, p + 1);
+                }
+            }
+            t = add_state(ig, n, set);
+            if (t < 0) {
+                ret = -1;
+                break;
+            }
+            /* the rows may be moved by add_state() */
+            ig->trans[(size_t)s * ig->nclasses + k] = (uint16_t)t;
+        }
+    }
+    free(set);
+    return ret;
+}
+
+/* mark the states from which every longer path matches, they are the ones
+ * which can not reach a state not accepting.
+ */
+static void mark_below(ignore_t* ig)
+{
+    size_t nstates = (unsigned)ig->nstates; /* never negative */
+    size_t nedges = nstates * ig->nclasses;
+    int* offs = calloc(nstates + 1, sizeof(int));
+    int* from = malloc(nedges * sizeof(int));
+    int* queue = malloc(nstates * sizeof(int));
+    unsigned char* reach = calloc(nstates, 1); /* reaches a failure */
+    int head = 0, tail = 0;
+
+    /* the transitions backward */
+    for (size_t e = 0; e < nedges; ++e) {
+        ++offs[ig->trans[e] + 1];
+    }
+    for (int t = 0; t < ig->nstates; ++t) {
+        offs[t + 1] += offs[t];
+    }
+    for (size_t e = 0; e < nedges; ++e) {
+        from[offs[ig->trans[e]]++] = (int)(e / ig->nclasses);
+    }
+    for (int t = ig->nstates; t > 0; --t) {
+        offs[t] = offs[t - 1];
+    }
+    offs[0] = 0;
+
+    for (int t = 0; t < ig->nstates; ++t) {
+        if (!(ig->flags[t] & STATE_ACCEPT)) {
+            reach[t] = 1;
+            queue[tail++] = t;
+        }
+    }
+    while (head < tail) {
+        int t = queue[head++];
+
+        for (int i = offs[t]; i < offs[t + 1]; ++i) {
+            if (!reach[from[i]]) {
+                reach[from[i]] = 1;
+                queue[tail++] = from[i];
+            }
+        }
+    }
+
+    for (int s = 0; s < ig->nstates; ++s) {
+        const uint16_t* row = ig->trans + (size_t)s * ig->nclasses;
+        int below = 1;
+
+        for (int k = 0; k < ig->nclasses && below; ++k) {
+            below = !reach[row[k]];
+        }
+        if (below) {
+            ig->flags[s] |= STATE_BELOW;
+        }
+    }
+
+    free(offs);
+    free(from);
+    free(queue);
+    free(reach);
+}
+
+static int cmp_len(const void* l, const void* r)
+{
+    size_t a = *(const size_t*)l, b = *(const size_t*)r;
+
+    return a < b ? -1 : a > b;
+}
+
+ignore_t* ignore_compile(char* const patterns[])
+{
+    ignore_t* ig = calloc(1, sizeof(ignore_t));
+    nfa_t n;
+    size_t len = 0;
+    int count = 0;
+    int nrest = 0;
+
+    for (; patterns[count]; ++count) {
+        len += strlen(patterns[count]) + 1;
+    }
+    ig->rest = malloc((count + 1) * sizeof(char*));
+    ig->trie = calloc(1, sizeof(trie_node_t));
+    ig->ntrie = 1;
+
+    for (int i = 0; i < count; ++i) {
+        char* lit = malloc(strlen(patterns[i]) + 1);
+
+        switch (classify_pattern(patterns[i], lit)) {
+        case PAT_EXACT:
+            strset_add(&ig->exact, lit);
+            break;
+        case PAT_SUFFIX:
+            if (strset_add(&ig->suffixes, lit)) {
+                size_t k = 0;
+
+                while (k < ig->nlens && ig->lens[k] != strlen(lit)) {
+                    ++k;
+                }
+                if (k == ig->nlens) {
+                    ig->lens = realloc(ig->lens, ++ig->nlens * sizeof(size_t));
+                    ig->lens[k] = strlen(lit);
+                }
+            }
+            break;
+        case PAT_PREFIX:
+            trie_add(ig, lit);
+            free(lit);
+            break;
+        default:
+            ig->rest[nrest++] = patterns[i];
+            free(lit);
+            break;
+        }
+    }
+    ig->rest[nrest] = NULL;
+    if (ig->nlens > 1) {
+        qsort(ig->lens, ig->nlens, sizeof(size_t), cmp_len);
+    }
+    if (nrest == 0) {
+        return ig;
+    }
+
+    memset(&n, 0, sizeof(n));
+    n.kind = malloc(len * sizeof(int) + 1);
+    n.tail = malloc(len + 1);
+    n.sets = malloc(len * sizeof(*n.sets) + 1);
+    for (int i = 0; i < nrest; ++i) {
+        parse_pattern(&n, ig->rest[i]);
+    }
+    n.words = (size_t)n.npos / 64 + 1;
+    n.map = calloc(IGNORE_MAP_SIZE, sizeof(int));
+
+    build_classes(ig, &n);
+    if (build_states(ig, &n) != 0) {
+        free(ig->trans);
+        free(ig->flags);
+        ig->trans = NULL;
+        ig->flags = NULL;
+    } else {
+        mark_below(ig);
+    }
+
+    free(n.kind);
+    free(n.tail);
+    free(n.sets);
+    free(n.states);
+    free(n.map);
+    return ig;
+}
+
+void ignore_free(ignore_t* ig)
+{
+    if (ig) {
+        strset_destroy(&ig->exact);
+        strset_destroy(&ig->suffixes);
+        free(ig->lens);
+        free(ig->trie);
+        free(ig->rest);
+        free(ig->trans);
+        free(ig->flags);
+        free(ig);
+    }
+}
+
+int ignore_match(const ignore_t* ig, const char* path)
+{
+    const unsigned char* s = (const unsigned char*)path;
+    size_t len;
+    int state;
+
+    if (!ig) {
+        return 0;
+    }
+
+    len = strlen(path);
+    if (strset_has(&ig->exact, path)) {
+        return 1;
+    }
+    for (size_t i = 0; i < ig->nlens && ig->lens[i] <= len; ++i) {
+        if (strset_has(&ig->suffixes, path + len - ig->lens[i])) {
+            return 1;
+        }
+    }
+    if (ig->trie[0].child && trie_match(ig, path)) {
+        return 1;
+    }
+
+    if (!ig->trans) {
+        for (char* const* pat = ig->rest; *pat; ++pat) {
+            if (glob_match(*pat, path)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    state = ig->start;
+    for (; *s; ++s) {
+        if (ig->flags[state] & STATE_ALL) {
+            return 1;
+        }
+        state = ig->trans[(size_t)state * ig->nclasses + ig->cls[*s]];
+        if (state == 0) {
+            return 0;
+        }
+    }
+    return ig->flags[state] & STATE_ACCEPT;
+}
+
+/* pass the prefixes under <node> which is reached by <buf> of <len>. */
+static void trie_walk(const ignore_t* ig, int node, char* buf, size_t len,
+        ignore_subtree_cb cb, void* arg)
+{
+    for (int k = ig->trie[node].child; k; k = ig->trie[k].next) {
+        buf[len] = (char)ig->trie[k].c;
+        if (ig->trie[k].end) {
+            cb(buf, len + 1, IGNORE_PREFIX, arg); /* the longer ones are covered */
+        } else {
+            trie_walk(ig, k, buf, len + 1, cb, arg);
+        }
+    }
+}
+
+void ignore_subtrees(const ignore_t* ig, ignore_subtree_cb cb, void* arg)
+{
+    char* buf;
+
+    if (!ig) {
+        return;
+    }
+    for (size_t i = 0; i < ig->exact.size; ++i) {
+        const char* s = ig->exact.keys[i];
+        size_t len = s ? strlen(s) : 0;
+
+        if (len > 1 && s[len - 1] == '/') {
+            cb(s, len - 1, IGNORE_DIR, arg);
+        }
+    }
+    for (size_t i = 0; i < ig->suffixes.size; ++i) {
+        const char* s = ig->suffixes.keys[i];
+        size_t len = s ? strlen(s) : 0;
+
+        if (len > 1 && s[len - 1] == '/') {
+            cb(s, len - 1, IGNORE_SUFFIX, arg);
+        }
+    }
+
+    buf = malloc(ig->ntrie);
+    trie_walk(ig, 0, buf, 0, cb, arg);
+    free(buf);
+}
+
+int ignore_prunes(const ignore_t* ig, const char* dir)
+{
+    const unsigned char* s = (const unsigned char*)dir;
+    int state;
+
+    if (!ig) {
+        return 0;
+    }
+    if (ig->trie[0].child && trie_match(ig, dir)) {
+        return 1;
+    }
+    if (!ig->trans) {
+        return 0;
+    }
+
+    state = ig->start;
+    for (; *s; ++s) {
+        if (ig->flags[state] & STATE_ALL) {
+            return 1;
+        }
+        state = ig->trans[(size_t)state * ig->nclasses + ig->cls[*s]];
+        if (state == 0) {
+            return 0;
+        }
+    }
+    return !!(ig->flags[state] & STATE_BELOW);
+}
@@ -0,0 +1,44 @@
+#ifndef _IGNORE_H_
+#define _IGNORE_H_
+
+#include <stddef.h>
+
+/* the ignore patterns compiled once. a literal name, "*" and a literal
+ * suffix, and a literal prefix and "*" are looked up in hash sets and a
+ * trie, the others are compiled into one DFA so a path is matched against
+ * all of them in one pass. it is read only after compiled, so it is shared
+ * by the threads.
+ */
+typedef struct ignore ignore_t;
+
+/* compile the shell-style <patterns> ending with NULL, which are kept by
+ * the caller until <ignore_free>.
+ */
+ignore_t* ignore_compile(char* const patterns[]);
+void ignore_free(ignore_t* ig);
+
+/* check if <path> matches any of the patterns, same as glob_match() on
+ * each of them. <ig> may be NULL.
+ */
+int ignore_match(const ignore_t* ig, const char* path);
+
+/* check if every path under the directory <dir>, which ends with '/',
+ * matches the patterns, so it is not listed at all. it may miss some
+ * which are covered by several patterns together. <ig> may be NULL.
+ */
+int ignore_prunes(const ignore_t* ig, const char* dir);
+
+/* the kinds of the simple patterns passed to <ignore_subtrees> */
+#define IGNORE_DIR      0   /* "dir/", the directory <lit> */
+#define IGNORE_PREFIX   1   /* "lit*", any path starting with <lit> */
+#define IGNORE_SUFFIX   2   /* "*lit/", any directory ending with <lit> */
+
+typedef void (*ignore_subtree_cb)(const char* lit, size_t len, int kind, void* arg);
+
+/* call <cb> with each simple pattern which ignores a whole subtree, <lit>
+ * of a directory is without the ending '/'. the patterns in the DFA are
+ * not passed. <ig> may be NULL.
+ */
+void ignore_subtrees(const ignore_t* ig, ignore_subtree_cb cb, void* arg);
+
+#endif // _IGNORE_H_
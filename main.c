@@ -10,7 +10,9 @@
 #include "config.h"
 #include "ssh_session.h"
 #include "match.h"
+#include "transfer.h"
 #include "version.h"
+#include "watch.h"
 #include "xstring.h"
 
 #define DEFAULT_CONFIG_FILE "sshul.json"
@@ -19,6 +21,7 @@ enum {
     ACT_NONE,
     ACT_LIST,
     ACT_UPDOWN,
+    ACT_WATCH,
 };
 
 #define CFG_TEMPLATE \
@@ -30,9 +33,23 @@ enum {
     "\t,\"remote_passwd\": \"123456\"\n" \
     "\t,\"remote_path\": \"/tmp\"\n" \
     "\t,\"local_path\": \".\"\n" \
-    "\t,\"ignore_files\": [ \"*.o\", \".git/\", \".vscode/\", \"build/\", \"sshul.json\" ]\n" \
+    "\t,\"ignore_files\": [ \"*.o\", \".git/\", \".vscode/\", \"build/\", \"sshul.json\", \".sshul*\" ]\n" \
     "\t,\"follow_link\": false\n" \
     "\t,\"use_compress\": false\n" \
+    "\t,\"sftp_window\": 2048\n" \
+    "\t,\"bwlimit\": 0\n" \
+    "\t,\"parallel_sessions\": 1\n" \
+    "\t,\"split_size\": 64\n" \
+    "\t,\"resume_transfer\": false\n" \
+    "\t,\"delta_transfer\": false\n" \
+    "\t,\"tar_threshold\": 0\n" \
+    "\t,\"sync_manifest\": false\n" \
+    "\t,\"manifest_verify\": 0\n" \
+    "\t,\"watch_delay\": 200\n" \
+    "\t,\"scan_threads\": 1\n" \
+    "\t,\"memory_limit\": 0\n" \
+    "\t,\"transfer_order\": \"path\"\n" \
+    "\t,\"priority_files\": []\n" \
     "}]\n"
 
 static int generate_config_file(const char* file)
@@ -146,8 +163,9 @@ static int check_local_dir(const char* path, int create)
 }
 #endif
 
-static int check_remote_dir(const char* path, int create, sftp_t* sftp)
+static int check_remote_dir(const char* path, int create, sftp_t* s)
 {
+    LIBSSH2_SFTP* sftp = s->sftp;
     LIBSSH2_SFTP_ATTRIBUTES attrs;
 
     if (libssh2_sftp_stat(sftp, path, &attrs) == 0) {
@@ -175,130 +193,225 @@ static int check_remote_dir(const char* path, int create, sftp_t* sftp)
     return 0;
 }
 
-static const char* get_ftype_str(int mode)
+/* print <items> from <first> to <last>, it is called while listing too. */
+static void list_items(file_table_t* items, size_t first, size_t last, void* arg)
 {
-    switch (mode & LIBSSH2_SFTP_S_IFMT) {
-    case LIBSSH2_SFTP_S_IFREG:
-        return "REG";
-    case LIBSSH2_SFTP_S_IFDIR:
-        return "DIR";
-    case LIBSSH2_SFTP_S_IFLNK:
-        return "LNK";
-    default: /* other type is not supported */
-        return NULL;
-    }
-}
+    xstr_t path;
 
-static void do_list(xlist_t* items)
-{
-    for (xlist_iter_t i = xlist_begin(items);
-            i != xlist_end(items); i = xlist_iter_next(i)) {
-        file_item_t* item = xlist_iter_value(i);
-        const char* type = get_ftype_str(item->mode);
+    xstr_init_ex(&path, 512);
+    for (size_t i = first; i < last; ++i) {
+        const char* type = get_ftype_str(items->mode[i]);
+        const char* file = file_table_path(items, i, &path, 0);
 
         if (type) {
-            if (item->is_newer) {
-                fprintf(stdout, item->is_exist ? "\033[31m[OVR %s]\033[0m %s\n"
-                    : "\033[32m[NEW %s]\033[0m %s\n", type, item->file);
+            if (items->flags[i] & FILE_NEWER) {
+                fprintf(stdout, items->flags[i] & FILE_EXIST ? "\033[31m[OVR %s]\033[0m %s\n"
+                    : "\033[32m[NEW %s]\033[0m %s\n", type, file);
             } else {
-                fprintf(stdout, "\033[90m[IGN %s]\033[0m %s\n", type, item->file);
+                fprintf(stdout, "\033[90m[IGN %s]\033[0m %s\n", type, file);
             }
         } else {
-            fprintf(stdout, "\033[90m[IGN UNN]\033[0m %s\n", item->file);
+            fprintf(stdout, "\033[90m[IGN UNN]\033[0m %s\n", file);
         }
     }
+    xstr_destroy(&path);
 }
 
-static void do_updown(xlist_t* items, config_t* cfg, sftp_t* sftp, int reverse, int prompt)
+static void do_list(file_table_t* items)
 {
-    xstr_t local;
-    xstr_t remote;
-    size_t ol;
-    size_t or;
-
-    if (prompt) {
-        size_t n = 0;
-
-        for (xlist_iter_t i = xlist_begin(items);
-                i != xlist_end(items); i = xlist_iter_next(i)) {
-            file_item_t* item = xlist_iter_value(i);
-            const char* type = get_ftype_str(item->mode);
-
-            if (type && item->is_newer) {
-                fprintf(stdout, item->is_exist ? "\033[31m[OVR %s]\033[0m %s\n"
-                    : "\033[32m[NEW %s]\033[0m %s\n", type, item->file);
-                ++n;
-            }
-        }
-        if (n > 0) {
-            char input[8] = { 0 };
-
-            fprintf(stdout, "The above files will be %s, continue? (Y/n):",
-                reverse ? "downloaded" : "uploaded");
-            fgets(input, sizeof(input), stdin);
-            if (input[0] != 'y' && input[0] != 'Y') {
-                fprintf(stdout, "exit\n");
-                return;
-            }
-        }
-    }
+    list_items(items, 0, items->count, NULL);
+}
 
+/* print the items in order while the walk goes on. */
+static void do_list_stream(config_t* cfg, sftp_t* sftp, int reverse)
+{
     if (reverse) {
-        if (check_local_dir(cfg->local_path, 1) != 0) {
-            return;
-        }
+        iterate_directory_stream(cfg->remote_path, cfg->local_path, cfg->ignores,
+            cfg->follow_link, cfg->resume_transfer, 1, sftp, list_items, NULL);
     } else {
-        if (check_remote_dir(cfg->remote_path, 1, sftp) != 0) {
-            return;
+        iterate_directory_stream(cfg->local_path, cfg->remote_path, cfg->ignores,
+            cfg->follow_link, cfg->resume_transfer, 0, sftp, list_items, NULL);
+    }
+}
+
+/* print the newer ones of <items>, return the number of them. */
+static size_t print_newer(file_table_t* items)
+{
+    size_t n = 0;
+    xstr_t path;
+
+    xstr_init_ex(&path, 512);
+    for (size_t i = 0; i < items->count; ++i) {
+        const char* type = get_ftype_str(items->mode[i]);
+
+        if (type && (items->flags[i] & FILE_NEWER)) {
+            fprintf(stdout, items->flags[i] & FILE_EXIST ? "\033[31m[OVR %s]\033[0m %s\n"
+                : "\033[32m[NEW %s]\033[0m %s\n", type, file_table_path(items, i, &path, 0));
+            ++n;
         }
     }
+    xstr_destroy(&path);
+    return n;
+}
 
-    xstr_init_ex(&local, 512);
-    xstr_append(&local, cfg->local_path);
-    xstr_push_back(&local, '/');
+/* ask to go on if <n> files are printed, return 0 if yes. */
+static int confirm_newer(size_t n, int reverse)
+{
+    char input[8] = { 0 };
 
-    xstr_init_ex(&remote, 512);
-    xstr_append(&remote, cfg->remote_path);
-    xstr_push_back(&remote, '/');
+    if (n == 0) {
+        return 0;
+    }
+    fprintf(stdout, "The above files will be %s, continue? (Y/n):",
+        reverse ? "downloaded" : "uploaded");
+    fgets(input, sizeof(input), stdin);
+    if (input[0] != 'y' && input[0] != 'Y') {
+        fprintf(stdout, "exit\n");
+        return -1;
+    }
+    return 0;
+}
 
-    ol = xstr_size(&local);
-    or = xstr_size(&remote);
+/* check or create the destination directory. */
+static int check_destination(config_t* cfg, sftp_t* sftp, int reverse)
+{
+    if (reverse) {
+        return check_local_dir(cfg->local_path, 1);
+    }
+    return check_remote_dir(cfg->remote_path, 1, sftp);
+}
 
-    for (xlist_iter_t i = xlist_begin(items);
-            i != xlist_end(items); i = xlist_iter_next(i)) {
-        file_item_t* item = xlist_iter_value(i);
-        const char* type = get_ftype_str(item->mode);
+static void do_updown(file_table_t* items, config_t* cfg, sftp_t* sftp, int reverse, int prompt,
+        int jobs, manifest_t* m)
+{
+    time_t start;
 
-        if (type && item->is_newer) {
-            xstr_assign_at(&local, ol, item->file);
-            xstr_assign_at(&remote, or, item->file);
+    if (prompt && confirm_newer(print_newer(items), reverse) != 0) {
+        return;
+    }
+    if (check_destination(cfg, sftp, reverse) != 0) {
+        return;
+    }
 
-            if (reverse) {
-                fprintf(stdout, item->is_exist
-                            ? "\033[31m [DOWNLD]\033[0m \033[s---- %s \033[?25l\033[31m"
-                            : "\033[32m [DOWNLD]\033[0m \033[s---- %s \033[?25l\033[31m", item->file);
-                sftp_recv_file(sftp, xstr_data(&local), xstr_data(&remote),
-                    item->mode, item->is_exist, item->mtime, item->size);
-            } else {
-                fprintf(stdout, item->is_exist
-                            ? "\033[31m [UPLOAD]\033[0m \033[s---- %s \033[?25l\033[31m"
-                            : "\033[32m [UPLOAD]\033[0m \033[s---- %s \033[?25l\033[31m", item->file);
-                sftp_send_file(sftp, xstr_data(&local), xstr_data(&remote),
-                    item->mode, item->is_exist, item->mtime, item->size);
+    start = time(NULL);
+    transfer_items(items, cfg, sftp, reverse, jobs, NULL);
+    if (m) {
+        iterate_directory_record(items, m, start);
+    }
+}
+
+/* transfer while listing, nothing is shown before. */
+static void do_stream(config_t* cfg, sftp_t* sftp, int reverse, int jobs)
+{
+    if (check_destination(cfg, sftp, reverse) != 0) {
+        return;
+    }
+    transfer_stream(cfg, sftp, reverse, jobs);
+}
+
+/* list or transfer within <cfg->memory_limit>, the newer files are listed
+ * once more after the prompt.
+ */
+static void do_bounded(config_t* cfg, sftp_t* sftp, int action, int reverse, int prompt,
+        int jobs)
+{
+    size_t budget = (size_t)cfg->memory_limit * 1024 * 1024;
+    file_table_t* items;
+    listing_t* l;
+    size_t n = 0;
+
+    if (reverse) {
+        l = iterate_listing_open(cfg->remote_path, cfg->local_path, cfg->ignores,
+                cfg->follow_link, cfg->resume_transfer, 1, sftp, budget);
+    } else {
+        l = iterate_listing_open(cfg->local_path, cfg->remote_path, cfg->ignores,
+                cfg->follow_link, cfg->resume_transfer, 0, sftp, budget);
+    }
+    if (!l) {
+        return;
+    }
+
+    if (action == ACT_LIST) {
+        while (iterate_listing_next(l, &items) == 0) {
+            do_list(items);
+        }
+    } else {
+        if (prompt) {
+            while (iterate_listing_next(l, &items) == 0) {
+                n += print_newer(items);
             }
-            fprintf(stdout, "\033[0m\033[?25h\n");
+        }
+        if ((!prompt || (confirm_newer(n, reverse) == 0 && iterate_listing_rewind(l) == 0))
+                && check_destination(cfg, sftp, reverse) == 0) {
+            transfer_listing(l, cfg, sftp, reverse, jobs);
         }
     }
+    iterate_listing_close(l);
+}
+
+/* report the order <cfg> transfers the files in, the files are sent as
+ * they are merged if the listing is <bounded>.
+ */
+static void print_order(const config_t* cfg, int bounded)
+{
+    static const char* const orders[] = { "path", "small_first", "large_first" };
 
-    xstr_destroy(&local);
-    xstr_destroy(&remote);
+    if (bounded) {
+        fprintf(stderr, "transfer order: path (memory_limit)\n");
+        return;
+    }
+    fprintf(stderr, "transfer order: %s", orders[cfg->transfer_order]);
+    if (cfg->priority_files[0]) {
+        fprintf(stderr, ", priority_files:");
+        for (int i = 0; cfg->priority_files[i]; ++i) {
+            fprintf(stderr, " %s", cfg->priority_files[i]);
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+/* open the manifest of <cfg> in the config file's path (the current dir),
+ * one per label and direction, it is only used for the same destination.
+ */
+static manifest_t* open_manifest(config_t* cfg, int reverse)
+{
+    manifest_t* m;
+    xstr_t file, key;
+    char port[16];
+
+    xstr_init_ex(&file, 64);
+    xstr_append(&file, ".sshul");
+    if (cfg->label[0]) {
+        xstr_push_back(&file, '.');
+        xstr_append(&file, cfg->label);
+    }
+    xstr_append(&file, reverse ? ".download.manifest" : ".upload.manifest");
+
+    xstr_init_ex(&key, 512);
+    xstr_append(&key, cfg->remote_user);
+    xstr_push_back(&key, '@');
+    xstr_append(&key, cfg->remote_host);
+    xstr_push_back(&key, ':');
+    xstr_append(&key, xultoa(port, (unsigned long)cfg->remote_port, 10));
+    xstr_push_back(&key, '\n');
+    xstr_append(&key, reverse ? cfg->local_path : cfg->remote_path);
+    xstr_append(&key, cfg->follow_link ? "\nfollow_link" : "\n");
+
+    m = manifest_open(xstr_data(&file), xstr_data(&key), cfg->manifest_verify);
+
+    xstr_destroy(&key);
+    xstr_destroy(&file);
+    return m;
 }
 
-static void process_config(config_t* cfg, int action, int reverse, int prompt)
+static void process_config(config_t* cfg, int action, int reverse, int prompt, int jobs,
+        int bwlimit)
 {
-    xlist_t* items;
+    file_table_t* items;
     ssh_t* scp;
     sftp_t* sftp;
+    manifest_t* m = NULL;
+    int bounded;
 
     fprintf(stderr, "[%s] %s [%s@%s:%s]\n", cfg->local_path,
         reverse ? "<-" : "->", cfg->remote_user, cfg->remote_host, cfg->remote_path);
@@ -316,17 +429,56 @@ static void process_config(config_t* cfg, int action, int reverse, int prompt)
         ssh_session_close(scp);
         return;
     }
+    sftp_set_window((size_t)cfg->sftp_window * 1024);
+    ssh_set_bwlimit((uint64_t)(bwlimit > 0 ? bwlimit : cfg->bwlimit) * 1024);
+    iterate_set_threads(cfg->scan_threads);
+
+    if (cfg->sync_manifest) {
+        m = open_manifest(cfg, reverse);
+    }
+    bounded = cfg->memory_limit > 0 && cfg->tar_threshold == 0 && !m;
+    if (action == ACT_LIST) {
+        print_order(cfg, bounded);
+    }
+
+    /* with no prompt, the transfer starts with the first listed directory,
+     * unless the listing is needed as a whole for tar, the manifest or the
+     * transfer order. so does the listing within a memory limit, and -l
+     * prints in the order of the walk unless the local listing runs in
+     * parallel.
+     */
+    if (action != ACT_WATCH && bounded) {
+        do_bounded(cfg, sftp, action, reverse, prompt,
+            jobs > 0 ? jobs : cfg->parallel_sessions);
+        sftp_session_free(sftp);
+        ssh_session_close(scp);
+        return;
+    }
+    if ((action == ACT_LIST || (action == ACT_UPDOWN && !prompt && cfg->tar_threshold == 0
+                && cfg->transfer_order == ORDER_PATH && !cfg->priority_files[0]))
+            && !m && cfg->scan_threads == 1) {
+        if (action == ACT_LIST) {
+            do_list_stream(cfg, sftp, reverse);
+        } else {
+            do_stream(cfg, sftp, reverse, jobs > 0 ? jobs : cfg->parallel_sessions);
+        }
+        sftp_session_free(sftp);
+        ssh_session_close(scp);
+        return;
+    }
 
     if (reverse) {
         /* iterate remote directory to get download list */
-        items = iterate_directory(cfg->remote_path, cfg->ignore_files, cfg->follow_link, sftp);
+        items = iterate_directory(cfg->remote_path, cfg->ignores, cfg->follow_link, sftp);
         /* download mode, <items> is remote file list, check local files status */
-        iterate_directory_setextra(items, cfg->local_path, cfg->follow_link, NULL);
+        iterate_directory_setextra(items, cfg->local_path, cfg->follow_link,
+                cfg->resume_transfer, NULL, m);
     } else {
         /* iterate local directory to get upload list */
-        items = iterate_directory(cfg->local_path, cfg->ignore_files, cfg->follow_link, NULL);
+        items = iterate_directory(cfg->local_path, cfg->ignores, cfg->follow_link, NULL);
         /* upload mode, <items> is local file list, check remote files status */
-        iterate_directory_setextra(items, cfg->remote_path, cfg->follow_link, sftp);
+        iterate_directory_setextra(items, cfg->remote_path, cfg->follow_link,
+                cfg->resume_transfer, sftp, m);
     }
 
     switch (action) {
@@ -334,10 +486,23 @@ static void process_config(config_t* cfg, int action, int reverse, int prompt)
         do_list(items);
         break;
     case ACT_UPDOWN:
-        do_updown(items, cfg, sftp, reverse, prompt);
+        do_updown(items, cfg, sftp, reverse, prompt,
+            jobs > 0 ? jobs : cfg->parallel_sessions, m);
+        break;
+    case ACT_WATCH:
+        /* sync once, then the touched files only */
+        do_updown(items, cfg, sftp, 0, 0, jobs > 0 ? jobs : cfg->parallel_sessions, m);
+        if (m) {
+            manifest_save(m);
+        }
+        watch_upload(cfg, sftp, m, jobs > 0 ? jobs : cfg->parallel_sessions);
         break;
     }
 
+    if (m) {
+        manifest_save(m);
+        manifest_close(m);
+    }
     iterate_directory_free(items);
 
     sftp_session_free(sftp);
@@ -352,7 +517,10 @@ static void usage(const char* s)
         "  -l   list all matched file.\n"
         "  -x   upload or download the newer files.\n"
         "  -r   switch to download mode (default is upload).\n"
-        "  -y   automatic yes to prompts.\n"
+        "  -y   automatic yes to prompts, the transfer starts while listing.\n"
+        "  -w   upload the newer files, then watch and upload the changed ones.\n"
+        "  -j N transfer files over N sessions in parallel.\n"
+        "  -b N limit the bandwidth of all the sessions to N KiB/s.\n"
         "  -t   generate template config file (" DEFAULT_CONFIG_FILE ").\n"
         "  -v   show version message.\n"
         "  -h   show this help message.\n", s);
@@ -367,7 +535,26 @@ static void usage(const char* s)
         "  local_path    - the local path which local files in.\n"
         "  ignore_files  - the file PATTERNs which used to filter remote or local files.\n"
         "  follow_link   - follow symbolic link. (default: false)\n"
-        "  use_compress  - enable compress. (default: false)\n");
+        "  use_compress  - enable compress. (default: false)\n"
+        "  sftp_window   - KiB of SFTP requests kept in flight per file. (default: 2048)\n"
+        "  bwlimit       - KiB/s shared by all the sessions, 0 to disable. (default: 0)\n"
+        "  parallel_sessions - number of sessions to transfer files. (default: 1)\n"
+        "  split_size    - MiB of a file part sent by each session, 0 to disable. (default: 64)\n"
+        "  resume_transfer - continue the shorter destination files after checking\n"
+        "                  their content by block hashes. (default: false)\n"
+        "  delta_transfer - upload only the changed blocks of existing files. (default: false)\n"
+        "  tar_threshold - KiB, smaller files are sent in one tar stream, 0 to disable. (default: 0)\n"
+        "  sync_manifest - keep the synced state in a file beside the config file, and\n"
+        "                  compare with it instead of listing the destination. (default: false)\n"
+        "  manifest_verify - percent of the files checked on the destination when the\n"
+        "                  manifest is used, it is dropped if any differs. (default: 0)\n"
+        "  watch_delay   - ms to wait for more changes before uploading in watch mode. (default: 200)\n"
+        "  scan_threads  - number of threads to list the local directory. (default: 1)\n"
+        "  memory_limit  - MiB of memory for the listing, the rest is sorted in temporary\n"
+        "                  files, 0 to keep it all in memory. (default: 0)\n"
+        "  transfer_order - the order of the files to transfer, \"path\", \"small_first\"\n"
+        "                  or \"large_first\", directories go first. (default: \"path\")\n"
+        "  priority_files - the file PATTERNs which are transferred before the others.\n");
 
     fprintf(stderr, "[PATTERN] example:\n"
         "  dir/*.[ch] dir/*/file.c di?/*.c dir/*.[a-z]\n");
@@ -380,6 +567,8 @@ int main(int argc, char** argv)
     int action = ACT_NONE;
     int reverse = 0;
     int prompt = 1;
+    int jobs = 0;
+    int bwlimit = 0;
 #ifdef _WIN32
     WSADATA wsData;
     WSAStartup(MAKEWORD(2, 2), &wsData);
@@ -407,6 +596,33 @@ int main(int argc, char** argv)
             case 'x': action = ACT_UPDOWN; continue;
             case 'r': reverse = 1; continue;
             case 'y': prompt = 0; continue;
+            case 'w': action = ACT_WATCH; continue;
+            case 'j':
+                /* -jN or -j N */
+                if (opt[1]) {
+                    jobs = atoi(opt + 1);
+                } else if (i + 1 < argc) {
+                    jobs = atoi(argv[++i]);
+                }
+                if (jobs <= 0) {
+                    fprintf(stderr, "invalid option value for [-j].\n");
+                    return 1;
+                }
+                opt += strlen(opt) - 1;
+                continue;
+            case 'b':
+                /* -bN or -b N */
+                if (opt[1]) {
+                    bwlimit = atoi(opt + 1);
+                } else if (i + 1 < argc) {
+                    bwlimit = atoi(argv[++i]);
+                }
+                if (bwlimit <= 0) {
+                    fprintf(stderr, "invalid option value for [-b].\n");
+                    return 1;
+                }
+                opt += strlen(opt) - 1;
+                continue;
             case 't':
                 return generate_config_file(file);
             case 'v':
@@ -422,6 +638,10 @@ int main(int argc, char** argv)
         }
     }
 
+    if (action == ACT_WATCH && reverse) {
+        fprintf(stderr, "watch mode only uploads.\n");
+        return 1;
+    }
     if (action != ACT_NONE) {
         xlist_t* cfgs;
 
@@ -440,7 +660,7 @@ int main(int argc, char** argv)
             config_t* cfg = xlist_iter_value(i);
 
             if (!strcmp(cfg->label, label)) {
-                process_config(cfg, action, reverse, prompt);
+                process_config(cfg, action, reverse, prompt, jobs, bwlimit);
             }
         }
 
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "manifest.h"
+
+#define MANIFEST_MAGIC  "SSHULMF\1"
+
+typedef struct {
+    char magic[8];
+    uint32_t keylen;    /* the key follows, padded to 8 bytes */
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t namesize;
+} manifest_header_t;
+
+static inline size_t key_space(size_t keylen)
+{
+    return (keylen + 7) & ~(size_t)7;
+}
+
+#ifdef _WIN32
+static void* map_file(const char* file, size_t* size)
+{
+    FILE* fp = fopen(file, "rb");
+    void* data = NULL;
+    long n;
+
+    if (!fp) {
+        return NULL;
+    }
+    if (fseek(fp, 0, SEEK_END) == 0 && (n = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        data = malloc(n);
+        if (fread(data, 1, n, fp) != (size_t)n) {
+            free(data);
+            data = NULL;
+        }
+        *size = n;
+    }
+    fclose(fp);
+    return data;
+}
+
+static void unmap_file(void* data, size_t size)
+{
+    free(data);
+}
+#else
+static void* map_file(const char* file, size_t* size)
+{
+    struct stat st;
+    void* data;
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    return data;
+}
+
+static void unmap_file(void* data, size_t size)
+{
+    munmap(data, size);
+}
+#endif
+
+/* check the mapped file and point the entries to it, return -1 if broken. */
+static int load_entries(manifest_t* m)
+{
+    const manifest_header_t* h = m->map;
+    size_t keylen = strlen(m->key);
+    size_t off = sizeof(manifest_header_t) + key_space(keylen);
+    const manifest_entry_t* entries;
+    const char* names;
+
+    if (m->mapsize < off || memcmp(h->magic, MANIFEST_MAGIC, sizeof(h->magic))
+            || h->keylen != keylen || memcmp(h + 1, m->key, keylen)) {
+        return -1;
+    }
+    if (h->count > (m->mapsize - off) / sizeof(manifest_entry_t)
+            || h->namesize != m->mapsize - off - h->count * sizeof(manifest_entry_t)) {
+        return -1;
+    }
+    entries = (const manifest_entry_t*)((const char*)m->map + off);
+    names = (const char*)(entries + h->count);
+
+    if (h->count > 0 && names[h->namesize - 1] != '\0') {
+        return -1;
+    }
+    for (size_t i = 0; i < h->count; ++i) {
+        if (entries[i].name >= h->namesize
+                || (i > 0 && strcmp(names + entries[i - 1].name, names + entries[i].name) >= 0)) {
+            return -1;
+        }
+    }
+
+    m->entries = entries;
+    m->count = (size_t)h->count;
+    m->names = names;
+    return 0;
+}
+
+manifest_t* manifest_open(const char* file, const char* key, int verify)
+{
+    manifest_t* m = calloc(1, sizeof(manifest_t));
+
+#ifdef _WIN32
+    m->file = _strdup(file);
+    m->key = _strdup(key);
+#else
+    m->file = strdup(file);
+    m->key = strdup(key);
+#endif
+    m->verify = verify;
+    m->names = "";
+
+    m->map = map_file(file, &m->mapsize);
+    if (m->map) {
+        if (load_entries(m) == 0) {
+            m->loaded = 1;
+        } else {
+            unmap_file(m->map, m->mapsize);
+            m->map = NULL;
+        }
+    }
+    return m;
+}
+
+static void release_entries(manifest_t* m)
+{
+    if (m->map) {
+        unmap_file(m->map, m->mapsize);
+        m->map = NULL;
+    }
+    free(m->heap);
+    free(m->heap_names);
+    m->heap = NULL;
+    m->heap_names = NULL;
+
+    m->entries = NULL;
+    m->count = 0;
+    m->names = "";
+}
+
+void manifest_close(manifest_t* m)
+{
+    release_entries(m);
+    free(m->bentries);
+    free(m->bnames);
+    free(m->file);
+    free(m->key);
+    free(m);
+}
+
+ptrdiff_t manifest_find(const manifest_t* m, const char* name)
+{
+    size_t lo = 0, hi = m->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int r = strcmp(manifest_name(m, mid), name);
+
+        if (r == 0) {
+            return (ptrdiff_t)mid;
+        }
+        if (r < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+void manifest_build_begin(manifest_t* m)
+{
+    m->bcount = 0;
+    m->bsize = 0;
+}
+
+void manifest_build_add(manifest_t* m, const char* name, int mode, int64_t mtime,
+        uint64_t size, uint32_t flags)
+{
+    size_t len = strlen(name) + 1;
+    manifest_entry_t* e;
+
+    if (m->bcount == m->bcap) {
+        m->bcap = m->bcap ? m->bcap * 2 : 256;
+        m->bentries = realloc(m->bentries, m->bcap * sizeof(manifest_entry_t));
+    }
+    if (m->bsize + len > m->bnamecap) {
+        while (m->bsize + len > m->bnamecap) {
+            m->bnamecap = m->bnamecap ? m->bnamecap * 2 : 4096;
+        }
+        m->bnames = realloc(m->bnames, m->bnamecap);
+    }
+
+    e = &m->bentries[m->bcount++];
+    e->size = size;
+    e->mtime = mtime;
+    e->mode = (uint32_t)mode;
+    e->flags = flags;
+    e->name = m->bsize;
+
+    memcpy(m->bnames + m->bsize, name, len);
+    m->bsize += len;
+}
+
+void manifest_build_end(manifest_t* m)
+{
+    release_entries(m);
+
+    m->heap = m->bentries;
+    m->heap_names = m->bnames;
+    m->entries = m->heap;
+    m->count = m->bcount;
+    m->names = m->heap_names ? m->heap_names : "";
+
+    m->bentries = NULL;
+    m->bnames = NULL;
+    m->bcount = m->bcap = 0;
+    m->bsize = m->bnamecap = 0;
+    m->loaded = 0;
+    m->dirty = 1;
+}
+
+void manifest_invalidate(manifest_t* m)
+{
+    m->invalid = 1;
+}
+
+static int write_entries(manifest_t* m, const char* file)
+{
+    manifest_header_t h;
+    size_t keylen = strlen(m->key);
+    size_t namesize = m->count > 0
+            ? m->entries[m->count - 1].name + strlen(manifest_name(m, m->count - 1)) + 1 : 0;
+    static const char pad[8] = { 0 };
+    FILE* fp = fopen(file, "wb");
+    int ret = 0;
+
+    if (!fp) {
+        return -1;
+    }
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MANIFEST_MAGIC, sizeof(h.magic));
+    h.keylen = (uint32_t)keylen;
+    h.count = m->count;
+    h.namesize = namesize;
+
+    if (fwrite(&h, sizeof(h), 1, fp) != 1
+            || fwrite(m->key, 1, keylen, fp) != keylen
+            || fwrite(pad, 1, key_space(keylen) - keylen, fp) != key_space(keylen) - keylen
+            || (m->count > 0 && fwrite(m->entries, sizeof(manifest_entry_t), m->count, fp) != m->count)
+            || (namesize > 0 && fwrite(m->names, 1, namesize, fp) != namesize)) {
+        ret = -1;
+    }
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int manifest_save(manifest_t* m)
+{
+    size_t len = strlen(m->file);
+    char* tmp;
+    int ret = 0;
+
+    if (m->invalid) {
+        if (remove(m->file) != 0 && errno != ENOENT) {
+            fprintf(stderr, "remove manifest (%s) failed (%s).\n", m->file, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    if (!m->dirty) {
+        return 0;
+    }
+
+    /* written beside and renamed, a broken write leaves the old one */
+    tmp = malloc(len + 5);
+    memcpy(tmp, m->file, len);
+    memcpy(tmp + len, ".tmp", 5);
+
+    if (write_entries(m, tmp) != 0) {
+        fprintf(stderr, "write manifest (%s) failed (%s).\n", tmp, strerror(errno));
+        remove(tmp);
+        ret = -1;
+#ifdef _WIN32
+    } else if (!MoveFileExA(tmp, m->file, MOVEFILE_REPLACE_EXISTING)) {
+        fprintf(stderr, "rename manifest (%s) failed (%d).\n", tmp, GetLastError());
+#else
+    } else if (rename(tmp, m->file) != 0) {
+        fprintf(stderr, "rename manifest (%s) failed (%s).\n", tmp, strerror(errno));
+#endif
+        remove(tmp);
+        ret = -1;
+    } else {
+        m->dirty = 0;
+    }
+    free(tmp);
+    return ret;
+}
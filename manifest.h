@@ -0,0 +1,75 @@
+#ifndef _MANIFEST_H_
+#define _MANIFEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* the directory is not listed, the files in it are unknown */
+#define MANIFEST_UNLISTED   0x1
+
+/* the state of a destination file as last synced. the manifest file is
+ * the header, the key, the entries sorted by name and the names, so it is
+ * used as mapped.
+ */
+typedef struct {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t flags;
+    uint64_t name;      /* offset of the name in <names> */
+} manifest_entry_t;
+
+typedef struct {
+    char* file;
+    char* key;
+    int verify;                 /* percent of the files checked */
+    int loaded;                 /* the entries are read from <file> */
+    int dirty;                  /* the entries are not saved */
+    int invalid;
+    const manifest_entry_t* entries;
+    size_t count;
+    const char* names;
+    void* map;                  /* the mapped file (read on Windows) */
+    size_t mapsize;
+    manifest_entry_t* heap;     /* the built entries */
+    char* heap_names;
+    /* the entries being built */
+    manifest_entry_t* bentries;
+    size_t bcount;
+    size_t bcap;
+    char* bnames;
+    size_t bsize;
+    size_t bnamecap;
+} manifest_t;
+
+/* open the manifest <file> of the destination described by <key>, it is
+ * not loaded if it is missing, broken or of another <key>.
+ */
+manifest_t* manifest_open(const char* file, const char* key, int verify);
+void manifest_close(manifest_t* m);
+
+static inline const char* manifest_name(const manifest_t* m, size_t i)
+{
+    return m->names + m->entries[i].name;
+}
+
+/* return the index of <name>, or -1 if it is not in <m>. */
+ptrdiff_t manifest_find(const manifest_t* m, const char* name);
+
+/* start building new entries, <m> is empty until <manifest_build_end>. */
+void manifest_build_begin(manifest_t* m);
+/* add an entry, the names must be added in sorted order. */
+void manifest_build_add(manifest_t* m, const char* name, int mode, int64_t mtime,
+        uint64_t size, uint32_t flags);
+void manifest_build_end(manifest_t* m);
+
+/* write the entries if they are changed, or remove the file if <m> is not
+ * valid any more, return 0 on success.
+ */
+int manifest_save(manifest_t* m);
+/* the destination is changed in an unknown way, the file is removed by
+ * <manifest_save> and not used again.
+ */
+void manifest_invalidate(manifest_t* m);
+
+#endif // _MANIFEST_H_
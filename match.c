@@ -1,137 +1,363 @@
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #ifndef _WIN32
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #endif
 
 #include "match.h"
+#include "spill.h"
+#include "uring.h"
+#include "xlist.h"
 #include "xstring.h"
+#include "xthread.h"
 
-/* glob_match() is from Linux kernel (lib/glob.c). */
-
-/**
- * glob_match - Shell-style pattern matching, like !fnmatch(pat, str, 0)
- * @pat: Shell-style pattern to match, e.g. "*.[ch]".
- * @str: String to match.  The pattern must match the entire string.
- *
- * Perform shell-style glob matching, returning true (1) if the match
- * succeeds, or false (0) if it fails.  Equivalent to !fnmatch(@pat, @str, 0).
- *
- * Pattern metacharacters are ?, *, [ and \.
- * (And, inside character classes, !, - and ].)
- *
- * This is small and simple implementation intended for device blacklists
- * where a string is matched against a number of patterns.  Thus, it
- * does not preprocess the patterns.  It is non-recursive, and run-time
- * is at most quadratic: strlen(@str)*strlen(@pat).
- *
- * An example of the worst case is glob_match("*aaaaa", "aaaaaaaaaa");
- * it takes 6 passes over the pattern before matching the string.
- *
- * Like !fnmatch(@pat, @str, 0) and unlike the shell, this does NOT
- * treat / or leading . specially; it isn't actually used for pathnames.
- *
- * Note that according to glob(7) (and unlike bash), character classes
- * are complemented by a leading !; this does not support the regex-style
- * [^a-z] syntax.
- *
- * An opening bracket without a matching close is matched literally.
+/* threads to list a local directory */
+static int scan_threads = 1;
+
+void iterate_set_threads(int threads)
+{
+    scan_threads = threads > 0 ? threads : 1;
+}
+
+/* the path nodes of the items are packed into blocks owned by the table,
+ * which are freed together with it.
  */
-static int glob_match(char const *pat, char const *str)
+#define PATH_BLOCK_SIZE     (64 * 1024)
+
+typedef struct path_block {
+    struct path_block* next;
+    size_t used;
+    size_t size;
+    char data[];
+} path_block_t;
+
+static file_table_t* file_table_new(void)
 {
-    /*
-     * Backtrack to previous * on mismatch and retry starting one
-     * character later in the string.  Because * matches all characters
-     * (no exception for /), it can be easily proved that there's
-     * never a need to backtrack multiple levels.
-     */
-    char const *back_pat = NULL, *back_str = NULL;
+    return calloc(1, sizeof(file_table_t));
+}
 
-    /*
-     * Loop over each token (character or class) in pat, matching
-     * it against the remaining unmatched tail of str.  Return false
-     * on mismatch, or true after matching the trailing nul bytes.
-     */
-    for (;;) {
-        unsigned char c = *str++;
-        unsigned char d = *pat++;
-
-        switch (d) {
-        case '?':   /* Wildcard: anything but nul */
-            if (c == '\0')
-                return 0;
-            break;
-        case '*':   /* Any-length wildcard */
-            if (*pat == '\0')   /* Optimize trailing * case */
-                return 1;
-            back_pat = pat;
-            back_str = --str;   /* Allow zero-length match */
-            break;
-        case '[': { /* Character class */
-            int match = 0, inverted = (*pat == '!');
-            char const *class = pat + inverted;
-            unsigned char a = *class++;
-
-            /*
-             * Iterate over each span in the character class.
-             * A span is either a single character a, or a
-             * range a-b.  The first span may begin with ']'.
-             */
-            do {
-                unsigned char b = a;
-
-                if (a == '\0')  /* Malformed */
-                    goto literal;
-
-                if (class[0] == '-' && class[1] != ']') {
-                    b = class[1];
-
-                    if (b == '\0')
-                        goto literal;
-
-                    class += 2;
-                    /* Any special action if a > b? */
-                }
-                match |= (a <= c && c <= b);
-            } while ((a = *class++) != ']');
+static void file_table_free(file_table_t* t)
+{
+    while (t->blocks) {
+        path_block_t* b = t->blocks;
 
-            if (match == inverted)
-                goto backtrack;
-            pat = class;
-            }
-            break;
-        case '\\':
-            d = *pat++;
-            /*FALLTHROUGH*/
-        default:    /* Literal character */
-literal:
-            if (c == d) {
-                if (d == '\0')
-                    return 1;
-                break;
-            }
-backtrack:
-            if (c == '\0' || !back_pat)
-                return 0;   /* No point continuing */
-            /* Try again from last *, one character later in str. */
-            pat = back_pat;
-            str = ++back_str;
-            break;
+        t->blocks = b->next;
+        free(b);
+    }
+    free(t->node);
+    free(t->mode);
+    free(t->mtime);
+    free(t->size);
+    free(t->exist_size);
+    free(t->flags);
+    free(t);
+}
+
+/* make room for <n> items in <t>. */
+static void file_table_reserve(file_table_t* t, size_t n)
+{
+    if (t->cap >= n) {
+        return;
+    }
+    while (t->cap < n) {
+        t->cap = t->cap ? t->cap * 2 : 256;
+    }
+    t->node = realloc(t->node, t->cap * sizeof(path_node_t*));
+    t->mode = realloc(t->mode, t->cap * sizeof(int));
+    t->mtime = realloc(t->mtime, t->cap * sizeof(time_t));
+    t->size = realloc(t->size, t->cap * sizeof(uint64_t));
+    t->exist_size = realloc(t->exist_size, t->cap * sizeof(uint64_t));
+    t->flags = realloc(t->flags, t->cap * sizeof(uint8_t));
+}
+
+/* drop the items of <t> but keep its first block for the next ones. */
+static void file_table_clear(file_table_t* t)
+{
+    path_block_t* b = t->blocks;
+
+    if (b) {
+        while (b->next) {
+            path_block_t* next = b->next;
+
+            b->next = next->next;
+            free(next);
         }
+        b->used = 0;
     }
+    t->count = 0;
 }
 
-static int is_ignored(const char* path, char* const ignores[])
+/* add an item to the end of <t> with no extra, return its index. the
+ * items may be moved until the table is complete.
+ */
+static size_t file_table_add(file_table_t* t, const path_node_t* node, int mode,
+        time_t mtime, uint64_t size)
 {
-    while (ignores[0]) {
-        if (glob_match(ignores[0], path)) {
-            return 1;
+    size_t i = t->count++;
+
+    file_table_reserve(t, t->count);
+    t->node[i] = node;
+    t->mode[i] = mode;
+    t->mtime[i] = mtime;
+    t->size[i] = size;
+    t->exist_size[i] = 0;
+    t->flags[i] = 0;
+    return i;
+}
+
+void file_table_get(const file_table_t* t, size_t i, file_item_t* item)
+{
+    item->node = t->node[i];
+    item->mode = t->mode[i];
+    item->is_newer = !!(t->flags[i] & FILE_NEWER);
+    item->is_exist = !!(t->flags[i] & FILE_EXIST);
+    item->is_done = !!(t->flags[i] & FILE_DONE);
+    item->mtime = t->mtime[i];
+    item->size = t->size[i];
+    item->exist_size = t->exist_size[i];
+}
+
+/* add the node of <name> under <parent> into the blocks of <t>. */
+static const path_node_t* new_path_node(file_table_t* t, const path_node_t* parent,
+        const char* name, size_t len)
+{
+    path_block_t* b = t->blocks;
+    size_t size = (sizeof(path_node_t) + len + 1 + 7) & ~(size_t)7;
+    path_node_t* node;
+
+    if (!b || b->size - b->used < size) {
+        size_t bsize = size > PATH_BLOCK_SIZE / 4 ? size : PATH_BLOCK_SIZE;
+
+        b = malloc(sizeof(path_block_t) + bsize);
+        b->used = 0;
+        b->size = bsize;
+        if (bsize == size && t->blocks) {
+            /* a long one does not waste the rest of the current block */
+            b->next = t->blocks->next;
+            t->blocks->next = b;
+        } else {
+            b->next = t->blocks;
+            t->blocks = b;
         }
-        ++ignores;
     }
-    return 0;
+    node = (path_node_t*)(b->data + b->used);
+    b->used += size;
+
+    node->parent = parent;
+    node->depth = parent ? parent->depth + 1 : 1;
+    node->len = (uint32_t)len;
+    memcpy(node->name, name, len);
+    node->name[len] = '\0';
+    return node;
+}
+
+/* return the last name of the relative path <file>. */
+static const char* last_name(const char* file)
+{
+    const char* name = file + strlen(file);
+
+    /* skip the '/' of a directory */
+    if (name > file && name[-1] == '/') {
+        --name;
+    }
+    while (name > file && name[-1] != '/') {
+        --name;
+    }
+    return name;
+}
+
+/* add the node of the relative path <file> under <parent>. */
+static const path_node_t* new_file_node(file_table_t* items, const path_node_t* parent,
+        const char* file)
+{
+    const char* name = last_name(file);
+
+    return new_path_node(items, parent, name, strlen(name));
+}
+
+/* the directory nodes of the last path, to find the parent of the next
+ * one if the paths come in the order of a walk, but not from it.
+ */
+typedef struct {
+    const path_node_t** nodes;
+    size_t depth;
+    size_t cap;
+} path_stack_t;
+
+static void push_path_node(path_stack_t* s, const path_node_t* node)
+{
+    if (s->depth == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 16;
+        s->nodes = realloc(s->nodes, s->cap * sizeof(path_node_t*));
+    }
+    s->nodes[s->depth++] = node;
+}
+
+/* return the parent node of <file>, a directory missing in <s> is added to
+ * <items> as a node without item.
+ */
+static const path_node_t* find_parent_node(file_table_t* items, path_stack_t* s, const char* file)
+{
+    const char* slash;
+    size_t k = 0;
+
+    /* every name but the last one */
+    while (!!(slash = strchr(file, '/')) && slash[1]) {
+        size_t len = slash + 1 - file;
+
+        if (k < s->depth && s->nodes[k]->len == len && !memcmp(s->nodes[k]->name, file, len)) {
+            ++k;
+        } else {
+            s->depth = k;
+            push_path_node(s, new_path_node(items, k ? s->nodes[k - 1] : NULL, file, len));
+            ++k;
+        }
+        file = slash + 1;
+    }
+    s->depth = k;
+    return k ? s->nodes[k - 1] : NULL;
+}
+
+static void append_path(xstr_t* path, const path_node_t* node)
+{
+    if (node->parent) {
+        append_path(path, node->parent);
+    }
+    xstr_append_ex(path, node->name, node->len);
+}
+
+const char* file_item_path(const file_item_t* item, xstr_t* path, size_t off)
+{
+    xstr_erase_after(path, off);
+    append_path(path, item->node);
+    return xstr_data(path);
+}
+
+const char* file_table_path(const file_table_t* t, size_t i, xstr_t* path, size_t off)
+{
+    xstr_erase_after(path, off);
+    append_path(path, t->node[i]);
+    return xstr_data(path);
+}
+
+static size_t path_node_len(const path_node_t* node)
+{
+    size_t len = 0;
+
+    for (const path_node_t* n = node; n; n = n->parent) {
+        len += n->len;
+    }
+    return len;
+}
+
+size_t file_item_path_len(const file_item_t* item)
+{
+    return path_node_len(item->node);
+}
+
+/* compare the path of <node> with the head of <*s>, which is moved after
+ * it if they are equal.
+ */
+static int cmp_path_head(const path_node_t* node, const char** s)
+{
+    int r;
+
+    if (node->parent && (r = cmp_path_head(node->parent, s)) != 0) {
+        return r;
+    }
+    r = strncmp(node->name, *s, node->len);
+    if (r == 0) {
+        *s += node->len;
+    }
+    return r;
+}
+
+/* compare the path of <node> with <file> as strcmp(). */
+static int cmp_path_str(const path_node_t* node, const char* file)
+{
+    int r = cmp_path_head(node, &file);
+
+    return r ? r : -(*file != '\0');
+}
+
+/* move the items of <s> and their paths to the end of <d>, and free <s>. */
+static void file_table_move(file_table_t* d, file_table_t* s)
+{
+    if (s->count > 0) {
+        size_t n = s->count;
+
+        file_table_reserve(d, d->count + n);
+        memcpy(d->node + d->count, s->node, n * sizeof(path_node_t*));
+        memcpy(d->mode + d->count, s->mode, n * sizeof(int));
+        memcpy(d->mtime + d->count, s->mtime, n * sizeof(time_t));
+        memcpy(d->size + d->count, s->size, n * sizeof(uint64_t));
+        memcpy(d->exist_size + d->count, s->exist_size, n * sizeof(uint64_t));
+        memcpy(d->flags + d->count, s->flags, n * sizeof(uint8_t));
+        d->count += n;
+    }
+    if (s->blocks) {
+        path_block_t* last = s->blocks;
+
+        while (last->next) {
+            last = last->next;
+        }
+        /* keep filling the current block of <dst> */
+        if (d->blocks) {
+            last->next = d->blocks->next;
+            d->blocks->next = s->blocks;
+        } else {
+            d->blocks = s->blocks;
+        }
+        s->blocks = NULL;
+    }
+    file_table_free(s);
+}
+
+/* what is listed of a directory tree */
+typedef struct {
+    const ignore_t* ignores;    /* the files left out, may be NULL */
+    const file_table_t* dirs;   /* the directories to descend into if not NULL,
+                                   sorted by path */
+} filter_t;
+
+/* binary search <file> in the sorted <t>, return its index or -1. */
+static ptrdiff_t find_file_item(const file_table_t* t, const char* file)
+{
+    size_t lo = 0, hi = t->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int r = cmp_path_str(t->node[mid], file);
+
+        if (r == 0) {
+            return (ptrdiff_t)mid;
+        }
+        if (r < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+static inline int is_filtered(const filter_t* f, const char* path)
+{
+    return ignore_match(f->ignores, path);
+}
+
+/* check if the files in the directory <path> are wanted, it is not opened
+ * if all of them are ignored.
+ */
+static inline int is_descended(const filter_t* f, const char* path)
+{
+    return (!f->dirs || find_file_item(f->dirs, path) >= 0)
+        && !ignore_prunes(f->ignores, path);
 }
 
 /* check if equal to "." or ".." */
@@ -161,19 +387,19 @@ static inline time_t filetime2time(FILETIME t)
             / 10000000 - 11644473600LL);
 }
 
-static void new_file_item(xlist_t* items, const char* file,
-        const WIN32_FILE_ATTRIBUTE_DATA* fattrs)
+static const path_node_t* new_file_item(file_table_t* items, const path_node_t* parent,
+        const char* file, const WIN32_FILE_ATTRIBUTE_DATA* fattrs)
 {
-    file_item_t* item = xlist_alloc_back(items);
+    const path_node_t* node = new_file_node(items, parent, file);
 
-    item->file = _strdup(file);
-    item->mode = fattr2mode(fattrs->dwFileAttributes);
-    item->mtime = filetime2time(fattrs->ftLastWriteTime);
-    item->size = (uint64_t)fattrs->nFileSizeHigh << 32 | fattrs->nFileSizeLow;
+    file_table_add(items, node, fattr2mode(fattrs->dwFileAttributes),
+            filetime2time(fattrs->ftLastWriteTime),
+            (uint64_t)fattrs->nFileSizeHigh << 32 | fattrs->nFileSizeLow);
+    return node;
 }
 
-static void iterate_local_directory(xlist_t* items, xstr_t* path, size_t baseoff,
-        char* const ignores[])
+static void iterate_local_directory(file_table_t* items, xstr_t* path, size_t baseoff,
+        const filter_t* f, const path_node_t* parent)
 {
     WIN32_FIND_DATAA fdata;
     HANDLE fh;
@@ -194,14 +420,17 @@ static void iterate_local_directory(xlist_t* items, xstr_t* path, size_t baseoff
             if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
                 xstr_push_back(path, '/');
 
-                if (!is_ignored(xstr_data(path) + baseoff, ignores)) {
-                    new_file_item(items, xstr_data(path) + baseoff,
-                        (WIN32_FILE_ATTRIBUTE_DATA*)&fdata);
-                    iterate_local_directory(items, path, baseoff, ignores);
+                if (!is_filtered(f, xstr_data(path) + baseoff)) {
+                    const path_node_t* node = new_file_item(items, parent,
+                            xstr_data(path) + baseoff, (WIN32_FILE_ATTRIBUTE_DATA*)&fdata);
+
+                    if (is_descended(f, xstr_data(path) + baseoff)) {
+                        iterate_local_directory(items, path, baseoff, f, node);
+                    }
                 }
-            } else if (!is_ignored(xstr_data(path) + baseoff, ignores)) {
+            } else if (!is_filtered(f, xstr_data(path) + baseoff)) {
 
-                new_file_item(items, xstr_data(path) + baseoff,
+                new_file_item(items, parent, xstr_data(path) + baseoff,
                     (WIN32_FILE_ATTRIBUTE_DATA*)&fdata);
             }
 
@@ -214,18 +443,17 @@ static void iterate_local_directory(xlist_t* items, xstr_t* path, size_t baseoff
 }
 
 #else
-static void new_file_item(xlist_t* items, const char* file, const struct stat* st)
+static const path_node_t* new_file_item(file_table_t* items, const path_node_t* parent,
+        const char* file, const struct stat* st)
 {
-    file_item_t* item = xlist_alloc_back(items);
+    const path_node_t* node = new_file_node(items, parent, file);
 
-    item->file = strdup(file);
-    item->mode = st->st_mode;
-    item->mtime = st->st_mtime;
-    item->size = st->st_size;
+    file_table_add(items, node, st->st_mode, st->st_mtime, st->st_size);
+    return node;
 }
 
-static void iterate_local_directory(xlist_t* items, xstr_t* path, size_t baseoff,
-        char* const ignores[], int (*statcb)(const char*, struct stat*))
+static void iterate_local_directory(file_table_t* items, xstr_t* path, size_t baseoff,
+        const filter_t* f, const path_node_t* parent, int (*statcb)(const char*, struct stat*))
 {
     DIR* dir;
     struct dirent* ent;
@@ -246,13 +474,17 @@ static void iterate_local_directory(xlist_t* items, xstr_t* path, size_t baseoff
                 if (S_ISDIR(st.st_mode)) {
                     xstr_push_back(path, '/');
 
-                    if (!is_ignored(xstr_data(path) + baseoff, ignores)) {
-                        new_file_item(items, xstr_data(path) + baseoff, &st);
-                        iterate_local_directory(items, path, baseoff, ignores, statcb);
+                    if (!is_filtered(f, xstr_data(path) + baseoff)) {
+                        const path_node_t* node = new_file_item(items, parent,
+                                xstr_data(path) + baseoff, &st);
+
+                        if (is_descended(f, xstr_data(path) + baseoff)) {
+                            iterate_local_directory(items, path, baseoff, f, node, statcb);
+                        }
                     }
-                } else if (!is_ignored(xstr_data(path) + baseoff, ignores)) {
+                } else if (!is_filtered(f, xstr_data(path) + baseoff)) {
 
-                    new_file_item(items, xstr_data(path) + baseoff, &st);
+                    new_file_item(items, parent, xstr_data(path) + baseoff, &st);
                 }
             }
 
@@ -262,175 +494,2058 @@ static void iterate_local_directory(xlist_t* items, xstr_t* path, size_t baseoff
 
     closedir(dir);
 }
-#endif
 
-static void new_remote_file_item(xlist_t* items, const char* file,
-        const LIBSSH2_SFTP_ATTRIBUTES* attrs)
+/* the parallel walker, each thread takes the directories from the back of
+ * its own queue, and steals from the front of the others' when it is empty.
+ * a directory is opened relative to its parent while the queue is short,
+ * otherwise by its path when it is taken, so the opened fds are bounded.
+ */
+#define WALK_OPEN_MAX   64
+
+typedef struct {
+    char* dir;      /* relative path ending with '/', "" for the top */
+    int fd;         /* the opened directory, or -1 */
+    const path_node_t* node;    /* of the directory, NULL for the top */
+} walk_job_t;
+
+typedef struct walker walker_t;
+
+typedef struct {
+    walker_t* w;
+    xmutex_t mutex;     /* protects the queue */
+    walk_job_t* jobs;
+    size_t head;
+    size_t tail;
+    size_t cap;
+    file_table_t* items; /* the files found by this thread */
+    xthread_t thread;
+} walk_thread_t;
+
+struct walker {
+    const char* base;   /* the listed directory ending with '/' */
+    const filter_t* f;
+    int follnk;
+    walk_thread_t* threads;
+    int nthreads;
+    xmutex_t mutex;     /* protects <queued> and <pending> */
+    xcond_t cond;
+    long queued;        /* jobs in the queues */
+    long pending;       /* jobs in the queues or running */
+};
+
+static void push_job(walk_thread_t* t, char* dir, int fd, const path_node_t* node)
 {
-    file_item_t* item = xlist_alloc_back(items);
-#ifdef _WIN32
-    item->file = _strdup(file);
-#else
-    item->file = strdup(file);
-#endif
-    item->mode = attrs->permissions;
-    item->mtime = attrs->mtime;
-    item->size = attrs->filesize;
+    walker_t* w = t->w;
+
+    xmutex_lock(&t->mutex);
+    if (t->tail == t->cap) {
+        if (t->head > 0) {
+            memmove(t->jobs, t->jobs + t->head, (t->tail - t->head) * sizeof(walk_job_t));
+            t->tail -= t->head;
+            t->head = 0;
+        } else {
+            t->cap = t->cap ? t->cap * 2 : 64;
+            t->jobs = realloc(t->jobs, t->cap * sizeof(walk_job_t));
+        }
+    }
+    t->jobs[t->tail].dir = dir;
+    t->jobs[t->tail].fd = fd;
+    t->jobs[t->tail].node = node;
+    ++t->tail;
+    xmutex_unlock(&t->mutex);
+
+    xmutex_lock(&w->mutex);
+    ++w->queued;
+    ++w->pending;
+    xcond_signal(&w->cond);
+    xmutex_unlock(&w->mutex);
 }
 
-static void iterate_remote_directory(xlist_t* items, xstr_t* path, size_t baseoff,
-        char* const ignores[], int follnk, LIBSSH2_SFTP* sftp)
+/* return the jobs in <t>'s queue, which the other threads may steal. */
+static size_t queued_jobs(walk_thread_t* t)
 {
-    LIBSSH2_SFTP_HANDLE* dir;
-    LIBSSH2_SFTP_ATTRIBUTES attrs;
-    char name[512];
+    size_t n;
+
+    xmutex_lock(&t->mutex);
+    n = t->tail - t->head;
+    xmutex_unlock(&t->mutex);
+    return n;
+}
+
+/* take a job from the back of <t>'s queue, or the front if <steal>. */
+static int pop_job(walk_thread_t* t, walk_job_t* job, int steal)
+{
+    int found = 0;
+
+    xmutex_lock(&t->mutex);
+    if (t->head < t->tail) {
+        *job = steal ? t->jobs[t->head++] : t->jobs[--t->tail];
+        if (t->head == t->tail) {
+            t->head = t->tail = 0;
+        }
+        found = 1;
+    }
+    xmutex_unlock(&t->mutex);
+    return found;
+}
+
+static int take_job(walk_thread_t* t, walk_job_t* job)
+{
+    walker_t* w = t->w;
+    int self = (int)(t - w->threads);
+
+    for (int i = 0; i < w->nthreads; ++i) {
+        int k = (self + i) % w->nthreads;
+
+        if (pop_job(&w->threads[k], job, k != self)) {
+            xmutex_lock(&w->mutex);
+            --w->queued;
+            xmutex_unlock(&w->mutex);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void walk_dir(walk_thread_t* t, walk_job_t* job, xstr_t* path)
+{
+    walker_t* w = t->w;
+    const filter_t* f = w->f;
+    DIR* dir;
+    struct dirent* ent;
+    struct stat st;
     size_t off;
+    int fd = job->fd;
 
-    dir = libssh2_sftp_opendir(sftp, xstr_data(path));
-    if (!dir) {
+    if (fd < 0) {
+        xstr_assign(path, w->base);
+        xstr_append(path, job->dir);
+        fd = open(xstr_data(path), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    if (fd < 0 || !(dir = fdopendir(fd))) {
+        if (fd >= 0) {
+            close(fd);
+        }
         return;
     }
 
+    xstr_assign(path, job->dir);
     off = xstr_size(path);
-    while (libssh2_sftp_readdir(dir, name, sizeof(name), &attrs) > 0) {
-        if (is_valid_name(name)) {
-            xstr_append(path, name);
+    while (!!(ent = readdir(dir))) {
+        if (!is_valid_name(ent->d_name)
+                || fstatat(dirfd(dir), ent->d_name, &st, w->follnk ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        xstr_append(path, ent->d_name);
 
-            if (!LIBSSH2_SFTP_S_ISLNK(attrs.permissions) || !follnk
-                    || libssh2_sftp_stat_ex(sftp, xstr_data(path), xstr_size(path),
-                            LIBSSH2_SFTP_STAT, &attrs) == 0) {
-                if (LIBSSH2_SFTP_S_ISDIR(attrs.permissions)) {
-                    xstr_push_back(path, '/');
+        if (S_ISDIR(st.st_mode)) {
+            xstr_push_back(path, '/');
 
-                    if (!is_ignored(xstr_data(path) + baseoff, ignores)) {
-                        new_remote_file_item(items, xstr_data(path) + baseoff, &attrs);
-                        iterate_remote_directory(items, path, baseoff, ignores, follnk, sftp);
-                    }
-                } else if (!is_ignored(xstr_data(path) + baseoff, ignores)) {
+            if (!is_filtered(f, xstr_data(path))) {
+                const path_node_t* node = new_file_item(t->items, job->node,
+                                            xstr_data(path), &st);
 
-                    new_remote_file_item(items, xstr_data(path) + baseoff, &attrs);
+                if (is_descended(f, xstr_data(path))) {
+                    int sub = -1;
+
+                    if (queued_jobs(t) < WALK_OPEN_MAX) {
+                        sub = openat(dirfd(dir), ent->d_name,
+                                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    }
+                    push_job(t, strdup(xstr_data(path)), sub, node);
                 }
             }
-
-            xstr_erase_after(path, off);
+        } else if (!is_filtered(f, xstr_data(path))) {
+            new_file_item(t->items, job->node, xstr_data(path), &st);
         }
+        xstr_erase_after(path, off);
     }
-
-    libssh2_sftp_closedir(dir);
+    closedir(dir);
 }
 
-static void free_file_item(void* v)
+static void walk_routine(void* arg)
 {
-    file_item_t* item = v;
+    walk_thread_t* t = arg;
+    walker_t* w = t->w;
+    walk_job_t job;
+    xstr_t path;
 
-    free(item->file);
-}
+    xstr_init_ex(&path, 512);
+    while (1) {
+        if (!take_job(t, &job)) {
+            xmutex_lock(&w->mutex);
+            while (w->queued <= 0 && w->pending > 0) {
+                xcond_wait(&w->cond, &w->mutex);
+            }
+            if (w->pending == 0) {
+                xmutex_unlock(&w->mutex);
+                break;
+            }
+            xmutex_unlock(&w->mutex);
+            continue;
+        }
 
-static int cmp_file_item(void* l, void* r)
-{
-    return strcmp(((file_item_t*)l)->file, ((file_item_t*)r)->file);
+        walk_dir(t, &job, &path);
+        free(job.dir);
+
+        xmutex_lock(&w->mutex);
+        if (--w->pending == 0) {
+            xcond_broadcast(&w->cond);
+        }
+        xmutex_unlock(&w->mutex);
+    }
+    xstr_destroy(&path);
 }
 
-xlist_t* iterate_directory(const char* _path, char* const ignores[], int follnk, LIBSSH2_SFTP* sftp)
+/* list the local directory <path> by <nthreads> threads. */
+static void iterate_local_parallel(file_table_t* items, const char* path, const filter_t* f,
+        int follnk, int nthreads)
 {
-    xlist_t* items = xlist_new(sizeof(file_item_t), free_file_item);
-    xstr_t path;
+    walker_t w;
+    int n;
 
-    xstr_init_ex(&path, 512);
-    xstr_append(&path, _path);
+    w.base = path;
+    w.f = f;
+    w.follnk = follnk;
+    w.threads = calloc(nthreads, sizeof(walk_thread_t));
+    w.nthreads = nthreads;
+    w.queued = 0;
+    w.pending = 0;
+    xmutex_init(&w.mutex);
+    xcond_init(&w.cond);
 
-    if (xstr_back(&path) != '/') {
-        xstr_push_back(&path, '/');
+    for (int i = 0; i < nthreads; ++i) {
+        w.threads[i].w = &w;
+        w.threads[i].items = file_table_new();
+        xmutex_init(&w.threads[i].mutex);
     }
-    if (sftp) {
-        iterate_remote_directory(items, &path, xstr_size(&path), ignores, follnk, sftp);
-    } else {
-#ifdef _WIN32
-        iterate_local_directory(items, &path, xstr_size(&path), ignores);
-#else
-        iterate_local_directory(items, &path, xstr_size(&path), ignores,
-            follnk ? stat : lstat);
-#endif
+    push_job(&w.threads[0], strdup(""), -1, NULL);
+
+    /* the calling thread works as thread 0 */
+    for (n = 1; n < nthreads; ++n) {
+        if (xthread_create(&w.threads[n].thread, walk_routine, &w.threads[n]) != 0) {
+            break;
+        }
+    }
+    walk_routine(&w.threads[0]);
+    while (--n > 0) {
+        xthread_join(&w.threads[n].thread);
     }
-    xlist_msort(items, cmp_file_item);
 
-    xstr_destroy(&path);
-    return items;
+    for (int i = 0; i < nthreads; ++i) {
+        walk_thread_t* t = &w.threads[i];
+
+        file_table_move(items, t->items);
+        free(t->jobs);
+        xmutex_destroy(&t->mutex);
+    }
+    xcond_destroy(&w.cond);
+    xmutex_destroy(&w.mutex);
+    free(w.threads);
 }
 
-static inline int file_type_equal(int t1, int t2)
+#ifdef HAVE_IO_URING
+/* the io_uring walker, the entries are stated in batches by the kernel
+ * while the directories are read. an entry which the filter drops by its
+ * d_type is not stated at all.
+ */
+typedef struct {
+    DIR* dir;
+    const path_node_t* node;
+    int refs;           /* the requests on it, and one while it is read */
+} uring_dir_t;
+
+typedef struct {
+    uring_dir_t* dir;   /* NULL if the request is not in flight */
+    char* file;         /* relative path */
+    size_t nameoff;     /* the name in the directory */
+    struct stat st;
+} uring_req_t;
+
+static void release_uring_dir(uring_dir_t* d)
 {
-    return (t1 & LIBSSH2_SFTP_S_IFMT) == (t2 & LIBSSH2_SFTP_S_IFMT);
+    if (--d->refs == 0) {
+        closedir(d->dir);
+        free(d);
+    }
 }
 
-void iterate_directory_setextra(xlist_t* items, const char* _path, int follnk, LIBSSH2_SFTP* sftp)
+static void finish_uring_req(file_table_t* items, xlist_t* dirs, const filter_t* f,
+        uring_req_t* req, int res)
 {
-    xstr_t path;
-    size_t off;
+    if (res == 0) {
+        if (S_ISDIR(req->st.st_mode)) {
+            size_t len = strlen(req->file);
 
-    xstr_init_ex(&path, 512);
-    xstr_append(&path, _path);
-    xstr_push_back(&path, '/');
+            req->file = realloc(req->file, len + 2);
+            req->file[len] = '/';
+            req->file[len + 1] = '\0';
 
-    off = xstr_size(&path);
-    if (sftp) {
-        LIBSSH2_SFTP_ATTRIBUTES attrs;
+            if (!is_filtered(f, req->file)) {
+                const path_node_t* node = new_file_item(items, req->dir->node,
+                                            req->file, &req->st);
 
-        for (xlist_iter_t i = xlist_begin(items);
-                i != xlist_end(items); i = xlist_iter_next(i)) {
-            file_item_t* item = xlist_iter_value(i);
+                if (is_descended(f, req->file)) {
+                    walk_job_t* job = xlist_alloc_back(dirs);
 
-            xstr_assign_at(&path, off, item->file);
-            if (libssh2_sftp_stat_ex(sftp, xstr_data(&path), xstr_size(&path),
-                    follnk ? LIBSSH2_SFTP_STAT : LIBSSH2_SFTP_LSTAT, &attrs) < 0) {
-                item->is_newer = libssh2_sftp_last_error(sftp) == LIBSSH2_FX_NO_SUCH_FILE;
-                item->is_exist = 0;
-            } else {
-                item->is_newer = file_type_equal(attrs.permissions, item->mode)
-                        && attrs.mtime < item->mtime;
-                item->is_exist = 1;
+                    job->dir = req->file;
+                    job->fd = -1;
+                    job->node = node;
+                    req->file = NULL;
+                }
             }
+        } else if (!is_filtered(f, req->file)) {
+            new_file_item(items, req->dir->node, req->file, &req->st);
         }
-    } else {
-#ifdef _WIN32
-        WIN32_FILE_ATTRIBUTE_DATA fattrs;
-#else
-        struct stat statbuf;
-#endif
-        for (xlist_iter_t i = xlist_begin(items);
-                i != xlist_end(items); i = xlist_iter_next(i)) {
-            file_item_t* item = xlist_iter_value(i);
+    }
+    free(req->file);
+    release_uring_dir(req->dir);
+    req->dir = NULL;
+}
 
-            xstr_assign_at(&path, off, item->file);
-            /* check remote file's mtime */
-#ifdef _WIN32
-            if (GetFileAttributesExA(xstr_data(&path), GetFileExInfoStandard, &fattrs)) {
-                item->is_newer = file_type_equal(fattr2mode(fattrs.dwFileAttributes), item->mode)
-                        && filetime2time(fattrs.ftLastWriteTime) < item->mtime;
-                item->is_exist = 1;
-            } else {
-                DWORD e = GetLastError();
-                item->is_newer = (e == ERROR_FILE_NOT_FOUND || e == ERROR_PATH_NOT_FOUND);
-                item->is_exist = 0;
+/* check by the d_type of <ent> if the entry <file> is dropped by <f>. */
+static int is_filtered_type(const filter_t* f, xstr_t* file, const struct dirent* ent,
+        int follnk)
+{
+    int ret;
+
+    if (!f->ignores || ent->d_type == DT_UNKNOWN || (ent->d_type == DT_LNK && follnk)) {
+        return 0;
+    }
+    if (ent->d_type != DT_DIR) {
+        return is_filtered(f, xstr_data(file));
+    }
+    xstr_push_back(file, '/');
+    ret = is_filtered(f, xstr_data(file));
+    xstr_pop_back(file);
+    return ret;
+}
+
+/* list the local directory <path> through io_uring, return -1 if it is
+ * not available, and nothing is added to <items>.
+ */
+static int iterate_local_uring(file_table_t* items, const char* path, const filter_t* f,
+        int follnk)
+{
+    uring_t* r = uring_open(256);
+    file_table_t* found;
+    xlist_t* dirs;
+    uring_req_t* reqs;
+    uring_req_t** free_reqs;
+    unsigned nreqs;
+    unsigned nfree;
+    walk_job_t job;
+    xstr_t file;
+    int ret = 0;
+
+    if (!r) {
+        return -1;
+    }
+    nreqs = uring_space(r);
+    reqs = calloc(nreqs, sizeof(uring_req_t));
+    free_reqs = malloc(nreqs * sizeof(uring_req_t*));
+    for (nfree = 0; nfree < nreqs; ++nfree) {
+        free_reqs[nfree] = &reqs[nfree];
+    }
+    found = file_table_new();
+    dirs = xlist_new(sizeof(walk_job_t), NULL);
+    xstr_init_ex(&file, 512);
+    job.dir = strdup("");
+    job.fd = -1;
+    job.node = NULL;
+    xlist_push_back(dirs, &job);
+
+    while (ret == 0) {
+        uring_dir_t* d;
+        struct dirent* ent;
+        char* rel;
+        void* data;
+        int res;
+
+        if (xlist_empty(dirs)) {
+            ret = uring_reap(r, &data, &res);
+            if (ret == 0) {
+                finish_uring_req(found, dirs, f, data, res);
+                free_reqs[nfree++] = data;
             }
+            continue;
+        }
+
+        job = *(walk_job_t*)xlist_front(dirs);
+        xlist_pop_front(dirs);
+        rel = job.dir;
+        xstr_assign(&file, path);
+        xstr_append(&file, rel);
+        d = malloc(sizeof(uring_dir_t));
+        d->dir = opendir(xstr_data(&file));
+        d->node = job.node;
+        d->refs = 1;
+        if (!d->dir) {
+            free(d);
+            free(rel);
+            continue;
+        }
+
+        xstr_assign(&file, rel);
+        while (ret == 0 && !!(ent = readdir(d->dir))) {
+            uring_req_t* req;
+
+            if (!is_valid_name(ent->d_name)) {
+                continue;
+            }
+            xstr_append(&file, ent->d_name);
+            if (!is_filtered_type(f, &file, ent, follnk)) {
+                while (uring_space(r) == 0 && ret == 0) {
+                    ret = uring_reap(r, &data, &res);
+                    if (ret == 0) {
+                        finish_uring_req(found, dirs, f, data, res);
+                        free_reqs[nfree++] = data;
+                    }
+                }
+                if (ret == 0) {
+                    req = free_reqs[--nfree];
+                    req->dir = d;
+                    req->file = strdup(xstr_data(&file));
+                    req->nameoff = strlen(rel);
+                    ++d->refs;
+                    uring_stat(r, dirfd(d->dir), req->file + req->nameoff, follnk,
+                        &req->st, req);
+                }
+            }
+            xstr_erase_after(&file, strlen(rel));
+        }
+        release_uring_dir(d);
+        free(rel);
+    }
+
+    /* the ring is closed first, then the kernel no longer uses the requests */
+    uring_close(r);
+    for (unsigned i = 0; i < nreqs; ++i) {
+        if (reqs[i].dir) {
+            free(reqs[i].file);
+            release_uring_dir(reqs[i].dir);
+        }
+    }
+    while (!xlist_empty(dirs)) {
+        free(((walk_job_t*)xlist_front(dirs))->dir);
+        xlist_pop_front(dirs);
+    }
+    if (ret > 0) {
+        file_table_move(items, found);
+    } else {
+        file_table_free(found);
+    }
+    xlist_free(dirs);
+    free(free_reqs);
+    free(reqs);
+    xstr_destroy(&file);
+    return ret > 0 ? 0 : -1;
+}
+#else
+static inline int iterate_local_uring(file_table_t* items, const char* path, const filter_t* f,
+        int follnk)
+{
+    return -1;
+}
+#endif // HAVE_IO_URING
+#endif
+
+static const path_node_t* new_remote_file_item(file_table_t* items, const path_node_t* parent,
+        const char* file, const LIBSSH2_SFTP_ATTRIBUTES* attrs)
+{
+    const path_node_t* node = new_file_node(items, parent, file);
+
+    file_table_add(items, node, attrs->permissions, attrs->mtime, attrs->filesize);
+    return node;
+}
+
+static void iterate_remote_directory(file_table_t* items, xstr_t* path, size_t baseoff,
+        const filter_t* f, const path_node_t* parent, int follnk, LIBSSH2_SFTP* sftp)
+{
+    LIBSSH2_SFTP_HANDLE* dir;
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    char name[512];
+    size_t off;
+
+    dir = libssh2_sftp_opendir(sftp, xstr_data(path));
+    if (!dir) {
+        return;
+    }
+
+    off = xstr_size(path);
+    while (libssh2_sftp_readdir(dir, name, sizeof(name), &attrs) > 0) {
+        if (is_valid_name(name)) {
+            xstr_append(path, name);
+
+            if (!LIBSSH2_SFTP_S_ISLNK(attrs.permissions) || !follnk
+                    || libssh2_sftp_stat_ex(sftp, xstr_data(path), xstr_size(path),
+                            LIBSSH2_SFTP_STAT, &attrs) == 0) {
+                if (LIBSSH2_SFTP_S_ISDIR(attrs.permissions)) {
+                    xstr_push_back(path, '/');
+
+                    if (!is_filtered(f, xstr_data(path) + baseoff)) {
+                        const path_node_t* node = new_remote_file_item(items, parent,
+                                xstr_data(path) + baseoff, &attrs);
+
+                        if (is_descended(f, xstr_data(path) + baseoff)) {
+                            iterate_remote_directory(items, path, baseoff, f, node, follnk, sftp);
+                        }
+                    }
+                } else if (!is_filtered(f, xstr_data(path) + baseoff)) {
+
+                    new_remote_file_item(items, parent, xstr_data(path) + baseoff, &attrs);
+                }
+            }
+
+            xstr_erase_after(path, off);
+        }
+    }
+
+    libssh2_sftp_closedir(dir);
+}
+
+/* add an item from a record of "<type> <mode> <mtime> <size> <path>". */
+static void new_found_file_item(file_table_t* items, const char* rec, xstr_t* path, size_t baseoff,
+        const filter_t* f, int follnk, xstr_t* pruned, path_stack_t* dirs)
+{
+    static const char types[] = "fdlbcps";
+    static const int modes[] = {
+        LIBSSH2_SFTP_S_IFREG, LIBSSH2_SFTP_S_IFDIR, LIBSSH2_SFTP_S_IFLNK, LIBSSH2_SFTP_S_IFBLK,
+        LIBSSH2_SFTP_S_IFCHR, LIBSSH2_SFTP_S_IFIFO, LIBSSH2_SFTP_S_IFSOCK
+    };
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+    const char* type = strchr(types, rec[0]);
+    const path_node_t* node;
+    char* p;
+
+    /* a broken link is left out like the SFTP listing */
+    if (!rec[0] || !type || (follnk && rec[0] == 'l') || rec[1] != ' ') {
+        return;
+    }
+    attrs.permissions = (unsigned long)strtoul(rec + 2, &p, 8) | modes[type - types];
+    attrs.mtime = (unsigned long)strtoul(p, &p, 10);
+    while (*p && *p != ' ') {
+        ++p; /* fraction of mtime */
+    }
+    attrs.filesize = strtoull(p, &p, 10);
+    if (*p++ != ' ' || !*p) {
+        return;
+    }
+
+    xstr_assign_at(path, baseoff, p);
+    if (LIBSSH2_SFTP_S_ISDIR(attrs.permissions)) {
+        xstr_push_back(path, '/');
+    }
+    p = xstr_data(path) + baseoff;
+
+    /* find lists a directory before the files in it */
+    if (!xstr_empty(pruned) && !strncmp(p, xstr_data(pruned), xstr_size(pruned))) {
+        return;
+    }
+    if (is_filtered(f, p)) {
+        if (LIBSSH2_SFTP_S_ISDIR(attrs.permissions)) {
+            xstr_assign(pruned, p);
+        }
+        return;
+    }
+    node = new_remote_file_item(items, find_parent_node(items, dirs, p), p, &attrs);
+    if (LIBSSH2_SFTP_S_ISDIR(attrs.permissions)) {
+        if (is_descended(f, p)) {
+            push_path_node(dirs, node);
+        } else {
+            xstr_assign(pruned, p);
+        }
+    }
+}
+
+/* bytes of the listed directories passed to a remote find */
+#define FIND_MAX_ARGS   (32 * 1024)
+
+#define FIND_PRINTF     " -printf '%y %m %T@ %s %P\\0'"
+
+/* the pruning clauses of a remote find */
+typedef struct {
+    xstr_t* cmd;
+    xstr_t arg;
+    int n;
+} find_args_t;
+
+/* append "-path <head><path><tail>" to the find command, the glob
+ * characters of the <len> bytes of <path> are escaped.
+ */
+static void append_find_path(find_args_t* a, const char* head, const char* path,
+        size_t len, const char* tail)
+{
+    xstr_assign(&a->arg, head);
+    for (size_t i = 0; i < len; ++i) {
+        if (path[i] == '*' || path[i] == '?' || path[i] == '[' || path[i] == '\\') {
+            xstr_push_back(&a->arg, '\\');
+        }
+        xstr_push_back(&a->arg, path[i]);
+    }
+    xstr_append(&a->arg, tail);
+    xstr_append(a->cmd, " -path ");
+    ssh_quote_arg(a->cmd, xstr_data(&a->arg));
+}
+
+static void append_find_ignore(const char* lit, size_t len, int kind, void* arg)
+{
+    find_args_t* a = arg;
+
+    xstr_append(a->cmd, a->n++ ? " -o" : " \\(");
+    if (kind == IGNORE_PREFIX) {
+        append_find_path(a, "./", lit, len, "*");
+    } else {
+        xstr_append(a->cmd, " -type d");
+        append_find_path(a, kind == IGNORE_SUFFIX ? "./*" : "./", lit, len, "");
+    }
+}
+
+/* append the clause printing the directories of the destination which the
+ * source does not have, and not descending into them. all the directories
+ * of the source down to the depth which fits the command are allowed, the
+ * ones below it are descended and left to <is_descended>.
+ */
+static void append_find_dirs(find_args_t* a, const filter_t* f)
+{
+    xstr_t path;
+    size_t* sizes;
+    size_t total = 0;
+    uint32_t maxdepth = 0;
+    uint32_t depth = 0;
+
+    for (size_t i = 0; i < f->dirs->count; ++i) {
+        if (LIBSSH2_SFTP_S_ISDIR(f->dirs->mode[i]) && f->dirs->node[i]->depth > maxdepth) {
+            maxdepth = f->dirs->node[i]->depth;
+        }
+    }
+    sizes = calloc(maxdepth + 1, sizeof(size_t));
+    for (size_t i = 0; i < f->dirs->count; ++i) {
+        if (LIBSSH2_SFTP_S_ISDIR(f->dirs->mode[i])) {
+            sizes[f->dirs->node[i]->depth] += path_node_len(f->dirs->node[i]) + 16;
+        }
+    }
+    while (depth < maxdepth && total + sizes[depth + 1] <= FIND_MAX_ARGS) {
+        total += sizes[++depth];
+    }
+    free(sizes);
+    if (depth == 0 && maxdepth > 0) {
+        return;
+    }
+
+    xstr_append(a->cmd, " -type d");
+    if (depth < maxdepth) {
+        /* deeper than <depth> */
+        xstr_append(a->cmd, " \\! -path './*");
+        for (uint32_t d = 0; d < depth; ++d) {
+            xstr_append(a->cmd, "/*");
+        }
+        xstr_push_back(a->cmd, '\'');
+    }
+    a->n = 0;
+    xstr_init_ex(&path, 512);
+    for (size_t i = 0; i < f->dirs->count; ++i) {
+        const file_table_t* dirs = f->dirs;
+
+        if (LIBSSH2_SFTP_S_ISDIR(dirs->mode[i]) && dirs->node[i]->depth <= depth) {
+            size_t len = path_node_len(dirs->node[i]) - 1;
+
+            xstr_append(a->cmd, a->n++ ? " -o" : " \\! \\(");
+            append_find_path(a, "./", file_table_path(dirs, i, &path, 0), len, "");
+        }
+    }
+    xstr_destroy(&path);
+    if (a->n) {
+        xstr_append(a->cmd, " \\)");
+    }
+    xstr_append(a->cmd, FIND_PRINTF " -prune -o");
+}
+
+/* list the remote directory by one find(1), return -1 if it can not run.
+ * the ignored subtrees of the simple patterns and the directories the
+ * source does not have are pruned by find, the rest is left to <f>.
+ */
+static int iterate_remote_find(file_table_t* items, xstr_t* path, size_t baseoff,
+        const filter_t* f, int follnk, ssh_t* ssh)
+{
+    ssh_exec_t* e;
+    xstr_t rec;
+    xstr_t pruned;
+    path_stack_t dirs = { NULL, 0, 0 };
+    find_args_t args;
+    char buf[16384];
+    ssize_t n;
+    size_t count = items->count;
+
+    xstr_init_ex(&rec, 512);
+    xstr_append(&rec, "cd ");
+    ssh_quote_arg(&rec, xstr_data(path));
+    xstr_append(&rec, follnk ? " && find -L . -mindepth 1" : " && find . -mindepth 1");
+
+    args.cmd = &rec;
+    args.n = 0;
+    xstr_init_ex(&args.arg, 256);
+    ignore_subtrees(f->ignores, append_find_ignore, &args);
+    if (args.n) {
+        xstr_append(&rec, " \\) -prune -o");
+    }
+    if (f->dirs) {
+        append_find_dirs(&args, f);
+    }
+    xstr_destroy(&args.arg);
+    xstr_append(&rec, FIND_PRINTF);
+
+    e = ssh_exec_open(ssh, xstr_data(&rec));
+    if (!e) {
+        xstr_destroy(&rec);
+        return -1;
+    }
+
+    xstr_clear(&rec);
+    xstr_init_ex(&pruned, 512);
+    while ((n = ssh_exec_read(e, buf, sizeof(buf))) > 0) {
+        char* cur = buf;
+        char* end = buf + n;
+
+        /* records are separated by '\0' */
+        while (cur < end) {
+            char* nul = memchr(cur, '\0', end - cur);
+
+            if (!nul) {
+                xstr_append_ex(&rec, cur, end - cur);
+                break;
+            }
+            xstr_append_ex(&rec, cur, nul - cur);
+            new_found_file_item(items, xstr_data(&rec), path, baseoff, f, follnk,
+                &pruned, &dirs);
+            xstr_clear(&rec);
+            cur = nul + 1;
+        }
+    }
+    xstr_erase_after(path, baseoff);
+    xstr_destroy(&pruned);
+    xstr_destroy(&rec);
+    free(dirs.nodes);
+
+    /* find fails if some directory can not be read, which is skipped by
+     * SFTP as well, it only counts when nothing is listed.
+     */
+    if (ssh_exec_close(e) != 0 && items->count == count) {
+        return -1;
+    }
+    return 0;
+}
+
+const char* get_ftype_str(int mode)
+{
+    switch (mode & LIBSSH2_SFTP_S_IFMT) {
+    case LIBSSH2_SFTP_S_IFREG:
+        return "REG";
+    case LIBSSH2_SFTP_S_IFDIR:
+        return "DIR";
+    case LIBSSH2_SFTP_S_IFLNK:
+        return "LNK";
+    default: /* other type is not supported */
+        return NULL;
+    }
+}
+
+/* one element of any column of a table */
+typedef union {
+    const path_node_t* node;
+    int mode;
+    time_t mtime;
+    uint64_t size;
+    uint8_t flags;
+} file_cell_t;
+
+/* gather the elements of <size> of <col> from the indexes <ord> into its
+ * <n> ones from <first>, by way of <tmp>.
+ */
+static void gather_column(void* col, size_t size, const size_t* ord, size_t first,
+        size_t n, file_cell_t* tmp)
+{
+    char* d = (char*)tmp;
+
+    for (size_t i = 0; i < n; ++i) {
+        memcpy(d + i * size, (const char*)col + ord[i] * size, size);
+    }
+    memcpy((char*)col + first * size, d, n * size);
+}
+
+/* put the items of <t> from <first> on in the order of the indexes <ord>. */
+static void file_table_permute(file_table_t* t, size_t first, const size_t* ord)
+{
+    size_t n = t->count - first;
+    file_cell_t* tmp = malloc(n * sizeof(file_cell_t));
+
+    gather_column(t->node, sizeof(*t->node), ord, first, n, tmp);
+    gather_column(t->mode, sizeof(*t->mode), ord, first, n, tmp);
+    gather_column(t->mtime, sizeof(*t->mtime), ord, first, n, tmp);
+    gather_column(t->size, sizeof(*t->size), ord, first, n, tmp);
+    gather_column(t->exist_size, sizeof(*t->exist_size), ord, first, n, tmp);
+    gather_column(t->flags, sizeof(*t->flags), ord, first, n, tmp);
+    free(tmp);
+}
+
+/* the items are sorted by their paths as strcmp(). the indexes of the
+ * items are radix sorted from the first byte of the paths, which are read
+ * along their nodes, and a small bucket is sorted by insertion. a large
+ * table is split by the first byte, then the buckets are sorted by the
+ * threads.
+ */
+#define SORT_INSERTION      32
+#define SORT_PARALLEL_MIN   (64 * 1024)
+
+/* compare the paths of <a> and <b> as strcmp(). a name of a directory ends
+ * with '/' which no other name has in the middle, so comparing the names
+ * of the same depth is the same as comparing the whole paths.
+ */
+static int cmp_path_node(const path_node_t* a, const path_node_t* b)
+{
+    int r;
+
+    if (a == b) {
+        return 0;
+    }
+    if (a->depth > b->depth) {
+        r = cmp_path_node(a->parent, b);
+        return r ? r : 1;
+    }
+    if (a->depth < b->depth) {
+        r = cmp_path_node(a, b->parent);
+        return r ? r : -1;
+    }
+    if (a->parent != b->parent && (r = cmp_path_node(a->parent, b->parent)) != 0) {
+        return r;
+    }
+    return strcmp(a->name, b->name);
+}
+
+/* an item to sort and where its path is read */
+typedef struct {
+    const path_node_t* at;  /* the node of the next byte, NULL past the end */
+    uint32_t off;           /* the next byte in the name of <at> */
+    size_t i;               /* the index of the item */
+} sort_entry_t;
+
+/* a range of the entries with the same bytes before their next ones */
+typedef struct {
+    size_t lo;
+    size_t n;
+} sort_range_t;
+
+typedef struct {
+    const path_node_t* const* node;
+    sort_entry_t* e;
+    sort_entry_t* tmp;
+    size_t bounds[257];     /* the buckets of the first byte */
+    int next;               /* the next bucket to sort */
+    xmutex_t mutex;         /* protects <next> */
+} sorter_t;
+
+/* return the node of <n> or its parents at <depth>, NULL if <n> is above. */
+static const path_node_t* node_at_depth(const path_node_t* n, uint32_t depth)
+{
+    if (n->depth < depth) {
+        return NULL;
+    }
+    while (n->depth > depth) {
+        n = n->parent;
+    }
+    return n;
+}
+
+static inline int path_byte(const sort_entry_t* e)
+{
+    return e->at ? (unsigned char)e->at->name[e->off] : 0;
+}
+
+/* move <e> past its byte, to the next name if it is the last of the name. */
+static inline void advance_entry(const path_node_t* const* node, sort_entry_t* e)
+{
+    if (++e->off == e->at->len) {
+        const path_node_t* leaf = node[e->i];
+
+        e->at = e->at == leaf ? NULL : node_at_depth(leaf, e->at->depth + 1);
+        e->off = 0;
+    }
+}
+
+static void insertion_sort(const path_node_t* const* node, sort_entry_t* e, size_t n)
+{
+    for (size_t i = 1; i < n; ++i) {
+        sort_entry_t x = e[i];
+        size_t j = i;
+
+        while (j > 0 && cmp_path_node(node[e[j - 1].i], node[x.i]) > 0) {
+            e[j] = e[j - 1];
+            --j;
+        }
+        e[j] = x;
+    }
+}
+
+/* distribute the <n> entries of <e> by their next byte by way of <tmp>, and
+ * move them past it. <bounds> gets where the buckets begin and end.
+ */
+static void radix_split(const path_node_t* const* node, sort_entry_t* e,
+        sort_entry_t* tmp, size_t n, size_t bounds[257])
+{
+    size_t pos[256] = { 0 };
+
+    for (size_t i = 0; i < n; ++i) {
+        ++pos[path_byte(&e[i])];
+    }
+    bounds[0] = 0;
+    for (int b = 0; b < 256; ++b) {
+        bounds[b + 1] = bounds[b] + pos[b];
+        pos[b] = bounds[b];
+    }
+    for (size_t i = 0; i < n; ++i) {
+        int b = path_byte(&e[i]);
+        sort_entry_t* d = &tmp[pos[b]++];
+
+        *d = e[i];
+        if (b != 0) {
+            advance_entry(node, d);
+        }
+    }
+    memcpy(e, tmp, n * sizeof(sort_entry_t));
+}
+
+/* skip the name the <n> entries of <e> are all at, the ones ending with it
+ * come first. return 0 if they are not at the same name.
+ */
+static int skip_common_name(const path_node_t* const* node, sort_entry_t* e,
+        sort_entry_t* tmp, size_t n)
+{
+    const path_node_t* at = e[0].at;
+    size_t k = 0, m;
+
+    if (!at || e[0].off != 0) {
+        return 0;
+    }
+    for (size_t i = 1; i < n; ++i) {
+        if (e[i].at != at || e[i].off != 0) {
+            return 0;
+        }
+    }
+    for (size_t i = 0; i < n; ++i) {
+        k += node[e[i].i] == at;
+    }
+    m = k;
+    k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sort_entry_t* d = node[e[i].i] == at ? &tmp[k++] : &tmp[m++];
+
+        *d = e[i];
+        d->at = node[d->i] == at ? NULL : node_at_depth(node[d->i], at->depth + 1);
+    }
+    memcpy(e, tmp, n * sizeof(sort_entry_t));
+    return 1;
+}
+
+/* sort the <n> entries of <e> with the same bytes before their next ones. */
+static void radix_sort(const path_node_t* const* node, sort_entry_t* e,
+        sort_entry_t* tmp, size_t n)
+{
+    size_t cap = 64, top = 0;
+    sort_range_t* stack = malloc(cap * sizeof(sort_range_t));
+    size_t bounds[257];
+
+    stack[top].lo = 0;
+    stack[top++].n = n;
+    while (top > 0) {
+        sort_range_t r = stack[--top];
+        sort_entry_t* p = e + r.lo;
+
+        if (r.n < SORT_INSERTION) {
+            insertion_sort(node, p, r.n);
+            continue;
+        }
+        /* the items of one directory share its node, whose name is passed
+         * at once rather than byte by byte.
+         */
+        if (skip_common_name(node, p, tmp + r.lo, r.n)) {
+            size_t k = 0;
+
+            while (k < r.n && !p[k].at) {
+                ++k;
+            }
+            if (r.n - k > 1) {
+                stack[top].lo = r.lo + k;
+                stack[top++].n = r.n - k;
+            }
+            continue;
+        }
+        radix_split(node, p, tmp + r.lo, r.n, bounds);
+
+        /* the ones past the end are equal, the rest goes on by the next byte */
+        if (top + 255 > cap) {
+            cap = (top + 255) * 2;
+            stack = realloc(stack, cap * sizeof(sort_range_t));
+        }
+        for (int b = 255; b > 0; --b) {
+            if (bounds[b + 1] - bounds[b] > 1) {
+                stack[top].lo = r.lo + bounds[b];
+                stack[top++].n = bounds[b + 1] - bounds[b];
+            }
+        }
+    }
+    free(stack);
+}
+
+static void sort_routine(void* arg)
+{
+    sorter_t* s = arg;
+
+    while (1) {
+        int b;
+
+        xmutex_lock(&s->mutex);
+        b = s->next++;
+        xmutex_unlock(&s->mutex);
+        if (b > 255) {
+            break;
+        }
+        if (s->bounds[b + 1] - s->bounds[b] > 1) {
+            radix_sort(s->node, s->e + s->bounds[b], s->tmp + s->bounds[b],
+                s->bounds[b + 1] - s->bounds[b]);
+        }
+    }
+}
+
+/* split <e> by the first byte the entries differ, then sort the buckets by
+ * <nthreads> threads.
+ */
+static void radix_sort_parallel(const path_node_t* const* node, sort_entry_t* e,
+        sort_entry_t* tmp, size_t n, int nthreads)
+{
+    sorter_t s;
+    xthread_t* threads = malloc(nthreads * sizeof(xthread_t));
+    int k;
+
+    s.node = node;
+    s.e = e;
+    s.tmp = tmp;
+    s.next = 1;             /* the ones past the end are equal */
+    xmutex_init(&s.mutex);
+
+    /* a common prefix, e.g. one top directory, leaves a single bucket */
+    do {
+        radix_split(node, e, tmp, n, s.bounds);
+        k = 0;
+        while (k < 256 && s.bounds[k + 1] == 0) {
+            ++k;
+        }
+    } while (k > 0 && k < 256 && s.bounds[k + 1] == n);
+
+    /* the calling thread works as thread 0 */
+    for (k = 1; k < nthreads; ++k) {
+        if (xthread_create(&threads[k], sort_routine, &s) != 0) {
+            break;
+        }
+    }
+    sort_routine(&s);
+    while (--k > 0) {
+        xthread_join(&threads[k]);
+    }
+
+    xmutex_destroy(&s.mutex);
+    free(threads);
+}
+
+static void sort_file_table(file_table_t* t)
+{
+    sort_entry_t* e;
+    sort_entry_t* tmp;
+    size_t* ord;
+
+    if (t->count < 2) {
+        return;
+    }
+    e = malloc(t->count * sizeof(sort_entry_t));
+    tmp = malloc(t->count * sizeof(sort_entry_t));
+    for (size_t i = 0; i < t->count; ++i) {
+        e[i].at = node_at_depth(t->node[i], 1);
+        e[i].off = 0;
+        e[i].i = i;
+    }
+
+    if (scan_threads > 1 && t->count >= SORT_PARALLEL_MIN) {
+        radix_sort_parallel(t->node, e, tmp, t->count, scan_threads);
+    } else {
+        radix_sort(t->node, e, tmp, t->count);
+    }
+    free(tmp);
+
+    ord = malloc(t->count * sizeof(size_t));
+    for (size_t i = 0; i < t->count; ++i) {
+        ord[i] = e[i].i;
+    }
+    free(e);
+    file_table_permute(t, 0, ord);
+    free(ord);
+}
+
+/* list the remote files under <_path> which pass <f> by one find(1), sorted
+ * by path. return NULL if the remote shell can not run it.
+ */
+static file_table_t* find_directory(const char* _path, const filter_t* f, int follnk,
+        sftp_t* sftp)
+{
+    file_table_t* items = file_table_new();
+    xstr_t path;
+
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, _path);
+    if (xstr_back(&path) != '/') {
+        xstr_push_back(&path, '/');
+    }
+    if (iterate_remote_find(items, &path, xstr_size(&path), f, follnk, sftp->ssh) != 0) {
+        file_table_free(items);
+        items = NULL;
+    } else {
+        sort_file_table(items);
+    }
+    xstr_destroy(&path);
+    return items;
+}
+
+/* list the files under <_path> which pass <f>, sorted by path. */
+static file_table_t* list_directory(const char* _path, const filter_t* f, int follnk, sftp_t* sftp)
+{
+    file_table_t* items = file_table_new();
+    xstr_t path;
+
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, _path);
+
+    if (xstr_back(&path) != '/') {
+        xstr_push_back(&path, '/');
+    }
+    if (sftp) {
+        if (iterate_remote_find(items, &path, xstr_size(&path), f, follnk, sftp->ssh) != 0) {
+            iterate_remote_directory(items, &path, xstr_size(&path), f, NULL, follnk,
+                sftp->sftp);
+        }
+    } else {
+#ifdef _WIN32
+        iterate_local_directory(items, &path, xstr_size(&path), f, NULL);
+#else
+        if (scan_threads > 1) {
+            iterate_local_parallel(items, xstr_data(&path), f, follnk, scan_threads);
+        } else if (iterate_local_uring(items, xstr_data(&path), f, follnk) != 0) {
+            iterate_local_directory(items, &path, xstr_size(&path), f, NULL,
+                follnk ? stat : lstat);
+        }
+#endif
+    }
+    sort_file_table(items);
+
+    xstr_destroy(&path);
+    return items;
+}
+
+file_table_t* iterate_directory(const char* path, const ignore_t* ignores, int follnk, sftp_t* sftp)
+{
+    filter_t f = { ignores, NULL };
+
+    return list_directory(path, &f, follnk, sftp);
+}
+
+file_table_t* iterate_files(const char* _path, char* const files[], size_t n,
+        const ignore_t* ignores, int follnk)
+{
+    file_table_t* items = file_table_new();
+    xstr_t path;
+    path_stack_t dirs = { NULL, 0, 0 };
+    const path_node_t* node;
+    size_t off;
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA fattrs;
+#else
+    struct stat st;
+#endif
+
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, _path);
+    if (xstr_back(&path) != '/') {
+        xstr_push_back(&path, '/');
+    }
+    off = xstr_size(&path);
+
+    for (size_t i = 0; i < n; ++i) {
+        xstr_assign_at(&path, off, files[i]);
+#ifdef _WIN32
+        if (!GetFileAttributesExA(xstr_data(&path), GetFileExInfoStandard, &fattrs)) {
+            continue;
+        }
+        if (fattrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            xstr_push_back(&path, '/');
+        }
+        if (ignore_match(ignores, xstr_data(&path) + off)) {
+            continue;
+        }
+        node = new_file_item(items, find_parent_node(items, &dirs, xstr_data(&path) + off),
+                xstr_data(&path) + off, &fattrs);
 #else
-            if ((follnk ? stat(xstr_data(&path), &statbuf)
-                        : lstat(xstr_data(&path), &statbuf)) < 0) {
-                item->is_newer = errno == ENOENT;
-                item->is_exist = 0;
+        if ((follnk ? stat(xstr_data(&path), &st) : lstat(xstr_data(&path), &st)) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            xstr_push_back(&path, '/');
+        }
+        if (ignore_match(ignores, xstr_data(&path) + off)) {
+            continue;
+        }
+        node = new_file_item(items, find_parent_node(items, &dirs, xstr_data(&path) + off),
+                xstr_data(&path) + off, &st);
+#endif
+        if (xstr_back(&path) == '/') {
+            push_path_node(&dirs, node);
+        }
+    }
+    sort_file_table(items);
+
+    xstr_destroy(&path);
+    free(dirs.nodes);
+    return items;
+}
+
+static inline int file_type_equal(int t1, int t2)
+{
+    return (t1 & LIBSSH2_SFTP_S_IFMT) == (t2 & LIBSSH2_SFTP_S_IFMT);
+}
+
+/* set whether the item <i> of <t> is newer and whether its destination exists. */
+static inline void set_extra(file_table_t* t, size_t i, int newer, int exist)
+{
+    t->flags[i] = (uint8_t)((t->flags[i] & ~(FILE_NEWER | FILE_EXIST))
+            | (newer ? FILE_NEWER : 0) | (exist ? FILE_EXIST : 0));
+}
+
+static void set_exist_size(file_table_t* t, size_t i, int mode, uint64_t size, int resume)
+{
+    t->exist_size[i] = 0;
+
+    if (LIBSSH2_SFTP_S_ISREG(t->mode[i]) && file_type_equal(mode, t->mode[i])) {
+        t->exist_size[i] = size;
+        if (resume && size < t->size[i]) {
+            t->flags[i] |= FILE_NEWER;
+        }
+    }
+}
+
+/* find the destination of the same name as <file> but of the other type,
+ * a directory is named with a trailing '/' so it is sorted apart.
+ */
+static int has_other_type(const manifest_t* m, xstr_t* name, const char* file)
+{
+    xstr_assign(name, file);
+    if (xstr_back(name) == '/') {
+        xstr_pop_back(name);
+    } else {
+        xstr_push_back(name, '/');
+    }
+    return manifest_find(m, xstr_data(name)) >= 0;
+}
+
+/* merge the sorted <srcs> with the destination entries in <m>, return -1
+ * if the files in a directory are needed but not in <m>.
+ */
+static int merge_destination(file_table_t* srcs, const manifest_t* m, int resume, int remote)
+{
+    size_t j = 0;
+    xstr_t path, next, name, blocked;
+    int ret = 0;
+
+    xstr_init_ex(&path, 512);
+    xstr_init_ex(&next, 512);
+    xstr_init_ex(&name, 512);
+    xstr_init(&blocked);
+    for (size_t i = 0; i < srcs->count; ++i) {
+        const char* file = file_table_path(srcs, i, &path, 0);
+        int mode = srcs->mode[i];
+        int r = 1;
+
+        while (j < m->count && (r = strcmp(manifest_name(m, j), file)) < 0) {
+            ++j;
+        }
+        if (j < m->count && r == 0) {
+            const manifest_entry_t* dst = &m->entries[j++];
+
+            if ((dst->flags & MANIFEST_UNLISTED) && i + 1 < srcs->count
+                    && !strncmp(file_table_path(srcs, i + 1, &next, 0), file,
+                        xstr_size(&path))) {
+                ret = -1;
+                break;
+            }
+            set_extra(srcs, i, file_type_equal(dst->mode, mode) && dst->mtime < srcs->mtime[i],
+                    1);
+            set_exist_size(srcs, i, dst->mode, dst->size, resume);
+            continue;
+        }
+
+        srcs->exist_size[i] = 0;
+        if (!xstr_empty(&blocked)
+                && !strncmp(file, xstr_data(&blocked), xstr_size(&blocked))) {
+            set_extra(srcs, i, 0, 0);
+        } else if (has_other_type(m, &name, file)) {
+            if (!LIBSSH2_SFTP_S_ISDIR(mode)) {
+                /* a directory is in the way */
+                set_extra(srcs, i, 0, 1);
+            } else if (!remote) {
+                /* a file is in the way, which fails locally with ENOTDIR
+                 * while SFTP reports no such file like a missing one.
+                 */
+                set_extra(srcs, i, 0, 0);
+                xstr_assign(&blocked, file);
             } else {
-                item->is_newer = file_type_equal(statbuf.st_mode, item->mode)
-                        && statbuf.st_mtime < item->mtime;
-                item->is_exist = 1;
+                set_extra(srcs, i, 1, 0);
             }
+        } else {
+            set_extra(srcs, i, 1, 0);
+        }
+    }
+    xstr_destroy(&blocked);
+    xstr_destroy(&name);
+    xstr_destroy(&next);
+    xstr_destroy(&path);
+    return ret;
+}
+
+/* replace the entries of <m> by the listed destination <dsts>, the
+ * directories the source does not have are not listed.
+ */
+static void build_destination(manifest_t* m, const file_table_t* dsts,
+        const file_table_t* srcs)
+{
+    xstr_t path;
+
+    xstr_init_ex(&path, 512);
+    manifest_build_begin(m);
+    for (size_t i = 0; i < dsts->count; ++i) {
+        const char* file = file_table_path(dsts, i, &path, 0);
+        uint32_t flags = 0;
+
+        if (LIBSSH2_SFTP_S_ISDIR(dsts->mode[i]) && find_file_item(srcs, file) < 0) {
+            flags = MANIFEST_UNLISTED;
+        }
+        manifest_build_add(m, file, dsts->mode[i], dsts->mtime[i], dsts->size[i], flags);
+    }
+    manifest_build_end(m);
+    xstr_destroy(&path);
+}
+
+/* set the extra of the item <i> of <t> by the stat of its destination under
+ * <path>.
+ */
+static void stat_destination(file_table_t* t, size_t i, xstr_t* path, size_t off,
+        int follnk, int resume, sftp_t* s)
+{
+    int mode = t->mode[i];
+
+    file_table_path(t, i, path, off);
+    t->exist_size[i] = 0;
+
+    if (s) {
+        LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+        if (libssh2_sftp_stat_ex(s->sftp, xstr_data(path), xstr_size(path),
+                follnk ? LIBSSH2_SFTP_STAT : LIBSSH2_SFTP_LSTAT, &attrs) < 0) {
+            set_extra(t, i, libssh2_sftp_last_error(s->sftp) == LIBSSH2_FX_NO_SUCH_FILE, 0);
+        } else {
+            set_extra(t, i, file_type_equal(attrs.permissions, mode)
+                    && attrs.mtime < t->mtime[i], 1);
+            set_exist_size(t, i, attrs.permissions, attrs.filesize, resume);
+        }
+    } else {
+#ifdef _WIN32
+        WIN32_FILE_ATTRIBUTE_DATA fattrs;
+
+        if (GetFileAttributesExA(xstr_data(path), GetFileExInfoStandard, &fattrs)) {
+            set_extra(t, i, file_type_equal(fattr2mode(fattrs.dwFileAttributes), mode)
+                    && filetime2time(fattrs.ftLastWriteTime) < t->mtime[i], 1);
+            set_exist_size(t, i, fattr2mode(fattrs.dwFileAttributes),
+                (uint64_t)fattrs.nFileSizeHigh << 32 | fattrs.nFileSizeLow, resume);
+        } else {
+            DWORD e = GetLastError();
+            set_extra(t, i, e == ERROR_FILE_NOT_FOUND || e == ERROR_PATH_NOT_FOUND, 0);
+        }
+#else
+        struct stat statbuf;
+
+        if ((follnk ? stat(xstr_data(path), &statbuf)
+                    : lstat(xstr_data(path), &statbuf)) < 0) {
+            set_extra(t, i, errno == ENOENT, 0);
+        } else {
+            set_extra(t, i, file_type_equal(statbuf.st_mode, mode)
+                    && statbuf.st_mtime < t->mtime[i], 1);
+            set_exist_size(t, i, statbuf.st_mode, statbuf.st_size, resume);
+        }
+#endif
+    }
+}
+
+/* stat <verify> percent of <srcs> picked at random on the destination,
+ * return -1 if any gets another result than the merge.
+ */
+static int verify_destination(file_table_t* srcs, int verify, const char* _path,
+        int follnk, int resume, sftp_t* sftp)
+{
+    uint32_t seed = (uint32_t)time(NULL) ^ (uint32_t)srcs->count;
+    xstr_t path;
+    size_t off;
+    int ret = 0;
+
+    if (verify <= 0) {
+        return 0;
+    }
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, _path);
+    xstr_push_back(&path, '/');
+    off = xstr_size(&path);
+
+    for (size_t i = 0; i < srcs->count && ret == 0; ++i) {
+        uint8_t flags = srcs->flags[i];
+        uint64_t exist_size = srcs->exist_size[i];
+
+        /* xorshift32 */
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        if (seed % 100 >= (uint32_t)verify) {
+            continue;
+        }
+        stat_destination(srcs, i, &path, off, follnk, resume, sftp);
+        if (srcs->flags[i] != flags || srcs->exist_size[i] != exist_size) {
+            ret = -1;
+        }
+    }
+
+    xstr_destroy(&path);
+    return ret;
+}
+
+void iterate_directory_setextra(file_table_t* items, const char* path, int follnk,
+        int resume, sftp_t* sftp, manifest_t* m)
+{
+    filter_t f = { NULL, items };
+    manifest_t* dsts = m;
+    file_table_t* dst_items;
+
+    memset(items->flags, 0, items->count * sizeof(uint8_t));
+
+    /* the destination as last synced */
+    if (m && m->loaded && !m->invalid) {
+        if (merge_destination(items, m, resume, !!sftp) == 0
+                && verify_destination(items, m->verify, path, follnk, resume, sftp) == 0) {
+            return;
+        }
+        fprintf(stderr, "the manifest is out of date, list the destination.\n");
+    }
+
+    /* the destination is listed once without the subtrees the source does
+     * not have, then both sorted lists are merged.
+     */
+    dst_items = list_directory(path, &f, follnk, sftp);
+    if (!dsts) {
+        /* an unsaved one holds the listing */
+        dsts = manifest_open("", "", 0);
+    }
+    build_destination(dsts, dst_items, items);
+    file_table_free(dst_items);
+
+    merge_destination(items, dsts, resume, !!sftp);
+
+    if (dsts != m) {
+        manifest_close(dsts);
+    }
+}
+
+void iterate_directory_stat(file_table_t* items, const char* _path, int follnk,
+        int resume, sftp_t* sftp)
+{
+    xstr_t path;
+    size_t off;
+
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, _path);
+    xstr_push_back(&path, '/');
+    off = xstr_size(&path);
+
+    for (size_t i = 0; i < items->count; ++i) {
+        items->flags[i] &= ~FILE_DONE;
+        stat_destination(items, i, &path, off, follnk, resume, sftp);
+    }
+    xstr_destroy(&path);
+}
+
+/* an item of one directory to be sorted by name */
+typedef struct {
+    const char* name;
+    size_t i;
+} sibling_t;
+
+static int cmp_sibling(const void* l, const void* r)
+{
+    return strcmp(((const sibling_t*)l)->name, ((const sibling_t*)r)->name);
+}
+
+/* sort the items of <t> from <first> on, all in one directory, by name. */
+static void sort_siblings(file_table_t* t, size_t first)
+{
+    size_t n = t->count - first;
+    sibling_t* sibs;
+    size_t* ord;
+
+    if (n < 2) {
+        return;
+    }
+    sibs = malloc(n * sizeof(sibling_t));
+    ord = malloc(n * sizeof(size_t));
+    for (size_t i = 0; i < n; ++i) {
+        sibs[i].name = t->node[first + i]->name;
+        sibs[i].i = first + i;
+    }
+    qsort(sibs, n, sizeof(sibling_t), cmp_sibling);
+    for (size_t i = 0; i < n; ++i) {
+        ord[i] = sibs[i].i;
+    }
+    file_table_permute(t, first, ord);
+    free(ord);
+    free(sibs);
+}
+
+/* binary search <name> in <t> sorted by the names of the same directory,
+ * return its index or -1.
+ */
+static ptrdiff_t find_sibling(const file_table_t* t, const char* name)
+{
+    size_t lo = 0, hi = t->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int r = strcmp(t->node[mid]->name, name);
+
+        if (r == 0) {
+            return (ptrdiff_t)mid;
+        }
+        if (r < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+/* list the files in the directory <path> under <parent>, but not the ones
+ * in its subdirectories, and sort them by name.
+ */
+static void list_one_directory(file_table_t* items, xstr_t* path, size_t baseoff,
+        const ignore_t* ignores, const path_node_t* parent, int follnk, sftp_t* sftp)
+{
+    file_table_t none = { 0 };
+    /* an empty <dirs>, none is descended */
+    filter_t f = { ignores, &none };
+    size_t first = items->count;
+
+    if (sftp) {
+        iterate_remote_directory(items, path, baseoff, &f, parent, follnk, sftp->sftp);
+    } else {
+#ifdef _WIN32
+        iterate_local_directory(items, path, baseoff, &f, parent);
+#else
+        iterate_local_directory(items, path, baseoff, &f, parent, follnk ? stat : lstat);
 #endif
+    }
+    sort_siblings(items, first);
+}
+
+/* the state of <iterate_directory_stream> */
+typedef struct {
+    const ignore_t* ignores;
+    int follnk;
+    int resume;
+    int reverse;
+    sftp_t* sftp;
+    xstr_t spath;
+    xstr_t dpath;
+    size_t soff;
+    size_t doff;
+    xstr_t name;
+    file_table_t* dsts;     /* the destination of the last listed directory */
+    file_table_t* dall;     /* the whole destination if listed by find(1) */
+} streamer_t;
+
+/* a listed directory, its items are passed in order up to the next
+ * subdirectory, which is walked before the rest of them.
+ */
+typedef struct {
+    file_table_t* items;
+    size_t next;
+    int blocked;            /* a local file is in the way, nothing under it is done */
+} stream_dir_t;
+
+/* find the destination of <node> in the directory listed last, or the one
+ * of the other type if <other>, a directory for a file and vice versa.
+ * return the table it is in and its index in <e>, or NULL.
+ */
+static const file_table_t* find_stream_dst(streamer_t* s, const path_node_t* node,
+        int other, ptrdiff_t* e)
+{
+    const file_table_t* t = s->dall ? s->dall : s->dsts;
+
+    xstr_clear(&s->name);
+    if (s->dall) {
+        append_path(&s->name, node);
+    } else {
+        xstr_append(&s->name, node->name);
+    }
+    if (other) {
+        if (xstr_back(&s->name) == '/') {
+            xstr_pop_back(&s->name);
+        } else {
+            xstr_push_back(&s->name, '/');
+        }
+    }
+    *e = s->dall ? find_file_item(t, xstr_data(&s->name))
+            : find_sibling(t, xstr_data(&s->name));
+    return *e >= 0 ? t : NULL;
+}
+
+/* list the directory <node> of the source, and of the destination if it
+ * <exist>s, and set the extra of the source items by it.
+ */
+static file_table_t* list_stream_dir(streamer_t* s, const path_node_t* node, int exist,
+        int blocked)
+{
+    file_table_t* items = file_table_new();
+
+    xstr_erase_after(&s->spath, s->soff);
+    xstr_erase_after(&s->dpath, s->doff);
+    if (node) {
+        append_path(&s->spath, node);
+        append_path(&s->dpath, node);
+    }
+    list_one_directory(items, &s->spath, s->soff, s->ignores, node, s->follnk,
+        s->reverse ? s->sftp : NULL);
+    file_table_clear(s->dsts);
+    if (exist && !s->dall) {
+        list_one_directory(s->dsts, &s->dpath, s->doff, NULL, node, s->follnk,
+            s->reverse ? NULL : s->sftp);
+    }
+
+    /* the same as <merge_destination> within one directory */
+    for (size_t i = 0; i < items->count; ++i) {
+        ptrdiff_t e;
+        const file_table_t* t = exist ? find_stream_dst(s, items->node[i], 0, &e) : NULL;
+
+        if (t) {
+            set_extra(items, i, file_type_equal(t->mode[e], items->mode[i])
+                    && t->mtime[e] < items->mtime[i], 1);
+            set_exist_size(items, i, t->mode[e], t->size[e], s->resume);
+            continue;
+        }
+        items->exist_size[i] = 0;
+        set_extra(items, i, !blocked, 0);
+        if (blocked) {
+            continue;
+        }
+        if (exist && find_stream_dst(s, items->node[i], 1, &e)) {
+            if (!LIBSSH2_SFTP_S_ISDIR(items->mode[i])) {
+                /* a directory is in the way */
+                set_extra(items, i, 0, 1);
+            } else if (s->reverse) {
+                /* a local file is in the way, nothing under it is done */
+                set_extra(items, i, 0, 0);
+            }
+        }
+    }
+    return items;
+}
+
+void iterate_directory_stream(const char* src, const char* dst,
+        const ignore_t* ignores, int follnk, int resume, int reverse, sftp_t* sftp,
+        iterate_stream_cb cb, void* arg)
+{
+    streamer_t s;
+    stream_dir_t* dirs;
+    size_t ndirs = 0;
+    size_t cap = 64;
+    filter_t f = { ignores, NULL };
+
+    /* the remote side is listed by one find(1) if it can, which is faster
+     * than one directory at a time. as the source, it is compared and
+     * passed as a whole, as the destination, each listed directory of the
+     * source looks up its files in it.
+     */
+    if (sftp && reverse) {
+        file_table_t* items = find_directory(src, &f, follnk, sftp);
+
+        if (items) {
+            iterate_directory_setextra(items, dst, follnk, resume, NULL, NULL);
+            if (items->count > 0) {
+                cb(items, 0, items->count, arg);
+            }
+            file_table_free(items);
+            return;
+        }
+    }
+    f.ignores = NULL;
+
+    s.ignores = ignores;
+    s.follnk = follnk;
+    s.resume = resume;
+    s.reverse = reverse;
+    s.sftp = sftp;
+    xstr_init_ex(&s.spath, 512);
+    xstr_append(&s.spath, src);
+    if (xstr_back(&s.spath) != '/') {
+        xstr_push_back(&s.spath, '/');
+    }
+    s.soff = xstr_size(&s.spath);
+    xstr_init_ex(&s.dpath, 512);
+    xstr_append(&s.dpath, dst);
+    if (xstr_back(&s.dpath) != '/') {
+        xstr_push_back(&s.dpath, '/');
+    }
+    s.doff = xstr_size(&s.dpath);
+    xstr_init_ex(&s.name, 256);
+    s.dsts = file_table_new();
+    s.dall = sftp && !reverse ? find_directory(dst, &f, follnk, sftp) : NULL;
+
+    dirs = malloc(cap * sizeof(stream_dir_t));
+    dirs[0].items = list_stream_dir(&s, NULL, 1, 0);
+    dirs[0].next = 0;
+    dirs[0].blocked = 0;
+    ndirs = 1;
+    while (ndirs > 0) {
+        stream_dir_t* d = &dirs[ndirs - 1];
+        ptrdiff_t sub = -1;
+        size_t first = d->next;
+        const path_node_t* node;
+        int blocked, exist;
+
+        while (sub < 0 && d->next < d->items->count) {
+            size_t i = d->next++;
+
+            if (LIBSSH2_SFTP_S_ISDIR(d->items->mode[i])
+                    && !ignore_prunes(ignores, file_table_path(d->items, i, &s.name, 0))) {
+                sub = (ptrdiff_t)i;
+            }
+        }
+        if (d->next > first) {
+            cb(d->items, first, d->next, arg);
+        }
+        if (sub < 0) {
+            file_table_free(d->items);
+            --ndirs;
+            continue;
+        }
+
+        /* the nodes of <d> are the parents of the ones under <sub> */
+        node = d->items->node[sub];
+        exist = !!(d->items->flags[sub] & FILE_EXIST);
+        blocked = d->blocked || !(d->items->flags[sub] & (FILE_NEWER | FILE_EXIST));
+        if (ndirs == cap) {
+            cap *= 2;
+            dirs = realloc(dirs, cap * sizeof(stream_dir_t));
+        }
+        dirs[ndirs].items = list_stream_dir(&s, node, exist && !blocked, blocked);
+        dirs[ndirs].next = 0;
+        dirs[ndirs].blocked = blocked;
+        ++ndirs;
+    }
+
+    file_table_free(s.dsts);
+    if (s.dall) {
+        file_table_free(s.dall);
+    }
+    xstr_destroy(&s.name);
+    xstr_destroy(&s.dpath);
+    xstr_destroy(&s.spath);
+    free(dirs);
+}
+
+/* the items merged at once by <iterate_listing_next> */
+#define LISTING_BATCH   1024
+
+struct listing {
+    spill_t* srcs;
+    spill_t* dsts;
+    int resume;
+    int reverse;
+    file_table_t* items;    /* the last merged ones */
+    spill_entry_t dst;      /* the next destination */
+    int dend;               /* <dst> is past the end, or -1 if it fails */
+    xstr_t prev;            /* the destination before <dst> */
+    xstr_t blocked;
+};
+
+/* a directory to be listed by <spill_tree> */
+typedef struct {
+    char* dir;      /* relative path ending with '/', "" for the top */
+    int exist;      /* the destination has it */
+} spill_dir_t;
+
+/* put the listed names of <t> in the directory <dir> into <s>. */
+static int spill_items(spill_t* s, const file_table_t* t, xstr_t* dir)
+{
+    size_t off = xstr_size(dir);
+    int ret = 0;
+
+    for (size_t i = 0; i < t->count && ret == 0; ++i) {
+        xstr_append_ex(dir, t->node[i]->name, t->node[i]->len);
+        ret = spill_add(s, xstr_data(dir), xstr_size(dir), t->mode[i], t->mtime[i], t->size[i]);
+        xstr_erase_after(dir, off);
+    }
+    return ret;
+}
+
+/* walk <src> and <dst> together, one directory of each in memory. */
+static int spill_tree(listing_t* l, const char* src, const char* dst,
+        const ignore_t* ignores, int follnk, sftp_t* sftp)
+{
+    file_table_t* srcs = file_table_new();
+    file_table_t* dsts = file_table_new();
+    spill_dir_t* dirs = malloc(64 * sizeof(spill_dir_t));
+    size_t ndirs = 0;
+    size_t cap = 64;
+    xstr_t spath, dpath, dir;
+    size_t soff, doff;
+    int ret = 0;
+
+    xstr_init_ex(&spath, 512);
+    xstr_append(&spath, src);
+    if (xstr_back(&spath) != '/') {
+        xstr_push_back(&spath, '/');
+    }
+    soff = xstr_size(&spath);
+    xstr_init_ex(&dpath, 512);
+    xstr_append(&dpath, dst);
+    if (xstr_back(&dpath) != '/') {
+        xstr_push_back(&dpath, '/');
+    }
+    doff = xstr_size(&dpath);
+    xstr_init_ex(&dir, 512);
+
+    dirs[ndirs].dir = strdup("");
+    dirs[ndirs++].exist = 1;
+    while (ndirs > 0) {
+        spill_dir_t d = dirs[--ndirs];
+
+        if (ret != 0) {
+            free(d.dir);
+            continue;
+        }
+        xstr_assign_at(&spath, soff, d.dir);
+        xstr_assign_at(&dpath, doff, d.dir);
+        file_table_clear(srcs);
+        list_one_directory(srcs, &spath, soff, ignores, NULL, follnk, l->reverse ? sftp : NULL);
+        file_table_clear(dsts);
+        if (d.exist) {
+            list_one_directory(dsts, &dpath, doff, NULL, NULL, follnk, l->reverse ? NULL : sftp);
+        }
+
+        xstr_assign(&dir, d.dir);
+        ret = spill_items(l->srcs, srcs, &dir);
+        if (ret == 0) {
+            ret = spill_items(l->dsts, dsts, &dir);
+        }
+        for (size_t i = 0; i < srcs->count && ret == 0; ++i) {
+            const path_node_t* node = srcs->node[i];
+
+            if (!LIBSSH2_SFTP_S_ISDIR(srcs->mode[i])) {
+                continue;
+            }
+            xstr_assign(&dir, d.dir);
+            xstr_append_ex(&dir, node->name, node->len);
+            if (ignore_prunes(ignores, xstr_data(&dir))) {
+                continue;
+            }
+            if (ndirs == cap) {
+                cap *= 2;
+                dirs = realloc(dirs, cap * sizeof(spill_dir_t));
+            }
+            dirs[ndirs].dir = strdup(xstr_data(&dir));
+            dirs[ndirs++].exist = d.exist && find_sibling(dsts, node->name) >= 0;
+        }
+        free(d.dir);
+    }
+
+    xstr_destroy(&dir);
+    xstr_destroy(&dpath);
+    xstr_destroy(&spath);
+    free(dirs);
+    file_table_free(dsts);
+    file_table_free(srcs);
+    return ret;
+}
+
+listing_t* iterate_listing_open(const char* src, const char* dst, const ignore_t* ignores,
+        int follnk, int resume, int reverse, sftp_t* sftp, size_t budget)
+{
+    listing_t* l = calloc(1, sizeof(listing_t));
+
+    l->resume = resume;
+    l->reverse = reverse;
+    l->items = file_table_new();
+    xstr_init_ex(&l->prev, 512);
+    xstr_init(&l->blocked);
+
+    /* the budget is shared by both sides */
+    l->srcs = spill_open(budget / 2);
+    l->dsts = l->srcs ? spill_open(budget / 2) : NULL;
+    if (!l->dsts || spill_tree(l, src, dst, ignores, follnk, sftp) != 0
+            || iterate_listing_rewind(l) != 0) {
+        iterate_listing_close(l);
+        return NULL;
+    }
+    return l;
+}
+
+int iterate_listing_rewind(listing_t* l)
+{
+    if (spill_rewind(l->srcs) != 0 || spill_rewind(l->dsts) != 0) {
+        return -1;
+    }
+    l->dend = spill_next(l->dsts, &l->dst);
+    xstr_clear(&l->prev);
+    xstr_clear(&l->blocked);
+    return l->dend < 0 ? -1 : 0;
+}
+
+/* check if <dir> is the directory of the same name as the file <file>. */
+static inline int is_dir_of(const char* dir, size_t dlen, const char* file, size_t flen)
+{
+    return dlen == flen + 1 && dir[flen] == '/' && !memcmp(dir, file, flen);
+}
+
+int iterate_listing_next(listing_t* l, file_table_t** items)
+{
+    spill_entry_t src;
+    int ret = 0;
+
+    file_table_clear(l->items);
+    while (l->items->count < LISTING_BATCH && (ret = spill_next(l->srcs, &src)) == 0) {
+        size_t i = file_table_add(l->items, new_path_node(l->items, NULL, src.path, src.len),
+                src.mode, src.mtime, src.size);
+        int r = 1;
+
+        /* both are sorted, "x/" comes right after "x" */
+        while (l->dend == 0 && (r = spill_cmp_path(l->dst.path, src.path)) < 0) {
+            xstr_assign(&l->prev, l->dst.path);
+            l->dend = spill_next(l->dsts, &l->dst);
         }
+        if (l->dend < 0) {
+            return -1;
+        }
+        if (l->dend == 0 && r == 0) {
+            set_extra(l->items, i, file_type_equal(l->dst.mode, src.mode)
+                    && l->dst.mtime < src.mtime, 1);
+            set_exist_size(l->items, i, l->dst.mode, l->dst.size, l->resume);
+            continue;
+        }
+
+        /* the same as <merge_destination> */
+        set_extra(l->items, i, 1, 0);
+        if (!xstr_empty(&l->blocked)
+                && !strncmp(src.path, xstr_data(&l->blocked), xstr_size(&l->blocked))) {
+            set_extra(l->items, i, 0, 0);
+        } else if (!LIBSSH2_SFTP_S_ISDIR(src.mode)) {
+            if (l->dend == 0 && is_dir_of(l->dst.path, l->dst.len, src.path, src.len)) {
+                /* a directory is in the way */
+                set_extra(l->items, i, 0, 1);
+            }
+        } else if (l->reverse
+                && is_dir_of(src.path, src.len, xstr_data(&l->prev), xstr_size(&l->prev))) {
+            /* a local file is in the way, nothing under it is done */
+            set_extra(l->items, i, 0, 0);
+            xstr_assign(&l->blocked, src.path);
+        }
+    }
+    if (ret < 0) {
+        return -1;
+    }
+    if (l->items->count == 0) {
+        return 1;
+    }
+    *items = l->items;
+    return 0;
+}
+
+void iterate_listing_close(listing_t* l)
+{
+    if (l->dsts) {
+        spill_close(l->dsts);
+    }
+    if (l->srcs) {
+        spill_close(l->srcs);
+    }
+    xstr_destroy(&l->blocked);
+    xstr_destroy(&l->prev);
+    file_table_free(l->items);
+    free(l);
+}
+
+void iterate_directory_record(file_table_t* items, manifest_t* m, time_t start)
+{
+    size_t j = 0;
+    xstr_t path;
+
+    for (size_t i = 0; i < items->count; ++i) {
+        if ((items->flags[i] & (FILE_NEWER | FILE_DONE)) == FILE_NEWER
+                && get_ftype_str(items->mode[i])) {
+            /* a failed transfer leaves the destination unknown */
+            manifest_invalidate(m);
+            return;
+        }
+    }
+
+    xstr_init_ex(&path, 512);
+    manifest_build_begin(m);
+    for (size_t i = 0; i < items->count; ++i) {
+        const char* file;
+        uint32_t flags = 0;
+
+        if (!(items->flags[i] & FILE_DONE)) {
+            continue;
+        }
+        file = file_table_path(items, i, &path, 0);
+        for (; j < m->count; ++j) {
+            const manifest_entry_t* e = &m->entries[j];
+            int r = strcmp(manifest_name(m, j), file);
+
+            if (r >= 0) {
+                if (r == 0) {
+                    flags = e->flags;
+                    ++j;
+                }
+                break;
+            }
+            manifest_build_add(m, manifest_name(m, j), e->mode, e->mtime, e->size, e->flags);
+        }
+        /* the destination is written after <start>, a source changed since
+         * then is still newer than it.
+         */
+        manifest_build_add(m, file, items->mode[i], start,
+            LIBSSH2_SFTP_S_ISREG(items->mode[i]) ? items->size[i] : 0, flags);
+    }
+    for (; j < m->count; ++j) {
+        const manifest_entry_t* e = &m->entries[j];
+
+        manifest_build_add(m, manifest_name(m, j), e->mode, e->mtime, e->size, e->flags);
     }
+    manifest_build_end(m);
 
     xstr_destroy(&path);
 }
 
-void iterate_directory_free(xlist_t* items)
+void iterate_directory_free(file_table_t* items)
 {
-    xlist_free(items);
+    file_table_free(items);
 }
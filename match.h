@@ -1,29 +1,148 @@
 #ifndef _MATCH_H_
 #define _MATCH_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 #include <libssh2_sftp.h>
 
-#include "xlist.h"
+#include "ignore.h"
+#include "manifest.h"
+#include "ssh_session.h"
+#include "xstring.h"
 
+/* the listed paths are kept as a tree of names, a path is the names from
+ * the top to its node.
+ */
+typedef struct path_node {
+    const struct path_node* parent; /* NULL at the top */
+    uint32_t depth;                 /* 1 at the top */
+    uint32_t len;
+    char name[];                    /* ends with '/' for a directory */
+} path_node_t;
+
+/* one item taken out of a table, e.g. a file to transfer */
 typedef struct {
-    char* file;
+    const path_node_t* node;
     int mode;
+    /* extra */
+    unsigned is_newer : 1;
+    unsigned is_exist : 1;
+    unsigned is_done : 1;   /* transferred successfully */
     time_t mtime;
     uint64_t size;
-    /* extra */
-    int is_newer;
-    int is_exist;
+    uint64_t exist_size;    /* size of the existing regular file, or 0 */
 } file_item_t;
 
-/* <ignores> is shell-style pattern strings, e.g. "*.[ch]", "*.?", "*.[a-z]".
- * for compatibility, '\' is not recognized as file separator on Windows.
+/* the extra of an item in a table */
+#define FILE_NEWER      0x01
+#define FILE_EXIST      0x02
+#define FILE_DONE       0x04    /* transferred successfully */
+
+/* the listed items sorted by path, each field is kept in its own array, so
+ * a pass over a few fields of all items reads only those. the path nodes
+ * are kept in blocks owned by the table.
+ */
+typedef struct {
+    const path_node_t** node;
+    int* mode;
+    time_t* mtime;
+    uint64_t* size;
+    uint64_t* exist_size;   /* size of the existing regular file, or 0 */
+    uint8_t* flags;         /* FILE_xxx */
+    size_t count;
+    size_t cap;
+    struct path_block* blocks;
+} file_table_t;
+
+/* copy the item <i> of <t> into <item>. */
+void file_table_get(const file_table_t* t, size_t i, file_item_t* item);
+
+/* set the threads to list a local directory, the default is 1. */
+void iterate_set_threads(int threads);
+
+/* <ignores> is the compiled shell-style patterns, e.g. "*.[ch]", "*.?",
+ * "*.[a-z]", may be NULL. for compatibility, '\' is not recognized as file
+ * separator on Windows.
+ * a remote directory is listed by one find(1) if the remote shell can run
+ * GNU find, otherwise by SFTP.
+ */
+file_table_t* iterate_directory(const char* path, const ignore_t* ignores,
+        int follnk, sftp_t* sftp);
+/* compare the sorted <items> with the files under <path>, which is listed
+ * once and merged with <items>. with <resume>, an existing regular file
+ * shorter than the one in <items> is taken as an interrupted transfer and
+ * always newer. if <m> is loaded, it is used instead of the listing after
+ * <m->verify> percent of <items> are checked, otherwise it gets the listing.
+ */
+void iterate_directory_setextra(file_table_t* items, const char* path,
+        int follnk, int resume, sftp_t* sftp, manifest_t* m);
+/* same as <iterate_directory_setextra> but stat the files one by one, it
+ * is faster for a few <items>.
+ */
+void iterate_directory_stat(file_table_t* items, const char* path,
+        int follnk, int resume, sftp_t* sftp);
+/* called by <iterate_directory_stream> with the items of one directory
+ * from <first> to <last>, which are valid only in the call.
+ */
+typedef void (*iterate_stream_cb)(file_table_t* items, size_t first, size_t last, void* arg);
+
+/* list <src> and compare it with <dst> one directory at a time, the items
+ * are passed to <cb> in the order of <iterate_directory> while they are
+ * listed, each directory before the files in it. the entries of a
+ * directory are sorted as they are read and the walk descends in that
+ * order, only the directories on the way down are kept. <src> is the remote
+ * one if <reverse>. the local side is listed by one thread. the remote side
+ * is listed at once by one find(1) if it can run it, then a remote <src> is
+ * compared and passed as a whole, otherwise it is listed by SFTP one
+ * directory at a time as well.
+ */
+void iterate_directory_stream(const char* src, const char* dst,
+        const ignore_t* ignores, int follnk, int resume, int reverse, sftp_t* sftp,
+        iterate_stream_cb cb, void* arg);
+/* the listing of a whole tree kept within a memory budget. */
+typedef struct listing listing_t;
+
+/* list <src> and <dst> one directory at a time, the destination only where
+ * the source has the same directory. the entries are sorted in runs of
+ * <budget> bytes, which are spilled to temporary files, so the memory does
+ * not grow with the tree but with the largest directory. <src> is the
+ * remote one if <reverse>. return NULL if it fails.
+ */
+listing_t* iterate_listing_open(const char* src, const char* dst, const ignore_t* ignores,
+        int follnk, int resume, int reverse, sftp_t* sftp, size_t budget);
+/* merge the next items of the source with the destination by the rules of
+ * <iterate_directory_setextra>, a directory comes before the files in it.
+ * <items> is valid until the next call. return 1 at the end, -1 if the
+ * spilled runs can not be read.
+ */
+int iterate_listing_next(listing_t* l, file_table_t** items);
+/* read the items from the first one again, return 0 on success. */
+int iterate_listing_rewind(listing_t* l);
+void iterate_listing_close(listing_t* l);
+
+/* put the transferred <items> into <m>, which is dropped if any failed.
+ * <start> is the time the transfer started.
  */
-xlist_t* iterate_directory(const char* path, char* const ignores[],
-        int follnk, LIBSSH2_SFTP* sftp);
-void iterate_directory_setextra(xlist_t* items, const char* path,
-        int follnk, LIBSSH2_SFTP* sftp);
-void iterate_directory_free(xlist_t* items);
+void iterate_directory_record(file_table_t* items, manifest_t* m, time_t start);
+
+/* list <n> <files> relative to local <path>, the missing and ignored ones
+ * are left out, a directory itself is listed without the files in it.
+ */
+file_table_t* iterate_files(const char* path, char* const files[], size_t n,
+        const ignore_t* ignores, int follnk);
+
+void iterate_directory_free(file_table_t* items);
+
+/* put the relative path of <item> into <path> after <off>, return the data
+ * of <path>. <file_table_path> is the same for the item <i> of <t>.
+ */
+const char* file_item_path(const file_item_t* item, xstr_t* path, size_t off);
+const char* file_table_path(const file_table_t* t, size_t i, xstr_t* path, size_t off);
+/* return the length of the relative path of <item>. */
+size_t file_item_path_len(const file_item_t* item);
+
+/* return "REG", "DIR" or "LNK", NULL if the file type is not supported. */
+const char* get_ftype_str(int mode);
 
 #endif // _MATCH_H_
\ No newline at end of file
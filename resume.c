@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mbedtls/sha256.h>
+
+#include "resume.h"
+
+#define RESUME_BLOCK_SIZE   (1024 * 1024)
+#define SHA256_HEX_LEN      64
+
+static void sha256_hex(const char* data, size_t size, char* hex)
+{
+    static const char digits[] = "0123456789abcdef";
+    unsigned char hash[32];
+
+    mbedtls_sha256_ret((const unsigned char*)data, size, hash, 0);
+    for (int i = 0; i < 32; ++i) {
+        hex[i * 2] = digits[hash[i] >> 4];
+        hex[i * 2 + 1] = digits[hash[i] & 0xf];
+    }
+    hex[SHA256_HEX_LEN] = '\0';
+}
+
+uint64_t resume_offset(ssh_t* ssh, const char* local, const char* remote, uint64_t length)
+{
+    const uint64_t nblocks = length / RESUME_BLOCK_SIZE;
+    uint64_t good = 0;
+    ssh_exec_t* e;
+    FILE* fp;
+    char* buf;
+    xstr_t cmd;
+    char line[128];
+    char hex[SHA256_HEX_LEN + 1];
+
+    if (nblocks == 0) {
+        return 0;
+    }
+    fp = fopen(local, "rb");
+    if (!fp) {
+        return 0;
+    }
+
+    /* one line of "<sha256>  -" per block, only dd and sha256sum are
+     * needed on the remote host.
+     */
+    xstr_init_ex(&cmd, 256);
+    snprintf(line, sizeof(line), "n=%llu; i=0; while [ $i -lt $n ]; do dd if=",
+        (unsigned long long)nblocks);
+    xstr_append(&cmd, line);
+    ssh_quote_arg(&cmd, remote);
+    snprintf(line, sizeof(line), " bs=%d skip=$i count=1 2>/dev/null"
+        " | sha256sum || exit 1; i=$((i+1)); done", RESUME_BLOCK_SIZE);
+    xstr_append(&cmd, line);
+
+    e = ssh_exec_open(ssh, xstr_data(&cmd));
+    xstr_destroy(&cmd);
+    if (!e) {
+        fclose(fp);
+        return 0;
+    }
+
+    buf = malloc(RESUME_BLOCK_SIZE);
+    while (good < nblocks) {
+        if (ssh_exec_gets(e, line, sizeof(line)) != 0
+                || fread(buf, 1, RESUME_BLOCK_SIZE, fp) != RESUME_BLOCK_SIZE) {
+            break;
+        }
+        sha256_hex(buf, RESUME_BLOCK_SIZE, hex);
+        if (strncmp(line, hex, SHA256_HEX_LEN) != 0) {
+            break;
+        }
+        ++good;
+    }
+    free(buf);
+
+    if (good < nblocks) {
+        ssh_exec_abort(e);
+    } else {
+        ssh_exec_close(e);
+    }
+    fclose(fp);
+    return good * RESUME_BLOCK_SIZE;
+}
@@ -0,0 +1,15 @@
+#ifndef _RESUME_H_
+#define _RESUME_H_
+
+#include <stdint.h>
+
+#include "ssh_session.h"
+
+/* compare the first <length> bytes of <local> and <remote> block by block
+ * with SHA-256, the remote hashes are computed by the remote shell. return
+ * the size of the equal blocks at the beginning, from where the transfer
+ * can go on, 0 if nothing matches or it can not be checked.
+ */
+uint64_t resume_offset(ssh_t* ssh, const char* local, const char* remote, uint64_t length);
+
+#endif // _RESUME_H_
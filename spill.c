@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spill.h"
+
+/* a run is read through a buffer of at least this size, the runs merged at
+ * once are limited by the budget.
+ */
+#define SPILL_READ_MIN      (16 * 1024)
+#define SPILL_WRITE_SIZE    (64 * 1024)
+
+/* an entry in memory and in the file, the path follows with a '\0', it is
+ * padded to 8 bytes.
+ */
+typedef struct {
+    uint32_t len;
+    int32_t mode;
+    int64_t mtime;
+    uint64_t size;
+} spill_rec_t;
+
+typedef union {
+    size_t off;                 /* in <buf> while adding */
+    const spill_rec_t* rec;     /* while sorted */
+} spill_slot_t;
+
+/* a sorted run in the file being read */
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t off;       /* the next byte to read */
+    char* buf;
+    size_t pos;         /* the current record in <buf> */
+    size_t len;         /* bytes read into <buf> */
+    size_t cap;
+} spill_run_t;
+
+struct spill {
+    size_t budget;
+    FILE* fp;
+    uint64_t fend;      /* the end of the written runs */
+    int sealed;         /* no more entries are added */
+    /* the entries in memory */
+    char* buf;
+    size_t used;
+    size_t cap;
+    spill_slot_t* slots;
+    size_t nslots;
+    size_t slotcap;
+    size_t next;        /* the next slot to read if there is no run */
+    /* the runs in the file */
+    spill_run_t* runs;
+    size_t nruns;
+    size_t runcap;
+    size_t* heap;       /* the runs being merged, by their current record */
+    size_t nheap;
+    int top;            /* the record of heap[0] is returned */
+    char* wbuf;
+    size_t wlen;
+};
+
+static inline size_t rec_size(size_t len)
+{
+    return (sizeof(spill_rec_t) + len + 1 + 7) & ~(size_t)7;
+}
+
+static inline const char* rec_path(const spill_rec_t* rec)
+{
+    return (const char*)(rec + 1);
+}
+
+static inline int path_byte(unsigned char c)
+{
+    return c == '/' ? 1 : (c && c < '/' ? c + 1 : c);
+}
+
+int spill_cmp_path(const char* a, const char* b)
+{
+    while (*a && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return path_byte((unsigned char)*a) - path_byte((unsigned char)*b);
+}
+
+static int cmp_slot(const void* l, const void* r)
+{
+    return spill_cmp_path(rec_path(((const spill_slot_t*)l)->rec),
+                rec_path(((const spill_slot_t*)r)->rec));
+}
+
+static int seek_spill_file(FILE* fp, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static int flush_write(spill_t* s)
+{
+    if (s->wlen > 0) {
+        if (seek_spill_file(s->fp, s->fend) != 0 || fwrite(s->wbuf, s->wlen, 1, s->fp) != 1) {
+            fprintf(stderr, "write the spilled listing failed (%s).\n", strerror(errno));
+            return -1;
+        }
+        s->fend += s->wlen;
+        s->wlen = 0;
+    }
+    return 0;
+}
+
+/* append <n> bytes to the end of the file. */
+static int spill_write(spill_t* s, const void* data, size_t n)
+{
+    while (n > 0) {
+        size_t k = SPILL_WRITE_SIZE - s->wlen < n ? SPILL_WRITE_SIZE - s->wlen : n;
+
+        memcpy(s->wbuf + s->wlen, data, k);
+        s->wlen += k;
+        data = (const char*)data + k;
+        n -= k;
+        if (s->wlen == SPILL_WRITE_SIZE && flush_write(s) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void add_run(spill_t* s, uint64_t off, uint64_t end)
+{
+    if (s->nruns == s->runcap) {
+        s->runcap = s->runcap ? s->runcap * 2 : 16;
+        s->runs = realloc(s->runs, s->runcap * sizeof(spill_run_t));
+    }
+    memset(&s->runs[s->nruns], 0, sizeof(spill_run_t));
+    s->runs[s->nruns].start = off;
+    s->runs[s->nruns++].end = end;
+}
+
+/* sort the entries in memory, their slots point to the records then. */
+static void sort_slots(spill_t* s)
+{
+    for (size_t i = 0; i < s->nslots; ++i) {
+        s->slots[i].rec = (const spill_rec_t*)(s->buf + s->slots[i].off);
+    }
+    qsort(s->slots, s->nslots, sizeof(spill_slot_t), cmp_slot);
+}
+
+/* write the entries in memory as a sorted run. */
+static int write_run(spill_t* s)
+{
+    uint64_t off = s->fend;
+
+    sort_slots(s);
+    for (size_t i = 0; i < s->nslots; ++i) {
+        if (spill_write(s, s->slots[i].rec, rec_size(s->slots[i].rec->len)) != 0) {
+            return -1;
+        }
+    }
+    if (flush_write(s) != 0) {
+        return -1;
+    }
+    add_run(s, off, s->fend);
+    s->used = 0;
+    s->nslots = 0;
+    return 0;
+}
+
+spill_t* spill_open(size_t budget)
+{
+    spill_t* s = calloc(1, sizeof(spill_t));
+
+    s->fp = tmpfile();
+    if (!s->fp) {
+        fprintf(stderr, "create the temporary file failed (%s).\n", strerror(errno));
+        free(s);
+        return NULL;
+    }
+    s->budget = budget;
+    s->wbuf = malloc(SPILL_WRITE_SIZE);
+    return s;
+}
+
+void spill_close(spill_t* s)
+{
+    for (size_t i = 0; i < s->nruns; ++i) {
+        free(s->runs[i].buf);
+    }
+    fclose(s->fp);
+    free(s->heap);
+    free(s->runs);
+    free(s->slots);
+    free(s->buf);
+    free(s->wbuf);
+    free(s);
+}
+
+int spill_add(spill_t* s, const char* path, size_t len, int mode, time_t mtime,
+        uint64_t size)
+{
+    size_t n = rec_size(len);
+    spill_rec_t* rec;
+
+    if (s->nslots > 0
+            && s->used + n + (s->nslots + 1) * sizeof(spill_slot_t) > s->budget
+            && write_run(s) != 0) {
+        return -1;
+    }
+    if (s->cap - s->used < n) {
+        s->cap = s->cap ? s->cap * 2 : 64 * 1024;
+        if (s->cap > s->budget) {
+            s->cap = s->budget;
+        }
+        if (s->cap < s->used + n) {
+            s->cap = s->used + n;
+        }
+        s->buf = realloc(s->buf, s->cap);
+    }
+    if (s->nslots == s->slotcap) {
+        s->slotcap = s->slotcap ? s->slotcap * 2 : 1024;
+        s->slots = realloc(s->slots, s->slotcap * sizeof(spill_slot_t));
+    }
+
+    rec = (spill_rec_t*)(s->buf + s->used);
+    memset(rec, 0, n);
+    rec->len = (uint32_t)len;
+    rec->mode = mode;
+    rec->mtime = mtime;
+    rec->size = size;
+    memcpy(rec + 1, path, len);
+    s->slots[s->nslots++].off = s->used;
+    s->used += n;
+    return 0;
+}
+
+/* make the current record of <r> whole in its buffer, return 1 at the end
+ * of the run.
+ */
+static int fill_run(spill_t* s, spill_run_t* r)
+{
+    size_t rest = r->len - r->pos;
+    size_t need = sizeof(spill_rec_t);
+    size_t n;
+
+    if (rest >= need) {
+        need = rec_size(((const spill_rec_t*)(r->buf + r->pos))->len);
+        if (rest >= need) {
+            return 0;
+        }
+    }
+    if (r->off == r->end) {
+        if (rest == 0) {
+            return 1;
+        }
+        fprintf(stderr, "the spilled listing is broken.\n");
+        return -1;
+    }
+    memmove(r->buf, r->buf + r->pos, rest);
+    r->pos = 0;
+    r->len = rest;
+    if (r->cap < need) {
+        r->cap = need;
+        r->buf = realloc(r->buf, r->cap);
+    }
+
+    n = r->cap - r->len;
+    if (n > r->end - r->off) {
+        n = (size_t)(r->end - r->off);
+    }
+    if (seek_spill_file(s->fp, r->off) != 0 || fread(r->buf + r->len, n, 1, s->fp) != 1) {
+        fprintf(stderr, "read the spilled listing failed (%s).\n", strerror(errno));
+        return -1;
+    }
+    r->off += n;
+    r->len += n;
+    return fill_run(s, r);
+}
+
+static inline const spill_rec_t* run_rec(const spill_run_t* r)
+{
+    return (const spill_rec_t*)(r->buf + r->pos);
+}
+
+static inline int cmp_run(const spill_t* s, size_t a, size_t b)
+{
+    return spill_cmp_path(rec_path(run_rec(&s->runs[a])), rec_path(run_rec(&s->runs[b])));
+}
+
+static void sift_down(spill_t* s, size_t i)
+{
+    while (1) {
+        size_t k = i;
+        size_t l = i * 2 + 1;
+
+        if (l < s->nheap && cmp_run(s, s->heap[l], s->heap[k]) < 0) {
+            k = l;
+        }
+        if (l + 1 < s->nheap && cmp_run(s, s->heap[l + 1], s->heap[k]) < 0) {
+            k = l + 1;
+        }
+        if (k == i) {
+            break;
+        }
+        l = s->heap[i];
+        s->heap[i] = s->heap[k];
+        s->heap[k] = l;
+        i = k;
+    }
+}
+
+/* start merging the first <n> runs, each of them is read through its
+ * share of the budget.
+ */
+static int merge_begin(spill_t* s, size_t n)
+{
+    size_t share = s->budget / n;
+
+    if (share < SPILL_READ_MIN) {
+        share = SPILL_READ_MIN;
+    }
+    s->heap = realloc(s->heap, n * sizeof(size_t));
+    s->nheap = 0;
+    s->top = 0;
+    for (size_t i = 0; i < n; ++i) {
+        spill_run_t* r = &s->runs[i];
+        size_t cap = r->end - r->start < share ? (size_t)(r->end - r->start) : share;
+        int ret;
+
+        r->off = r->start;
+        r->pos = r->len = 0;
+        if (r->cap != cap) {
+            free(r->buf);
+            r->buf = malloc(cap);
+            r->cap = cap;
+        }
+        if ((ret = fill_run(s, r)) < 0) {
+            return -1;
+        }
+        if (ret == 0) {
+            s->heap[s->nheap++] = i;
+        }
+    }
+    for (size_t i = s->nheap / 2; i-- > 0; ) {
+        sift_down(s, i);
+    }
+    return 0;
+}
+
+/* return the least record of the merged runs, 1 at the end. */
+static int merge_next(spill_t* s, const spill_rec_t** rec)
+{
+    if (s->top) {
+        spill_run_t* r = &s->runs[s->heap[0]];
+        int ret;
+
+        r->pos += rec_size(run_rec(r)->len);
+        if ((ret = fill_run(s, r)) < 0) {
+            return -1;
+        }
+        if (ret > 0) {
+            s->heap[0] = s->heap[--s->nheap];
+        }
+        s->top = 0;
+        sift_down(s, 0);
+    }
+    if (s->nheap == 0) {
+        return 1;
+    }
+    *rec = run_rec(&s->runs[s->heap[0]]);
+    s->top = 1;
+    return 0;
+}
+
+/* merge the first <n> runs into one at the end of the file. */
+static int merge_runs(spill_t* s, size_t n)
+{
+    uint64_t off = s->fend;
+    const spill_rec_t* rec;
+    int ret = merge_begin(s, n);
+
+    while (ret == 0 && (ret = merge_next(s, &rec)) == 0) {
+        ret = spill_write(s, rec, rec_size(rec->len));
+    }
+    if (ret < 0 || flush_write(s) != 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        free(s->runs[i].buf);
+    }
+    memmove(s->runs, s->runs + n, (s->nruns - n) * sizeof(spill_run_t));
+    s->nruns -= n;
+    add_run(s, off, s->fend);
+    return 0;
+}
+
+int spill_rewind(spill_t* s)
+{
+    size_t fanin = s->budget / SPILL_READ_MIN;
+
+    if (!s->sealed) {
+        s->sealed = 1;
+        if (s->nruns == 0) {
+            sort_slots(s);
+        } else {
+            if (s->nslots > 0 && write_run(s) != 0) {
+                return -1;
+            }
+            free(s->buf);
+            free(s->slots);
+            s->buf = NULL;
+            s->slots = NULL;
+            s->used = s->cap = s->nslots = s->slotcap = 0;
+        }
+        /* too many runs to read at once are merged into longer ones */
+        if (fanin < 2) {
+            fanin = 2;
+        }
+        while (s->nruns > fanin) {
+            if (merge_runs(s, fanin) != 0) {
+                return -1;
+            }
+        }
+    }
+
+    s->next = 0;
+    return s->nruns > 0 ? merge_begin(s, s->nruns) : 0;
+}
+
+int spill_next(spill_t* s, spill_entry_t* e)
+{
+    const spill_rec_t* rec;
+    int ret;
+
+    if (s->nruns == 0) {
+        if (s->next == s->nslots) {
+            return 1;
+        }
+        rec = s->slots[s->next++].rec;
+    } else if ((ret = merge_next(s, &rec)) != 0) {
+        return ret;
+    }
+    e->path = rec_path(rec);
+    e->len = rec->len;
+    e->mode = rec->mode;
+    e->mtime = (time_t)rec->mtime;
+    e->size = rec->size;
+    return 0;
+}
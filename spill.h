@@ -0,0 +1,46 @@
+#ifndef _SPILL_H_
+#define _SPILL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* a list of file entries sorted within a memory budget. the entries are
+ * kept in memory until the budget is used up, then sorted and written to a
+ * temporary file as one run, and read back by a k-way merge of the runs.
+ */
+typedef struct spill spill_t;
+
+typedef struct {
+    const char* path;   /* valid until the next <spill_next> */
+    size_t len;
+    int mode;
+    time_t mtime;
+    uint64_t size;
+} spill_entry_t;
+
+/* compare two paths in the order of a spill, '/' comes right after the end
+ * of a name, so a directory "x/" follows the file "x" and the paths under
+ * it follow the directory.
+ */
+int spill_cmp_path(const char* a, const char* b);
+
+/* return NULL if the temporary file can not be created. */
+spill_t* spill_open(size_t budget);
+void spill_close(spill_t* s);
+
+/* add an entry of <path>, which is at most <len> bytes, return 0 on
+ * success. no more entries are added after <spill_rewind>.
+ */
+int spill_add(spill_t* s, const char* path, size_t len, int mode, time_t mtime,
+        uint64_t size);
+
+/* start reading the sorted entries from the first one, return 0 on
+ * success. it may be called again to read them once more.
+ */
+int spill_rewind(spill_t* s);
+
+/* read the next entry in order, return 1 at the end, -1 if it fails. */
+int spill_next(spill_t* s, spill_entry_t* e);
+
+#endif // _SPILL_H_
@@ -1,9 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
 #ifdef _WIN32
 #include <WS2tcpip.h>
+#include <io.h>
 #else
 #include <unistd.h>
 #include <sys/stat.h>
@@ -14,10 +18,25 @@
 #endif
 
 #include "ssh_session.h"
+#include "xthread.h"
 
-#define GENERIC_BUF_SIZE    16384
+#define DEFAULT_SFTP_WINDOW (2048 * 1024)
 
-static char* generic_buf;
+static size_t sftp_window = DEFAULT_SFTP_WINDOW;
+
+/* ms of the bandwidth limit which may be used at once */
+#define BWLIMIT_BURST_MS 100
+
+/* one token bucket shared by all the sessions. <bw_due> is the time in ns
+ * when the bytes taken so far are paid at <bw_rate>, it is kept no earlier
+ * than a burst before now, so at most a burst is sent without waiting.
+ */
+static struct {
+    xmutex_t lock;
+    int inited;
+    uint64_t rate;      /* bytes per second, 0 if unlimited */
+    int64_t due;
+} bw;
 
 static libssh2_socket_t connect_tcp_server(const char* host, int port)
 {
@@ -99,9 +118,6 @@ ssh_t* ssh_session_open(const char* host, int port, int compress,
 // #ifndef NDEBUG
 //     libssh2_trace(s, LIBSSH2_TRACE_SCP | LIBSSH2_TRACE_SFTP);
 // #endif
-    if (!generic_buf) {
-        generic_buf = malloc(GENERIC_BUF_SIZE);
-    }
     return s;
 error:
     ssh_session_close(s);
@@ -119,18 +135,362 @@ void ssh_session_close(ssh_t* s)
         libssh2_session_disconnect(s, "Normal Shutdown");
         libssh2_session_free(s);
     }
-    free(generic_buf);
-    generic_buf = NULL;
+}
+
+ssh_exec_t* ssh_exec_open(ssh_t* s, const char* cmd)
+{
+    ssh_exec_t* e = libssh2_channel_open_session(s);
+
+    if (!e) {
+        return NULL;
+    }
+    libssh2_channel_handle_extended_data2(e, LIBSSH2_CHANNEL_EXTENDED_DATA_IGNORE);
+
+    if (libssh2_channel_exec(e, cmd) != 0) {
+        libssh2_channel_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+ssize_t ssh_exec_read(ssh_exec_t* e, char* buf, size_t size)
+{
+    return libssh2_channel_read(e, buf, size);
+}
+
+int ssh_exec_gets(ssh_exec_t* e, char* line, size_t size)
+{
+    size_t len = 0;
+
+    while (1) {
+        char ch;
+        ssize_t n = libssh2_channel_read(e, &ch, 1);
+
+        if (n <= 0) {
+            return -1;
+        }
+        if (ch == '\n') {
+            break;
+        }
+        if (len < size - 1) {
+            line[len++] = ch;
+        }
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+/* write all <data> to the input of the command, return 0 if done. */
+int ssh_exec_write(ssh_exec_t* e, const char* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = libssh2_channel_write(e, data, size);
+
+        if (n < 0) {
+            return -1;
+        }
+        data += n;
+        size -= n;
+        ssh_take_bandwidth((size_t)n);
+    }
+    return 0;
+}
+
+int ssh_exec_close(ssh_exec_t* e)
+{
+    char buf[256];
+    int status = -1;
+
+    /* the exit status comes after all the output */
+    libssh2_channel_send_eof(e);
+    while (libssh2_channel_read(e, buf, sizeof(buf)) > 0) {
+    }
+    if (libssh2_channel_close(e) == 0 && libssh2_channel_wait_closed(e) == 0) {
+        status = libssh2_channel_get_exit_status(e);
+    }
+    libssh2_channel_free(e);
+    return status;
+}
+
+void ssh_exec_abort(ssh_exec_t* e)
+{
+    libssh2_channel_close(e);
+    libssh2_channel_free(e);
+}
+
+void ssh_quote_arg(xstr_t* cmd, const char* arg)
+{
+    xstr_push_back(cmd, '\'');
+    for (; *arg; ++arg) {
+        if (*arg == '\'') {
+            xstr_append(cmd, "'\\''");
+        } else {
+            xstr_push_back(cmd, *arg);
+        }
+    }
+    xstr_push_back(cmd, '\'');
 }
 
 sftp_t* sftp_session_new(ssh_t* s)
 {
-    return libssh2_sftp_init(s);
+    sftp_t* sftp = malloc(sizeof(sftp_t));
+
+    if (!sftp) {
+        return NULL;
+    }
+    sftp->sftp = libssh2_sftp_init(s);
+    if (!sftp->sftp) {
+        free(sftp);
+        return NULL;
+    }
+    sftp->ssh = s;
+    sftp->buf = malloc(GENERIC_BUF_SIZE);
+    sftp->progress = 1;
+    sftp->error[0] = '\0';
+    return sftp;
 }
 
 void sftp_session_free(sftp_t* s)
 {
-    libssh2_sftp_shutdown(s);
+    libssh2_sftp_shutdown(s->sftp);
+    free(s->buf);
+    free(s);
+}
+
+static void set_error(sftp_t* s, const char* fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(s->error, sizeof(s->error), fmt, ap);
+    va_end(ap);
+}
+
+static void show_progress(sftp_t* s, uint64_t cursize, uint64_t size, int* percent)
+{
+    if (s->progress && size && (int)(cursize * 100 / size) != *percent) {
+        *percent = (int)(cursize * 100 / size);
+        fprintf(stdout, "\033[u%3d%%", *percent);
+        fflush(stdout);
+    }
+}
+
+void sftp_set_window(size_t window)
+{
+    sftp_window = window < GENERIC_BUF_SIZE ? GENERIC_BUF_SIZE : window;
+}
+
+static int64_t now_ns(void)
+{
+#ifdef _WIN32
+    return (int64_t)GetTickCount64() * 1000000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static void sleep_ns(int64_t ns)
+{
+#ifdef _WIN32
+    Sleep((DWORD)((ns + 999999) / 1000000));
+#else
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ns / 1000000000);
+    ts.tv_nsec = (long)(ns % 1000000000);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+#endif
+}
+
+void ssh_set_bwlimit(uint64_t rate)
+{
+    if (!bw.inited) {
+        xmutex_init(&bw.lock);
+        bw.inited = 1;
+    }
+    bw.rate = rate;
+    bw.due = 0;
+}
+
+void ssh_take_bandwidth(size_t size)
+{
+    int64_t now, wait, burst;
+
+    if (!bw.rate || !size) {
+        return;
+    }
+    burst = (int64_t)BWLIMIT_BURST_MS * 1000000;
+    now = now_ns();
+
+    /* the waits are queued in the order of taking, so the sessions share
+     * the rate evenly.
+     */
+    xmutex_lock(&bw.lock);
+    if (bw.due < now - burst) {
+        bw.due = now - burst;
+    }
+    bw.due += (int64_t)((double)size * 1e9 / (double)bw.rate);
+    wait = bw.due - now;
+    xmutex_unlock(&bw.lock);
+
+    if (wait > 0) {
+        sleep_ns(wait);
+    }
+}
+
+/* return the bytes kept in flight per file. with a bandwidth limit, it is
+ * no more than a burst, so the data put on the wire at once is bounded.
+ */
+static size_t flow_window(void)
+{
+    if (bw.rate) {
+        uint64_t burst = bw.rate * BWLIMIT_BURST_MS / 1000;
+
+        if (burst < GENERIC_BUF_SIZE) {
+            burst = GENERIC_BUF_SIZE;
+        }
+        if (burst < sftp_window) {
+            return (size_t)burst;
+        }
+    }
+    return sftp_window;
+}
+
+/* allocate a transfer buffer of <window> bytes but no larger than the file,
+ * the session buffer is used for small files. release it by <free_window>.
+ */
+static char* alloc_window(sftp_t* s, uint64_t size, size_t window, size_t* bufsz)
+{
+    char* buf;
+
+    if (size <= GENERIC_BUF_SIZE) {
+        *bufsz = GENERIC_BUF_SIZE;
+        return s->buf;
+    }
+    *bufsz = size < window ? (size_t)size : window;
+
+    buf = malloc(*bufsz);
+    if (!buf) {
+        *bufsz = GENERIC_BUF_SIZE;
+        return s->buf;
+    }
+    return buf;
+}
+
+static void free_window(sftp_t* s, char* buf)
+{
+    if (buf != s->buf) {
+        free(buf);
+    }
+}
+
+static int seek_local_file(FILE* fp, uint64_t offset)
+{
+#ifdef _WIN32
+    return _fseeki64(fp, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(fp, (off_t)offset, SEEK_SET);
+#endif
+}
+
+/* open a local file for writing like fopen "wb", but <trunc> is optional.
+ * a new file is created with <mode>.
+ */
+static FILE* open_local_file(const char* local, int trunc, int mode)
+{
+    FILE* fp;
+#ifdef _WIN32
+    int fd = _open(local, _O_WRONLY | _O_CREAT | _O_BINARY | (trunc ? _O_TRUNC : 0),
+                _S_IREAD | _S_IWRITE);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    fp = _fdopen(fd, "wb");
+    if (!fp) {
+        _close(fd);
+    }
+#else
+    int fd = open(local, O_WRONLY | O_CREAT | (trunc ? O_TRUNC : 0), mode);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    fp = fdopen(fd, "wb");
+    if (!fp) {
+        close(fd);
+    }
+#endif
+    return fp;
+}
+
+/* upload at most <length> bytes from <fp> to <hdl>, <size> is used to show
+ * progress. return 0 if <length> bytes or all the rest of <fp> is sent.
+ */
+static int send_data(sftp_t* s, LIBSSH2_SFTP_HANDLE* hdl, FILE* fp,
+        uint64_t length, uint64_t size)
+{
+    size_t bufsz;
+    char* buf = alloc_window(s, length < size ? length : size, flow_window(), &bufsz);
+    char* pos = buf;
+    size_t len = 0;
+    size_t nread;
+    ssize_t nwrite;
+    int eof = 0;
+    int percent = 0;
+    int ret = -1;
+    uint64_t cursize = 0;
+
+    /* libssh2 splits the buffer into many SFTP write requests and sends
+     * all of them before waiting for the first ack, so everything in
+     * [pos, pos + len) is in flight. the acked head is dropped and the
+     * buffer is refilled once half of it has been acked.
+     */
+    while (1) {
+        if (!eof && len <= bufsz / 2) {
+            size_t want = bufsz - len < length ? bufsz - len : (size_t)length;
+
+            memmove(buf, pos, len);
+            pos = buf;
+            nread = fread(buf + len, 1, want, fp);
+            if (nread < want) {
+                if (ferror(fp)) {
+                    set_error(s, "read local file failed (%s)", strerror(errno));
+                    break;
+                }
+                eof = 1;
+            }
+            length -= nread;
+            if (length == 0) {
+                eof = 1;
+            }
+            len += nread;
+        }
+        if (len == 0) {
+            ret = 0;
+            break; /* eof */
+        }
+
+        nwrite = libssh2_sftp_write(hdl, pos, len);
+        if (nwrite < 0) {
+            set_error(s, "write remote file failed [%d/%d] (%d)",
+                (int)nwrite, (int)len, (int)libssh2_sftp_last_error(s->sftp));
+            break;
+        }
+        pos += nwrite;
+        len -= nwrite;
+
+        cursize += nwrite;
+        show_progress(s, cursize, size, &percent);
+        ssh_take_bandwidth((size_t)nwrite);
+    }
+
+    free_window(s, buf);
+    return ret;
 }
 
 int sftp_send_file(sftp_t* s, const char* local, const char* remote,
@@ -140,30 +500,32 @@ int sftp_send_file(sftp_t* s, const char* local, const char* remote,
     FILE* fp;
     int ret = -1;
 
+    s->error[0] = '\0';
+
     /* local file is a directory */
     if (LIBSSH2_SFTP_S_ISDIR(mode)) {
-        if (exists || libssh2_sftp_mkdir(s, remote, mode & 0777) == 0) {
+        if (exists || libssh2_sftp_mkdir(s->sftp, remote, mode & 0777) == 0) {
             return 0;
         }
-        fprintf(stdout, "create remote dir failed (%d)", (int)libssh2_sftp_last_error(s));
+        set_error(s, "create remote dir failed (%d)", (int)libssh2_sftp_last_error(s->sftp));
         return -1;
     }
 #ifndef _WIN32
     /* local file is a symlink */
     if (LIBSSH2_SFTP_S_ISLNK(mode)) {
         /* unlink remote file if exists */
-        if (exists && libssh2_sftp_unlink(s, remote) < 0) {
-            fprintf(stdout, "unlink remote file failed (%d)", (int)libssh2_sftp_last_error(s));
+        if (exists && libssh2_sftp_unlink(s->sftp, remote) < 0) {
+            set_error(s, "unlink remote file failed (%d)", (int)libssh2_sftp_last_error(s->sftp));
         } else {
-            int nread = readlink(local, generic_buf, GENERIC_BUF_SIZE - 1);
+            int nread = readlink(local, s->buf, GENERIC_BUF_SIZE - 1);
             /* create remote link file */
             if (nread > 0) {
-                generic_buf[nread] = 0;
-                if (libssh2_sftp_symlink(s, generic_buf, (char*)remote) == 0) {
+                s->buf[nread] = 0;
+                if (libssh2_sftp_symlink(s->sftp, s->buf, (char*)remote) == 0) {
                     return 0;
                 }
-                fprintf(stdout, "symlink remote file failed (%d)",
-                    (int)libssh2_sftp_last_error(s));
+                set_error(s, "symlink remote file failed (%d)",
+                    (int)libssh2_sftp_last_error(s->sftp));
                 return -1;
             }
         }
@@ -171,66 +533,271 @@ int sftp_send_file(sftp_t* s, const char* local, const char* remote,
     }
 #endif
     if (!LIBSSH2_SFTP_S_ISREG(mode)) {
-        fprintf(stdout, "unsupported file type (%d)", mode & LIBSSH2_SFTP_S_IFMT);
+        set_error(s, "unsupported file type (%d)", mode & LIBSSH2_SFTP_S_IFMT);
         return -1;
     }
 
-    hdl = libssh2_sftp_open(s, remote,
+    hdl = libssh2_sftp_open(s->sftp, remote,
             LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_TRUNC, mode & 0777);
     if (!hdl) {
-        fprintf(stdout, "open remote file failed (%d)", (int)libssh2_sftp_last_error(s));
+        set_error(s, "open remote file failed (%d)", (int)libssh2_sftp_last_error(s->sftp));
         return -1;
     }
 
     fp = fopen(local, "rb");
 
     if (fp) {
-        char* pos;
-        int nread, nwrite;
-        int percent = 0;
-        uint64_t cursize = 0;
-
-        while (1) {
-            pos = generic_buf;
-            nread = fread(generic_buf, 1, GENERIC_BUF_SIZE, fp);
-            if (nread > 0) {
-                cursize += nread;
-                nwrite = (int)(cursize * 100 / size);
-                if (nwrite != percent) {
-                    percent = nwrite;
-                    fprintf(stdout, "\033[u%3d%%", percent);
-                    fflush(stdout);
-                }
-                do {
-                    nwrite = libssh2_sftp_write(hdl, pos, nread);
-                    if (nwrite < 0) {
-                        fprintf(stdout, "write remote file failed [%d/%d] (%d)",
-                            nwrite, nread, (int)libssh2_sftp_last_error(s));
-                        goto out;
-                    }
-                    nread -= nwrite;
-                    pos += nwrite;
-                }
-                while (nread > 0);
+        ret = send_data(s, hdl, fp, UINT64_MAX, size);
+        fclose(fp);
+    } else {
+        set_error(s, "open local file failed (%s)", strerror(errno));
+    }
 
-            } else if (nread == 0) {
-                ret = 0;
-                break; /* eof */
-            } else {
-                fprintf(stdout, "read local file failed (%s)", strerror(errno));
+    libssh2_sftp_close_handle(hdl);
+    return ret;
+}
+
+int sftp_send_range(sftp_t* s, const char* local, const char* remote,
+        int mode, uint64_t offset, uint64_t length)
+{
+    const uint64_t range[2] = { offset, length };
+
+    return sftp_send_ranges(s, local, remote, mode, range, 1);
+}
+
+int sftp_send_ranges(sftp_t* s, const char* local, const char* remote,
+        int mode, const uint64_t* ranges, size_t n)
+{
+    LIBSSH2_SFTP_HANDLE* hdl;
+    FILE* fp;
+    int ret = -1;
+
+    s->error[0] = '\0';
+
+    hdl = libssh2_sftp_open(s->sftp, remote,
+            LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT, mode & 0777);
+    if (!hdl) {
+        set_error(s, "open remote file failed (%d)", (int)libssh2_sftp_last_error(s->sftp));
+        return -1;
+    }
+
+    fp = fopen(local, "rb");
+
+    if (fp) {
+        for (ret = 0; ret == 0 && n > 0; ranges += 2, --n) {
+            if (seek_local_file(fp, ranges[0]) != 0) {
+                set_error(s, "seek local file failed (%s)", strerror(errno));
+                ret = -1;
                 break;
             }
+            libssh2_sftp_seek64(hdl, ranges[0]);
+            ret = send_data(s, hdl, fp, ranges[1], ranges[1]);
         }
-out:
         fclose(fp);
     } else {
-        fprintf(stdout, "open local file failed (%s)", strerror(errno));
+        set_error(s, "open local file failed (%s)", strerror(errno));
     }
 
     libssh2_sftp_close_handle(hdl);
     return ret;
 }
 
+int sftp_send_finish(sftp_t* s, const char* remote, uint64_t size)
+{
+    LIBSSH2_SFTP_ATTRIBUTES attrs;
+
+    memset(&attrs, 0, sizeof(attrs));
+    attrs.flags = LIBSSH2_SFTP_ATTR_SIZE;
+    attrs.filesize = size;
+
+    if (libssh2_sftp_setstat(s->sftp, remote, &attrs) != 0) {
+        set_error(s, "truncate remote file failed (%d)", (int)libssh2_sftp_last_error(s->sftp));
+        return -1;
+    }
+    return 0;
+}
+
+/* writes downloaded data to a local file in its own thread, so the disk
+ * write of one buffer overlaps the network read of the next one.
+ */
+typedef struct {
+    FILE* fp;
+    int threaded;
+    int quit;
+    int error;      /* errno of the failed write */
+    char* data;     /* buffer being written, NULL if idle */
+    size_t size;
+    xthread_t thread;
+    xmutex_t mutex;
+    xcond_t cond;
+} file_writer_t;
+
+static void file_writer_routine(void* arg)
+{
+    file_writer_t* w = arg;
+
+    xmutex_lock(&w->mutex);
+    while (1) {
+        while (!w->data && !w->quit) {
+            xcond_wait(&w->cond, &w->mutex);
+        }
+        if (!w->data) {
+            break; /* quit */
+        }
+        xmutex_unlock(&w->mutex);
+
+        if (!w->error && fwrite(w->data, 1, w->size, w->fp) != w->size) {
+            w->error = errno;
+        }
+
+        xmutex_lock(&w->mutex);
+        w->data = NULL;
+        xcond_broadcast(&w->cond);
+    }
+    xmutex_unlock(&w->mutex);
+}
+
+static void file_writer_start(file_writer_t* w, FILE* fp, int threaded)
+{
+    w->fp = fp;
+    w->threaded = threaded;
+    w->quit = 0;
+    w->error = 0;
+    w->data = NULL;
+
+    if (threaded) {
+        xmutex_init(&w->mutex);
+        xcond_init(&w->cond);
+
+        if (xthread_create(&w->thread, file_writer_routine, w) != 0) {
+            xmutex_destroy(&w->mutex);
+            xcond_destroy(&w->cond);
+            w->threaded = 0;
+        }
+    }
+}
+
+/* queue <data> to be written, wait for the previous buffer is written.
+ * <data> must not be touched until next call of <file_writer_put> or
+ * <file_writer_finish>. return errno of a failed write, otherwise 0.
+ */
+static int file_writer_put(file_writer_t* w, char* data, size_t size)
+{
+    int error;
+
+    if (!w->threaded) {
+        if (fwrite(data, 1, size, w->fp) != size) {
+            w->error = errno;
+        }
+        return w->error;
+    }
+
+    xmutex_lock(&w->mutex);
+    while (w->data) {
+        xcond_wait(&w->cond, &w->mutex);
+    }
+    error = w->error;
+    if (!error) {
+        w->data = data;
+        w->size = size;
+        xcond_broadcast(&w->cond);
+    }
+    xmutex_unlock(&w->mutex);
+
+    return error;
+}
+
+/* wait for all data is written and stop the writer thread. */
+static int file_writer_finish(file_writer_t* w)
+{
+    if (w->threaded) {
+        xmutex_lock(&w->mutex);
+        w->quit = 1;
+        xcond_broadcast(&w->cond);
+        xmutex_unlock(&w->mutex);
+
+        xthread_join(&w->thread);
+        xmutex_destroy(&w->mutex);
+        xcond_destroy(&w->cond);
+    }
+    return w->error;
+}
+
+/* download at most <length> bytes from <hdl> to <fp>, <size> is used to show
+ * progress. return 0 if <length> bytes or all the rest of <hdl> is received.
+ */
+static int recv_data(sftp_t* s, LIBSSH2_SFTP_HANDLE* hdl, FILE* fp,
+        uint64_t length, uint64_t size)
+{
+    file_writer_t writer;
+    size_t bufsz, chunk, ask;
+    char* buf = alloc_window(s, length < size ? length : size, flow_window(), &bufsz);
+    char* cur = buf;
+    size_t len = 0;
+    ssize_t nread;
+    int percent = 0;
+    int ret = -1;
+    uint64_t cursize = 0;
+
+    /* libssh2 keeps read requests for up to 4 times of the asked size in
+     * flight at increasing offsets and returns the data in order, so every
+     * read asks for a quarter of the window to keep the whole window in
+     * flight. the window is split into two chunks, one is filled from the
+     * network while the other one is being written by the writer thread.
+     */
+    ask = bufsz / 4;
+    if (buf != s->buf) {
+        chunk = bufsz / 2;
+        file_writer_start(&writer, fp, size > chunk);
+    } else {
+        chunk = bufsz;
+        file_writer_start(&writer, fp, 0);
+    }
+
+    while (1) {
+        size_t want = ask < length ? ask : (size_t)length;
+
+        nread = want ? libssh2_sftp_read(hdl, cur + len, want) : 0;
+        if (nread < 0) {
+            set_error(s, "read remote file failed (%d)",
+                (int)libssh2_sftp_last_error(s->sftp));
+            break;
+        }
+        if (nread > 0) {
+            len += nread;
+            length -= nread;
+            cursize += nread;
+            show_progress(s, cursize, size, &percent);
+            ssh_take_bandwidth((size_t)nread);
+            /* the chunk is full once it has no room for another read */
+            if (chunk - len >= ask && length > 0) {
+                continue;
+            }
+        }
+
+        if (len > 0) {
+            if (file_writer_put(&writer, cur, len) != 0) {
+                break;
+            }
+            if (writer.threaded) {
+                cur = cur == buf ? buf + chunk : buf;
+            }
+            len = 0;
+        }
+        if (nread == 0 || length == 0) {
+            ret = 0;
+            break; /* eof */
+        }
+    }
+
+    if (file_writer_finish(&writer) != 0) {
+        set_error(s, "write local file failed (%s)", strerror(writer.error));
+        ret = -1;
+    }
+    free_window(s, buf);
+    return ret;
+}
+
 int sftp_recv_file(sftp_t* s, const char* local, const char* remote,
         int mode, int exists, time_t mtime, uint64_t size)
 {
@@ -238,18 +805,20 @@ int sftp_recv_file(sftp_t* s, const char* local, const char* remote,
     FILE* fp;
     int ret = -1;
 
+    s->error[0] = '\0';
+
     /* remote file is a directory */
     if (LIBSSH2_SFTP_S_ISDIR(mode)) {
 #ifdef _WIN32
         if (exists || CreateDirectoryA(local, NULL)) {
             return 0;
         }
-        fprintf(stdout, "create local dir failed (%d)", GetLastError());
+        set_error(s, "create local dir failed (%d)", GetLastError());
 #else
         if (exists || mkdir(local, mode & 0777) == 0) {
             return 0;
         }
-        fprintf(stdout, "create local dir failed (%s)", strerror(errno));
+        set_error(s, "create local dir failed (%s)", strerror(errno));
 #endif
         return -1;
     }
@@ -258,96 +827,112 @@ int sftp_recv_file(sftp_t* s, const char* local, const char* remote,
         /* unlink local file if exists */
 #ifdef _WIN32
         if (exists && !DeleteFileA(local)) {
-            fprintf(stdout, "unlink local file failed (%d)", GetLastError());
+            set_error(s, "unlink local file failed (%d)", GetLastError());
 #else
         if (exists && unlink(local) < 0) {
-            fprintf(stdout, "unlink local file failed (%s)", strerror(errno));
+            set_error(s, "unlink local file failed (%s)", strerror(errno));
 #endif
         } else {
-            int nread = libssh2_sftp_readlink(s, remote, generic_buf, GENERIC_BUF_SIZE - 1);
+            int nread = libssh2_sftp_readlink(s->sftp, remote, s->buf, GENERIC_BUF_SIZE - 1);
             /* create local link file */
             if (nread > 0) {
 #ifdef _WIN32
                 /* just write a normal file, TODO */
                 fp = fopen(local, "wb");
                 if (fp) {
-                    fwrite(generic_buf, 1, nread, fp);
+                    fwrite(s->buf, 1, nread, fp);
                     fclose(fp);
                     return 0;
                 }
 #else
-                generic_buf[nread] = 0;
-                if (symlink(generic_buf, local) == 0) {
+                s->buf[nread] = 0;
+                if (symlink(s->buf, local) == 0) {
                     return 0;
                 }
 #endif
-                fprintf(stdout, "symlink local file failed (%s)", strerror(errno));
+                set_error(s, "symlink local file failed (%s)", strerror(errno));
                 return -1;
             }
         }
         return -1;
     }
     if (!LIBSSH2_SFTP_S_ISREG(mode)) {
-        fprintf(stdout, "unsupported file type (%d)", mode & LIBSSH2_SFTP_S_IFMT);
+        set_error(s, "unsupported file type (%d)", mode & LIBSSH2_SFTP_S_IFMT);
         return -1;
     }
 
-#ifdef _WIN32
-    fp = fopen(local, "wb");
-#else
-    if (1) {
-        int fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, mode & 0777);
-        if (fd < 0) {
-            fprintf(stdout, "open local file failed (%s)", strerror(errno));
-            return -1;
-        }
-        fp = fdopen(fd, "wb");
-    }
-#endif
+    fp = open_local_file(local, 1, mode & 0777);
     if (!fp) {
-        fprintf(stdout, "open local file (%s) failed", local);
-        // close(fd);
+        set_error(s, "open local file failed (%s)", strerror(errno));
         return -1;
     }
 
-    hdl = libssh2_sftp_open(s, remote, LIBSSH2_FXF_READ, 0);
+    hdl = libssh2_sftp_open(s->sftp, remote, LIBSSH2_FXF_READ, 0);
 
     if (hdl) {
-        int nread, nwrite;
-        int percent = 0;
-        uint64_t cursize = 0;
+        ret = recv_data(s, hdl, fp, UINT64_MAX, size);
+        libssh2_sftp_close_handle(hdl);
+    } else {
+        set_error(s, "open remote file failed (%d)", (int)libssh2_sftp_last_error(s->sftp));
+    }
 
-        while (1) {
-            nread = libssh2_sftp_read(hdl, generic_buf, GENERIC_BUF_SIZE);
-            if (nread > 0) {
-                cursize += nread;
-                nwrite = (int)(cursize * 100 / size);
-                if (nwrite != percent) {
-                    percent = nwrite;
-                    fprintf(stdout, "\033[u%3d%%", percent);
-                    fflush(stdout);
-                }
-                nwrite = fwrite(generic_buf, 1, nread, fp);
-                if (nwrite != nread) {
-                    fprintf(stdout, "write local file failed [%d/%d] (%s)",
-                        nwrite, nread, strerror(errno));
-                    break;
-                }
-            } else if (nread == 0) {
-                ret = 0;
-                break; /* eof */
-            } else {
-                fprintf(stdout, "read remote file failed (%d)",
-                    (int)libssh2_sftp_last_error(s));
-                break;
-            }
-        }
+    fclose(fp);
+    return ret;
+}
+
+int sftp_recv_range(sftp_t* s, const char* local, const char* remote,
+        int mode, uint64_t offset, uint64_t length)
+{
+    LIBSSH2_SFTP_HANDLE* hdl;
+    FILE* fp;
+    int ret = -1;
 
+    s->error[0] = '\0';
+
+    fp = open_local_file(local, 0, mode & 0777);
+    if (!fp) {
+        set_error(s, "open local file failed (%s)", strerror(errno));
+        return -1;
+    }
+    if (seek_local_file(fp, offset) != 0) {
+        set_error(s, "seek local file failed (%s)", strerror(errno));
+        fclose(fp);
+        return -1;
+    }
+
+    hdl = libssh2_sftp_open(s->sftp, remote, LIBSSH2_FXF_READ, 0);
+
+    if (hdl) {
+        libssh2_sftp_seek64(hdl, offset);
+        ret = recv_data(s, hdl, fp, length, length);
         libssh2_sftp_close_handle(hdl);
     } else {
-        fprintf(stdout, "open remote file failed (%d)", (int)libssh2_sftp_last_error(s));
+        set_error(s, "open remote file failed (%d)", (int)libssh2_sftp_last_error(s->sftp));
     }
 
     fclose(fp);
     return ret;
 }
+
+int sftp_recv_finish(sftp_t* s, const char* local, uint64_t size)
+{
+#ifdef _WIN32
+    int fd = _open(local, _O_WRONLY | _O_BINARY);
+
+    if (fd >= 0) {
+        int err = _chsize_s(fd, (__int64)size);
+
+        _close(fd);
+        if (err == 0) {
+            return 0;
+        }
+        errno = err;
+    }
+#else
+    if (truncate(local, (off_t)size) == 0) {
+        return 0;
+    }
+#endif
+    set_error(s, "truncate local file failed (%s)", strerror(errno));
+    return -1;
+}
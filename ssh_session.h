@@ -3,25 +3,78 @@
 
 #include <libssh2.h>
 #include <libssh2_sftp.h>
+#include "xstring.h"
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
+#define GENERIC_BUF_SIZE    16384
+
 typedef LIBSSH2_SESSION ssh_t;
-typedef LIBSSH2_SFTP sftp_t;
+typedef LIBSSH2_CHANNEL ssh_exec_t;
+
+typedef struct {
+    ssh_t* ssh;         /* session which the SFTP runs on */
+    LIBSSH2_SFTP* sftp;
+    char* buf;          /* buffer for small files and links */
+    int progress;       /* print transfer percentage */
+    char error[128];    /* message of the last failed transfer */
+} sftp_t;
 
 ssh_t* ssh_session_open(const char* host, int port, int compress,
         const char* user, const char* passwd);
 void ssh_session_close(ssh_t* s);
 
+/* limit the bytes per second of all the sessions together, 0 to disable.
+ * it is set before the transfer starts. <ssh_take_bandwidth> waits until
+ * <size> more bytes may be transferred, the transfer of SFTP files and the
+ * input of commands take it by themselves.
+ */
+void ssh_set_bwlimit(uint64_t rate);
+void ssh_take_bandwidth(size_t size);
+
+/* run <cmd> by the remote shell, stderr of <cmd> is discarded.
+ * <ssh_exec_read> returns 0 at the end of output, <ssh_exec_close> closes
+ * the input of <cmd>, discards the rest output and returns its exit status
+ * or -1 if it can not be got. <ssh_exec_abort> closes it without waiting.
+ */
+ssh_exec_t* ssh_exec_open(ssh_t* s, const char* cmd);
+ssize_t ssh_exec_read(ssh_exec_t* e, char* buf, size_t size);
+int ssh_exec_write(ssh_exec_t* e, const char* data, size_t size);
+/* read a line of output without '\n', return -1 at the end of output. */
+int ssh_exec_gets(ssh_exec_t* e, char* line, size_t size);
+int ssh_exec_close(ssh_exec_t* e);
+void ssh_exec_abort(ssh_exec_t* e);
+/* append <arg> to <cmd> in single quotes for the remote shell. */
+void ssh_quote_arg(xstr_t* cmd, const char* arg);
+
 sftp_t* sftp_session_new(ssh_t* s);
 void sftp_session_free(sftp_t* s);
 
-/* upload a file via SFTP */
+/* set how many bytes of SFTP requests are kept in flight per file. */
+void sftp_set_window(size_t window);
+
+/* upload a file via SFTP, <s->error> is set if it fails. */
 int sftp_send_file(sftp_t* s, const char* local, const char* remote,
         int mode, int exists, time_t mtime, uint64_t size);
-/* download a file via SFTP */
+/* download a file via SFTP, <s->error> is set if it fails. */
 int sftp_recv_file(sftp_t* s, const char* local, const char* remote,
         int mode, int exists, time_t mtime, uint64_t size);
 
+/* upload or download <length> bytes at <offset> of a regular file. the
+ * destination file is created if not exists but never truncated, so the
+ * ranges of a file can be transferred over several sessions at the same
+ * time. after all ranges are done, call <sftp_xxx_finish> to set the
+ * destination file to its final size.
+ */
+int sftp_send_range(sftp_t* s, const char* local, const char* remote,
+        int mode, uint64_t offset, uint64_t length);
+/* same as <sftp_send_range> but for <n> ranges of offset and length pairs. */
+int sftp_send_ranges(sftp_t* s, const char* local, const char* remote,
+        int mode, const uint64_t* ranges, size_t n);
+int sftp_send_finish(sftp_t* s, const char* remote, uint64_t size);
+int sftp_recv_range(sftp_t* s, const char* local, const char* remote,
+        int mode, uint64_t offset, uint64_t length);
+int sftp_recv_finish(sftp_t* s, const char* local, uint64_t size);
+
 #endif // _SSH_SESSION_H_
\ No newline at end of file
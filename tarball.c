@@ -0,0 +1,446 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <sys/utime.h>
+#else
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+
+#include "tarball.h"
+
+#define TAR_BLOCK       512
+#define TAR_MAX_ARGS    (64 * 1024)     /* bytes of file names per remote tar */
+
+/* ustar header fields */
+#define TAR_NAME        0
+#define TAR_MODE        100
+#define TAR_UID         108
+#define TAR_GID         116
+#define TAR_SIZE        124
+#define TAR_MTIME       136
+#define TAR_CHKSUM      148
+#define TAR_TYPE        156
+#define TAR_MAGIC       257
+#define TAR_VERSION     263
+#define TAR_PREFIX      345
+
+/* split the path of <item> into the name and prefix fields, at the '/'
+ * after one of its parent directories. return -1 if too long.
+ */
+static int split_name(const file_item_t* item, size_t* prefix)
+{
+    size_t len = file_item_path_len(item);
+    size_t rest = item->node->len;
+
+    *prefix = 0;
+    if (len <= 100) {
+        return 0;
+    }
+    for (const path_node_t* n = item->node->parent; n; n = n->parent) {
+        size_t i = len - rest - 1;
+
+        if (i <= 155 && len - i - 1 <= 100) {
+            *prefix = i;
+            return 0;
+        }
+        rest += n->len;
+    }
+    return -1;
+}
+
+int tarball_wanted(file_item_t* item, uint64_t threshold, int reverse)
+{
+    size_t prefix;
+
+    if (split_name(item, &prefix) != 0 || file_item_path_len(item) >= 255) {
+        return 0;
+    }
+    if (LIBSSH2_SFTP_S_ISREG(item->mode)) {
+        return item->size < threshold;
+    }
+    return !reverse && LIBSSH2_SFTP_S_ISDIR(item->mode);
+}
+
+/* <file> is the path of <item>. */
+static void make_header(char* h, file_item_t* item, const char* file)
+{
+    const int isdir = LIBSSH2_SFTP_S_ISDIR(item->mode);
+    size_t prefix;
+    unsigned sum = 0;
+
+    memset(h, 0, TAR_BLOCK);
+    split_name(item, &prefix);
+    if (prefix) {
+        memcpy(h + TAR_PREFIX, file, prefix);
+        strcpy(h + TAR_NAME, file + prefix + 1);
+    } else {
+        strcpy(h + TAR_NAME, file);
+    }
+    snprintf(h + TAR_MODE, 8, "%07o", item->mode & 07777);
+    snprintf(h + TAR_UID, 8, "%07o", 0);
+    snprintf(h + TAR_GID, 8, "%07o", 0);
+    snprintf(h + TAR_SIZE, 12, "%011llo", isdir ? 0ULL : (unsigned long long)item->size);
+    snprintf(h + TAR_MTIME, 12, "%011llo", (unsigned long long)item->mtime);
+    h[TAR_TYPE] = isdir ? '5' : '0';
+    memcpy(h + TAR_MAGIC, "ustar", 6);
+    memcpy(h + TAR_VERSION, "00", 2);
+
+    memset(h + TAR_CHKSUM, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; ++i) {
+        sum += (unsigned char)h[i];
+    }
+    snprintf(h + TAR_CHKSUM, 8, "%06o", sum);
+    h[TAR_CHKSUM + 7] = ' ';
+}
+
+/* write the content of <fp> to the stream, padded to whole blocks. if
+ * the file is shorter than in <item> now, the rest is filled with zeros.
+ */
+static int write_file(sftp_t* s, ssh_exec_t* e, FILE* fp, file_item_t* item,
+        const char* file)
+{
+    uint64_t left = item->size;
+    int ret = 0;
+
+    while (left > 0) {
+        size_t n = left < GENERIC_BUF_SIZE ? (size_t)left : GENERIC_BUF_SIZE;
+        size_t nread = fread(s->buf, 1, n, fp);
+
+        if (nread < n) {
+            if (ret == 0) {
+                snprintf(s->error, sizeof(s->error), "read %s failed", file);
+                ret = -1;
+            }
+            memset(s->buf + nread, 0, n - nread);
+        }
+        if (ssh_exec_write(e, s->buf, n) != 0) {
+            return -2;
+        }
+        left -= n;
+    }
+
+    if (item->size % TAR_BLOCK) {
+        memset(s->buf, 0, TAR_BLOCK);
+        if (ssh_exec_write(e, s->buf, TAR_BLOCK - item->size % TAR_BLOCK) != 0) {
+            return -2;
+        }
+    }
+    return ret;
+}
+
+int tarball_send(sftp_t* s, const char* local_path, const char* remote_path,
+        file_item_t** items, size_t n, int* results)
+{
+    ssh_exec_t* e;
+    xstr_t path;
+    char header[TAR_BLOCK];
+    size_t off;
+    int ret = 0;
+    int status;
+
+    s->error[0] = '\0';
+
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, "tar -xpof - -C ");
+    ssh_quote_arg(&path, remote_path);
+
+    for (size_t i = 0; i < n; ++i) {
+        results[i] = 1;
+    }
+    e = ssh_exec_open(s->ssh, xstr_data(&path));
+    if (!e) {
+        snprintf(s->error, sizeof(s->error), "exec remote tar failed");
+        xstr_destroy(&path);
+        return -1;
+    }
+
+    xstr_assign(&path, local_path);
+    xstr_push_back(&path, '/');
+    off = xstr_size(&path);
+
+    for (size_t i = 0; i < n && ret != -2; ++i) {
+        const char* file = file_item_path(items[i], &path, off) + off;
+        FILE* fp = NULL;
+
+        /* a file which can not be opened is left out */
+        if (LIBSSH2_SFTP_S_ISREG(items[i]->mode)) {
+            fp = fopen(xstr_data(&path), "rb");
+            if (!fp) {
+                snprintf(s->error, sizeof(s->error), "open %s failed (%s)",
+                    file, strerror(errno));
+                results[i] = -1;
+                continue;
+            }
+        }
+
+        make_header(header, items[i], file);
+        if (ssh_exec_write(e, header, TAR_BLOCK) != 0) {
+            ret = -2;
+        } else {
+            int r = fp ? write_file(s, e, fp, items[i], file) : 0;
+
+            if (r == -2) {
+                ret = r;
+            } else {
+                results[i] = r;
+            }
+        }
+        if (fp) {
+            fclose(fp);
+        }
+    }
+    xstr_destroy(&path);
+
+    /* end of archive */
+    memset(header, 0, TAR_BLOCK);
+    if (ret != -2 && (ssh_exec_write(e, header, TAR_BLOCK) != 0
+            || ssh_exec_write(e, header, TAR_BLOCK) != 0)) {
+        ret = -2;
+    }
+
+    status = ssh_exec_close(e);
+    if (ret == 0 && status != 0) {
+        snprintf(s->error, sizeof(s->error), "remote tar failed (%d)", status);
+        ret = -1;
+    } else if (ret == -2) {
+        snprintf(s->error, sizeof(s->error), "write remote tar failed (%d)", status);
+    }
+
+    /* which files are extracted is unknown if the remote tar fails */
+    for (size_t i = 0; i < n; ++i) {
+        if (ret != 0 && results[i] == 0) {
+            results[i] = 1;
+        }
+        if (results[i] != 0) {
+            ret = -1;
+        }
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+static int read_full(ssh_exec_t* e, char* buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = ssh_exec_read(e, buf, size);
+
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        size -= n;
+        ssh_take_bandwidth((size_t)n);
+    }
+    return 0;
+}
+
+static uint64_t parse_octal(const char* field, size_t size)
+{
+    uint64_t v = 0;
+
+    for (size_t i = 0; i < size && field[i] == ' '; ++i) {
+        ++field;
+        --size;
+    }
+    for (size_t i = 0; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+        v = v * 8 + (field[i] - '0');
+    }
+    return v;
+}
+
+/* read the next regular file <file> of the stream into <local>. */
+static int read_file(sftp_t* s, ssh_exec_t* e, const char* local,
+        const char* file, uint64_t size, int mode, time_t mtime)
+{
+    FILE* fp = fopen(local, "wb");
+    uint64_t left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    int ret = 0;
+
+    if (!fp) {
+        snprintf(s->error, sizeof(s->error), "open %s failed (%s)", file, strerror(errno));
+        ret = -1;
+    }
+    while (left > 0) {
+        size_t n = left < GENERIC_BUF_SIZE ? (size_t)left : GENERIC_BUF_SIZE;
+
+        if (read_full(e, s->buf, n) != 0) {
+            if (fp) {
+                fclose(fp);
+            }
+            return -2;
+        }
+        /* padding is not written */
+        if (fp && size > 0) {
+            size_t w = size < n ? (size_t)size : n;
+
+            if (fwrite(s->buf, 1, w, fp) != w && ret == 0) {
+                snprintf(s->error, sizeof(s->error), "write %s failed (%s)",
+                    file, strerror(errno));
+                ret = -1;
+            }
+            size -= w;
+        }
+        left -= n;
+    }
+    if (fp) {
+        struct utimbuf times;
+
+        fclose(fp);
+        times.actime = mtime;
+        times.modtime = mtime;
+#ifdef _WIN32
+        _utime(local, (struct _utimbuf*)&times);
+#else
+        chmod(local, mode & 07777);
+        utime(local, &times);
+#endif
+    }
+    return ret;
+}
+
+/* download <items> by one remote tar, file names are passed in command line.
+ * the items not received are left 1 in <results>, return 1 if the remote
+ * command can not be run.
+ */
+static int recv_batch(sftp_t* s, const char* remote_path, int follnk, xstr_t* path,
+        size_t off, file_item_t** items, size_t n, int* results)
+{
+    ssh_exec_t* e;
+    xstr_t cmd;
+    char header[TAR_BLOCK + 1];
+    char name[512];
+    int ret = 0;
+    int status;
+    size_t k = 0;
+
+    xstr_init_ex(&cmd, TAR_MAX_ARGS + 512);
+    xstr_append(&cmd, "cd ");
+    ssh_quote_arg(&cmd, remote_path);
+    xstr_append(&cmd, follnk ? " && tar -chf - --" : " && tar -cf - --");
+    for (size_t i = 0; i < n; ++i) {
+        xstr_push_back(&cmd, ' ');
+        ssh_quote_arg(&cmd, file_item_path(items[i], path, off) + off);
+    }
+    e = ssh_exec_open(s->ssh, xstr_data(&cmd));
+    xstr_destroy(&cmd);
+    if (!e) {
+        snprintf(s->error, sizeof(s->error), "exec remote tar failed");
+        return 1;
+    }
+
+    name[0] = '\0';
+    while (ret != -2) {
+        uint64_t size;
+        char type;
+        int r;
+
+        if (read_full(e, header, TAR_BLOCK) != 0) {
+            ret = -2;
+            break;
+        }
+        if (header[TAR_NAME] == '\0') {
+            break; /* end of archive */
+        }
+        header[TAR_BLOCK] = '\0';
+        size = parse_octal(header + TAR_SIZE, 12);
+        type = header[TAR_TYPE];
+
+        /* GNU long name of the next entry */
+        if (type == 'L') {
+            if (size >= sizeof(name) || read_full(e, s->buf,
+                    (size_t)(size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK) != 0) {
+                ret = -2;
+                break;
+            }
+            memcpy(name, s->buf, (size_t)size);
+            name[size] = '\0';
+            continue;
+        }
+        if (name[0] == '\0') {
+            if (header[TAR_PREFIX]) {
+                snprintf(name, sizeof(name), "%.155s/%.100s", header + TAR_PREFIX, header + TAR_NAME);
+            } else {
+                snprintf(name, sizeof(name), "%.100s", header + TAR_NAME);
+            }
+        }
+
+        /* the entries must be the files asked in order */
+        if ((type != '0' && type != '\0') || k == n
+                || strcmp(name, file_item_path(items[k], path, off) + off) != 0) {
+            snprintf(s->error, sizeof(s->error), "unexpected entry in remote tar");
+            ret = -2;
+            break;
+        }
+        r = read_file(s, e, xstr_data(path), xstr_data(path) + off, size,
+                (int)parse_octal(header + TAR_MODE, 8),
+                (time_t)parse_octal(header + TAR_MTIME, 12));
+        if (r == -2) {
+            ret = r;
+            break;
+        }
+        results[k] = r;
+        if (r != 0) {
+            ret = -1;
+        }
+        ++k;
+        name[0] = '\0';
+    }
+
+    if (ret == -2) {
+        ssh_exec_abort(e);
+        status = -1;
+    } else {
+        status = ssh_exec_close(e);
+    }
+    if (ret == 0 && (status != 0 || k < n)) {
+        snprintf(s->error, sizeof(s->error), "remote tar failed (%d)", status);
+        ret = -1;
+    } else if (ret == -2 && s->error[0] == '\0') {
+        snprintf(s->error, sizeof(s->error), "read remote tar failed");
+    }
+    return ret == 0 ? 0 : -1;
+}
+
+int tarball_recv(sftp_t* s, const char* local_path, const char* remote_path,
+        int follnk, file_item_t** items, size_t n, int* results)
+{
+    xstr_t path;
+    size_t off;
+    size_t first = 0;
+    size_t len = 0;
+    int ret = 0;
+
+    s->error[0] = '\0';
+
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, local_path);
+    xstr_push_back(&path, '/');
+    off = xstr_size(&path);
+
+    for (size_t i = 0; i < n; ++i) {
+        results[i] = 1;
+    }
+    /* keep the command line short */
+    for (size_t i = 0; i < n; ++i) {
+        len += file_item_path_len(items[i]) + 3;
+        if (len > TAR_MAX_ARGS || i + 1 == n) {
+            int r = recv_batch(s, remote_path, follnk, &path, off, items + first,
+                        i + 1 - first, results + first);
+
+            if (r > 0) {
+                ret = -1;
+                break; /* the rest is not run either */
+            }
+            if (r != 0) {
+                ret = -1;
+            }
+            first = i + 1;
+            len = 0;
+        }
+    }
+
+    xstr_destroy(&path);
+    return ret;
+}
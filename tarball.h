@@ -0,0 +1,27 @@
+#ifndef _TARBALL_H_
+#define _TARBALL_H_
+
+#include "match.h"
+#include "ssh_session.h"
+
+/* return 1 if <item> can be put in a tar stream, regular files must be
+ * smaller than <threshold> bytes, directories are only bundled in upload.
+ */
+int tarball_wanted(file_item_t* item, uint64_t threshold, int reverse);
+
+/* upload <items> in one tar stream which is extracted by the remote tar,
+ * mode and mtime of the files are kept. <results> gets 0 for each item
+ * done, -1 for failed and 1 for the ones left to be transferred one by
+ * one, e.g. if the remote command can not be run. <s->error> is set if any
+ * fails, return 0 if all are done.
+ */
+int tarball_send(sftp_t* s, const char* local_path, const char* remote_path,
+        file_item_t** items, size_t n, int* results);
+/* download <items> which are packed by the remote tar in batches, links
+ * are packed as their targets with <follnk>. the items of a failed batch
+ * are left to be transferred one by one.
+ */
+int tarball_recv(sftp_t* s, const char* local_path, const char* remote_path,
+        int follnk, file_item_t** items, size_t n, int* results);
+
+#endif // _TARBALL_H_
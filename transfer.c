@@ -0,0 +1,926 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "transfer.h"
+#include "delta.h"
+#include "resume.h"
+#include "tarball.h"
+#include "xstring.h"
+#include "xthread.h"
+
+typedef struct transfer transfer_t;
+
+/* a file larger than <split_size> is split into parts, each part is a task
+ * written in place, the one finishes last sets the final file size. a
+ * resumed file is the same but its parts start from the resume offset.
+ */
+typedef struct {
+    int left;           /* number of unfinished parts */
+    int failed;
+    char error[128];    /* error of the first failed part */
+} split_t;
+
+typedef struct {
+    file_item_t* item;
+    uint64_t offset;
+    uint64_t length;
+    split_t* split;     /* NULL if the task is the whole file */
+    int delta;          /* upload the whole file by <delta_send_file> */
+    void* owner;        /* freed when the file is done, may be NULL */
+} task_t;
+
+typedef struct {
+    transfer_t* t;
+    ssh_t* ssh;         /* NULL if <sftp> is the main session or pooled */
+    sftp_t* sftp;
+    xstr_t local;
+    xstr_t remote;
+    size_t ol;
+    size_t or;
+    xthread_t thread;
+} worker_t;
+
+struct transfer {
+    config_t* cfg;
+    int reverse;
+    task_t* tasks;
+    size_t ntasks;
+    size_t next;        /* index of the next task to be taken */
+    xmutex_t mutex;     /* protects <next>, the queue and stdout */
+    worker_t* workers;
+    int nworkers;
+    transfer_pool_t* pool;  /* keeps the sessions opened, may be NULL */
+    /* the queue of <transfer_stream> */
+    task_t* queue;
+    size_t qhead;
+    size_t qcount;
+    size_t qcap;
+    int closed;         /* no more tasks are queued */
+    xcond_t cond;       /* a task is queued or the queue is closed */
+    int nthreads;       /* the workers taking from the queue */
+    uint64_t split_size;
+};
+
+static void worker_init(worker_t* w, transfer_t* t, ssh_t* ssh, sftp_t* sftp)
+{
+    w->t = t;
+    w->ssh = ssh;
+    w->sftp = sftp;
+
+    xstr_init_ex(&w->local, 512);
+    xstr_append(&w->local, t->cfg->local_path);
+    xstr_push_back(&w->local, '/');
+
+    xstr_init_ex(&w->remote, 512);
+    xstr_append(&w->remote, t->cfg->remote_path);
+    xstr_push_back(&w->remote, '/');
+
+    w->ol = xstr_size(&w->local);
+    w->or = xstr_size(&w->remote);
+}
+
+static void worker_destroy(worker_t* w)
+{
+    if (w->ssh) {
+        sftp_session_free(w->sftp);
+        ssh_session_close(w->ssh);
+    }
+    xstr_destroy(&w->local);
+    xstr_destroy(&w->remote);
+}
+
+static int worker_transfer(worker_t* w, task_t* task)
+{
+    file_item_t* item = task->item;
+
+    file_item_path(item, &w->local, w->ol);
+    xstr_assign_at(&w->remote, w->or, xstr_data(&w->local) + w->ol);
+
+    if (task->delta) {
+        return delta_send_file(w->sftp, xstr_data(&w->local), xstr_data(&w->remote),
+                    item->mode, item->mtime, item->size, item->exist_size);
+    }
+    if (task->split) {
+        if (w->t->reverse) {
+            return sftp_recv_range(w->sftp, xstr_data(&w->local), xstr_data(&w->remote),
+                        item->mode, task->offset, task->length);
+        }
+        return sftp_send_range(w->sftp, xstr_data(&w->local), xstr_data(&w->remote),
+                    item->mode, task->offset, task->length);
+    }
+    if (w->t->reverse) {
+        return sftp_recv_file(w->sftp, xstr_data(&w->local), xstr_data(&w->remote),
+                    item->mode, item->is_exist, item->mtime, item->size);
+    }
+    return sftp_send_file(w->sftp, xstr_data(&w->local), xstr_data(&w->remote),
+                item->mode, item->is_exist, item->mtime, item->size);
+}
+
+/* called after a part of <task> is done, return 0 if it is not the last
+ * part, 1 if the file is done, -1 if any part failed.
+ */
+static int worker_finish_part(worker_t* w, task_t* task, int ret)
+{
+    transfer_t* t = w->t;
+    split_t* split = task->split;
+    int left;
+
+    xmutex_lock(&t->mutex);
+    if (ret != 0 && !split->failed) {
+        split->failed = 1;
+        strcpy(split->error, w->sftp->error);
+    }
+    left = --split->left;
+    xmutex_unlock(&t->mutex);
+
+    if (left > 0) {
+        return 0;
+    }
+    if (split->failed) {
+        strcpy(w->sftp->error, split->error);
+        return -1;
+    }
+    /* <w->local> and <w->remote> are still the path of the file */
+    if (t->reverse) {
+        ret = sftp_recv_finish(w->sftp, xstr_data(&w->local), task->item->size);
+    } else {
+        ret = sftp_send_finish(w->sftp, xstr_data(&w->remote), task->item->size);
+    }
+    return ret == 0 ? 1 : -1;
+}
+
+/* transfer <task> by <w> with progress. */
+static void run_task_progress(worker_t* w, task_t* task)
+{
+    file_item_t* item = task->item;
+    const char* file = file_item_path(item, &w->local, w->ol) + w->ol;
+    int ret;
+
+    if (w->t->reverse) {
+        fprintf(stdout, item->is_exist
+                    ? "\033[31m [DOWNLD]\033[0m \033[s---- %s \033[?25l\033[31m"
+                    : "\033[32m [DOWNLD]\033[0m \033[s---- %s \033[?25l\033[31m", file);
+    } else {
+        fprintf(stdout, item->is_exist
+                    ? "\033[31m [UPLOAD]\033[0m \033[s---- %s \033[?25l\033[31m"
+                    : "\033[32m [UPLOAD]\033[0m \033[s---- %s \033[?25l\033[31m", file);
+    }
+    ret = worker_transfer(w, task);
+    if (task->split) {
+        ret = worker_finish_part(w, task, ret) > 0 ? 0 : -1;
+    }
+    item->is_done = ret == 0;
+    if (ret != 0) {
+        fprintf(stdout, "%s", w->sftp->error);
+    }
+    fprintf(stdout, "\033[0m\033[?25h\n");
+    free(task->owner);
+}
+
+/* transfer the tasks one by one with progress. */
+static void run_tasks_sequential(transfer_t* t)
+{
+    for (size_t i = 0; i < t->ntasks; ++i) {
+        run_task_progress(&t->workers[0], &t->tasks[i]);
+    }
+}
+
+/* print one line of a finished file of <w> without progress. */
+static void print_result(worker_t* w, file_item_t* item, int ret)
+{
+    item->is_done = ret == 0;
+    fprintf(stdout, item->is_exist ? "\033[31m [%s]\033[0m %s %s"
+                : "\033[32m [%s]\033[0m %s %s", w->t->reverse ? "DOWNLD" : "UPLOAD",
+            ret == 0 && LIBSSH2_SFTP_S_ISREG(item->mode) ? "100%" : "----",
+            file_item_path(item, &w->local, w->ol) + w->ol);
+    if (ret != 0) {
+        fprintf(stdout, " \033[31m%s\033[0m", w->sftp->error);
+    }
+    fprintf(stdout, "\n");
+}
+
+/* transfer <task> by <w> in parallel with the other workers. */
+static void worker_run(worker_t* w, task_t* task)
+{
+    transfer_t* t = w->t;
+    int ret = worker_transfer(w, task);
+
+    if (task->split) {
+        ret = worker_finish_part(w, task, ret);
+        if (ret == 0) {
+            return;
+        }
+        ret = ret > 0 ? 0 : -1;
+    }
+
+    /* no progress in parallel, print one line per finished file */
+    xmutex_lock(&t->mutex);
+    print_result(w, task->item, ret);
+    xmutex_unlock(&t->mutex);
+    free(task->owner);
+}
+
+static void worker_routine(void* arg)
+{
+    worker_t* w = arg;
+    transfer_t* t = w->t;
+
+    while (1) {
+        task_t* task;
+
+        xmutex_lock(&t->mutex);
+        if (t->next == t->ntasks) {
+            xmutex_unlock(&t->mutex);
+            break;
+        }
+        task = &t->tasks[t->next++];
+        xmutex_unlock(&t->mutex);
+
+        worker_run(w, task);
+    }
+}
+
+/* transfer <tasks> by all workers, return when all tasks are done. */
+static void run_tasks(transfer_t* t, task_t* tasks, size_t ntasks)
+{
+    int n = (size_t)t->nworkers < ntasks ? t->nworkers : (int)ntasks;
+    int i;
+
+    t->tasks = tasks;
+    t->ntasks = ntasks;
+    t->next = 0;
+
+    /* the main thread works as worker 0 */
+    for (i = 1; i < n; ++i) {
+        if (xthread_create(&t->workers[i].thread, worker_routine, &t->workers[i]) != 0) {
+            break;
+        }
+    }
+    worker_routine(&t->workers[0]);
+
+    while (--i > 0) {
+        xthread_join(&t->workers[i].thread);
+    }
+}
+
+/* the sessions opened besides the main one, which are kept open. */
+struct transfer_pool {
+    ssh_t** ssh;
+    sftp_t** sftp;
+    int count;
+    int cap;
+};
+
+transfer_pool_t* transfer_pool_new(void)
+{
+    return calloc(1, sizeof(transfer_pool_t));
+}
+
+void transfer_pool_keepalive(transfer_pool_t* p)
+{
+    int idle;
+    int n = 0;
+
+    for (int i = 0; i < p->count; ++i) {
+        if (libssh2_keepalive_send(p->ssh[i], &idle) != 0) {
+            sftp_session_free(p->sftp[i]);
+            ssh_session_close(p->ssh[i]);
+            continue;
+        }
+        p->ssh[n] = p->ssh[i];
+        p->sftp[n++] = p->sftp[i];
+    }
+    p->count = n;
+}
+
+void transfer_pool_free(transfer_pool_t* p)
+{
+    for (int i = 0; i < p->count; ++i) {
+        sftp_session_free(p->sftp[i]);
+        ssh_session_close(p->ssh[i]);
+    }
+    free(p->ssh);
+    free(p->sftp);
+    free(p);
+}
+
+static void pool_add(transfer_pool_t* p, ssh_t* ssh, sftp_t* sftp)
+{
+    if (p->count == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 4;
+        p->ssh = realloc(p->ssh, p->cap * sizeof(ssh_t*));
+        p->sftp = realloc(p->sftp, p->cap * sizeof(sftp_t*));
+    }
+    libssh2_keepalive_config(ssh, 1, 30);
+    p->ssh[p->count] = ssh;
+    p->sftp[p->count++] = sftp;
+}
+
+/* open <jobs> - 1 more sessions, the ones kept in <t->pool> are taken
+ * first. sessions are opened one by one in the main thread, if one fails
+ * the transfer goes on with less workers.
+ */
+static void open_workers(transfer_t* t, sftp_t* sftp, int jobs)
+{
+    config_t* cfg = t->cfg;
+
+    t->workers = malloc(jobs * sizeof(worker_t));
+    t->nworkers = 1;
+    worker_init(&t->workers[0], t, NULL, sftp);
+
+    while (t->nworkers < jobs) {
+        ssh_t* ssh;
+        sftp_t* s;
+
+        if (t->pool && t->nworkers <= t->pool->count) {
+            worker_init(&t->workers[t->nworkers], t, NULL, t->pool->sftp[t->nworkers - 1]);
+            ++t->nworkers;
+            continue;
+        }
+        ssh = ssh_session_open(cfg->remote_host, cfg->remote_port,
+                cfg->use_compress, cfg->remote_user, cfg->remote_passwd);
+
+        if (!ssh) {
+            fprintf(stderr, "ssh_session_open failed, use %d sessions.\n", t->nworkers);
+            break;
+        }
+        s = sftp_session_new(ssh);
+        if (!s) {
+            fprintf(stderr, "sftp_session_new failed, use %d sessions.\n", t->nworkers);
+            ssh_session_close(ssh);
+            break;
+        }
+        s->progress = 0;
+        if (t->pool) {
+            pool_add(t->pool, ssh, s);
+            ssh = NULL;
+        }
+        worker_init(&t->workers[t->nworkers++], t, ssh, s);
+    }
+}
+
+/* append the tasks of <item> to <tasks>, return the number of tasks. if
+ * <split> is not NULL, the file from <offset> is split into parts of
+ * <split_size>, or only one part if <split_size> is 0.
+ */
+static size_t add_tasks(task_t* tasks, split_t* split, file_item_t* item,
+        uint64_t offset, uint64_t split_size)
+{
+    size_t n = 0;
+
+    if (!split) {
+        tasks[0].item = item;
+        tasks[0].offset = 0;
+        tasks[0].length = item->size;
+        tasks[0].split = NULL;
+        tasks[0].delta = 0;
+        tasks[0].owner = NULL;
+        return 1;
+    }
+
+    split->failed = 0;
+    split->error[0] = '\0';
+    while (offset < item->size) {
+        tasks[n].item = item;
+        tasks[n].offset = offset;
+        tasks[n].length = split_size && item->size - offset > split_size
+                ? split_size : item->size - offset;
+        tasks[n].split = split;
+        tasks[n].delta = 0;
+        tasks[n].owner = NULL;
+        offset += tasks[n++].length;
+    }
+    split->left = (int)n;
+    return n;
+}
+
+static int can_split(file_item_t* item, uint64_t split_size)
+{
+    return split_size > 0 && LIBSSH2_SFTP_S_ISREG(item->mode) && item->size > split_size;
+}
+
+/* return where to go on transferring a partial <item>, 0 to start over. */
+static uint64_t get_resume_offset(config_t* cfg, sftp_t* sftp, file_item_t* item)
+{
+    xstr_t local, remote;
+    uint64_t offset;
+
+    if (!cfg->resume_transfer || item->exist_size == 0 || item->exist_size >= item->size) {
+        return 0;
+    }
+    xstr_init_ex(&local, 512);
+    xstr_append(&local, cfg->local_path);
+    xstr_push_back(&local, '/');
+    file_item_path(item, &local, xstr_size(&local));
+
+    xstr_init_ex(&remote, 512);
+    xstr_append(&remote, cfg->remote_path);
+    xstr_push_back(&remote, '/');
+    file_item_path(item, &remote, xstr_size(&remote));
+
+    offset = resume_offset(sftp->ssh, xstr_data(&local), xstr_data(&remote), item->exist_size);
+
+    xstr_destroy(&local);
+    xstr_destroy(&remote);
+    return offset;
+}
+
+/* the sort key of a task for <schedule_tasks> */
+typedef struct {
+    int rank;           /* directories, the priority files, then the others */
+    uint64_t size;      /* the smaller goes first */
+    size_t index;
+} schedule_key_t;
+
+static int cmp_schedule_key(const void* l, const void* r)
+{
+    const schedule_key_t* a = l;
+    const schedule_key_t* b = r;
+
+    if (a->rank != b->rank) {
+        return a->rank < b->rank ? -1 : 1;
+    }
+    if (a->size != b->size) {
+        return a->size < b->size ? -1 : 1;
+    }
+    return a->index < b->index ? -1 : (a->index > b->index);
+}
+
+/* reorder <tasks> by <cfg->transfer_order> and <cfg->priorities>, the
+ * directories keep their order before the files, and the parts of a file
+ * stay together.
+ */
+static void schedule_tasks(config_t* cfg, task_t* tasks, size_t n)
+{
+    schedule_key_t* keys;
+    task_t* sorted;
+    xstr_t path;
+
+    if (n < 2 || (cfg->transfer_order == ORDER_PATH && !cfg->priority_files[0])) {
+        return;
+    }
+    keys = malloc(n * sizeof(schedule_key_t));
+    xstr_init_ex(&path, 512);
+    for (size_t i = 0; i < n; ++i) {
+        file_item_t* item = tasks[i].item;
+
+        if (LIBSSH2_SFTP_S_ISDIR(item->mode)) {
+            keys[i].rank = 0;
+        } else {
+            keys[i].rank = ignore_match(cfg->priorities, file_item_path(item, &path, 0)) ? 1 : 2;
+        }
+        keys[i].size = 0;
+        if (keys[i].rank > 0 && cfg->transfer_order == ORDER_SMALL_FIRST) {
+            keys[i].size = item->size;
+        } else if (keys[i].rank > 0 && cfg->transfer_order == ORDER_LARGE_FIRST) {
+            keys[i].size = UINT64_MAX - item->size;
+        }
+        keys[i].index = i;
+    }
+    qsort(keys, n, sizeof(schedule_key_t), cmp_schedule_key);
+
+    sorted = malloc(n * sizeof(task_t));
+    for (size_t i = 0; i < n; ++i) {
+        sorted[i] = tasks[keys[i].index];
+    }
+    memcpy(tasks, sorted, n * sizeof(task_t));
+
+    free(sorted);
+    xstr_destroy(&path);
+    free(keys);
+}
+
+/* transfer the small files in tar streams by the main session, the ones
+ * the tar does not finish are transferred one by one.
+ */
+static void run_tarball(transfer_t* t, file_item_t** items, size_t n)
+{
+    worker_t* w = &t->workers[0];
+    config_t* cfg = t->cfg;
+    int progress = w->sftp->progress;
+    int* results = malloc(n * sizeof(int));
+
+    if (t->reverse) {
+        tarball_recv(w->sftp, cfg->local_path, cfg->remote_path, cfg->follow_link,
+            items, n, results);
+    } else {
+        tarball_send(w->sftp, cfg->local_path, cfg->remote_path, items, n, results);
+    }
+
+    w->sftp->progress = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (results[i] > 0) {
+            task_t task;
+
+            add_tasks(&task, NULL, items[i], 0, 0);
+            print_result(w, items[i], worker_transfer(w, &task));
+        } else {
+            print_result(w, items[i], results[i]);
+        }
+    }
+    w->sftp->progress = progress;
+    free(results);
+}
+
+/* return 1 if <item> is below the directory <node>. */
+static int is_below(const file_item_t* item, const path_node_t* node)
+{
+    const path_node_t* n = item->node->parent;
+
+    while (n && n->depth > node->depth) {
+        n = n->parent;
+    }
+    return n == node;
+}
+
+void transfer_items(file_table_t* items, config_t* cfg, sftp_t* sftp, int reverse, int jobs,
+        transfer_pool_t* pool)
+{
+    transfer_t t;
+    uint64_t split_size = jobs > 1 ? (uint64_t)cfg->split_size * 1024 * 1024 : 0;
+    task_t* files;
+    task_t* dirs = NULL;
+    split_t* splits = NULL;
+    file_item_t** tars = NULL;
+    file_item_t* rows;
+    size_t* from;
+    size_t nrows = 0;
+    size_t ntars = 0;
+    const path_node_t* untarred = NULL;
+    size_t nfiles = 0;
+    size_t ndirs = 0;
+    size_t nsplits = 0;
+    size_t ntasks = 0;
+    int maxdepth = 0;
+
+    /* count the tasks first, a split file has one task per part at most */
+    for (size_t i = 0; i < items->count; ++i) {
+        if (!(items->flags[i] & FILE_NEWER) || !get_ftype_str(items->mode[i])) {
+            continue;
+        }
+        if (split_size > 0 && LIBSSH2_SFTP_S_ISREG(items->mode[i])
+                && items->size[i] > split_size) {
+            ntasks += (size_t)((items->size[i] + split_size - 1) / split_size);
+            ++nsplits;
+        } else {
+            ++ntasks;
+            nsplits += items->exist_size[i] > 0;
+        }
+        ++nrows;
+    }
+
+    /* the tasks point to the rows of the newer items, whose results are put
+     * back into the table at last.
+     */
+    rows = malloc((nrows ? nrows : 1) * sizeof(file_item_t));
+    from = malloc((nrows ? nrows : 1) * sizeof(size_t));
+    nrows = 0;
+    for (size_t i = 0; i < items->count; ++i) {
+        if ((items->flags[i] & FILE_NEWER) && get_ftype_str(items->mode[i])) {
+            file_table_get(items, i, &rows[nrows]);
+            from[nrows++] = i;
+        }
+    }
+
+    files = malloc((ntasks ? ntasks : 1) * sizeof(task_t));
+    if (jobs > 1) {
+        dirs = malloc((ntasks ? ntasks : 1) * sizeof(task_t));
+    }
+    if (nsplits > 0) {
+        splits = malloc(nsplits * sizeof(split_t));
+        nsplits = 0;
+    }
+    if (cfg->tar_threshold > 0) {
+        tars = malloc((ntasks ? ntasks : 1) * sizeof(file_item_t*));
+    }
+    for (size_t i = 0; i < nrows; ++i) {
+        file_item_t* item = &rows[i];
+
+        /* the remote tar creates the missing parents of what it extracts,
+         * so nothing below a new directory left out of it goes in, or the
+         * directory would exist before it is created.
+         */
+        if (untarred && !is_below(item, untarred)) {
+            untarred = NULL;
+        }
+        if (tars && !untarred
+                && tarball_wanted(item, (uint64_t)cfg->tar_threshold * 1024, reverse)) {
+            tars[ntars++] = item;
+            continue;
+        }
+        if (tars && !reverse && !untarred && !item->is_exist
+                && LIBSSH2_SFTP_S_ISDIR(item->mode)) {
+            untarred = item->node;
+        }
+        if (dirs && LIBSSH2_SFTP_S_ISDIR(item->mode)) {
+            int depth = (int)item->node->depth;
+
+            if (depth > maxdepth) {
+                maxdepth = depth;
+            }
+            ndirs += add_tasks(&dirs[ndirs], NULL, item, 0, 0);
+        } else {
+            uint64_t offset = get_resume_offset(cfg, sftp, item);
+            int delta = offset == 0 && !reverse && cfg->delta_transfer
+                        && item->exist_size >= DELTA_MIN_SIZE;
+
+            if (offset > 0 || (!delta && can_split(item, split_size))) {
+                nfiles += add_tasks(&files[nfiles], &splits[nsplits++],
+                            item, offset, split_size);
+            } else {
+                nfiles += add_tasks(&files[nfiles], NULL, item, 0, 0);
+                files[nfiles - 1].delta = delta;
+            }
+        }
+    }
+
+    schedule_tasks(cfg, files, nfiles);
+
+    t.cfg = cfg;
+    t.reverse = reverse;
+    t.pool = pool;
+    xmutex_init(&t.mutex);
+
+    /* the tar stream creates the directories for upload, and needs the
+     * directories created before for download.
+     */
+    if (!dirs) {
+        open_workers(&t, sftp, 1);
+        if (ntars > 0 && !reverse) {
+            run_tarball(&t, tars, ntars);
+        }
+        t.tasks = files;
+        t.ntasks = nfiles;
+        run_tasks_sequential(&t);
+    } else {
+        task_t* level = malloc((ndirs + 1) * sizeof(task_t));
+        size_t most = nfiles > ndirs ? nfiles : ndirs;
+
+        sftp->progress = 0;
+        open_workers(&t, sftp, (size_t)jobs < most ? jobs : (most ? (int)most : 1));
+        if (ntars > 0 && !reverse) {
+            run_tarball(&t, tars, ntars);
+        }
+
+        /* create directories level by level, then the files in them */
+        for (int depth = 1; depth <= maxdepth; ++depth) {
+            size_t n = 0;
+
+            for (size_t i = 0; i < ndirs; ++i) {
+                if ((int)dirs[i].item->node->depth == depth) {
+                    level[n++] = dirs[i];
+                }
+            }
+            run_tasks(&t, level, n);
+        }
+        run_tasks(&t, files, nfiles);
+
+        sftp->progress = 1;
+        free(level);
+    }
+    if (ntars > 0 && reverse) {
+        run_tarball(&t, tars, ntars);
+    }
+
+    for (int i = 0; i < t.nworkers; ++i) {
+        worker_destroy(&t.workers[i]);
+    }
+    free(t.workers);
+    xmutex_destroy(&t.mutex);
+
+    for (size_t i = 0; i < nrows; ++i) {
+        if (rows[i].is_done) {
+            items->flags[from[i]] |= FILE_DONE;
+        } else {
+            items->flags[from[i]] &= ~FILE_DONE;
+        }
+    }
+    free(from);
+    free(rows);
+    free(splits);
+    free(tars);
+    free(dirs);
+    free(files);
+}
+
+/* the pipelined transfer, the main thread lists and compares one directory
+ * at a time with worker 0, and queues the tasks of its newer files, which
+ * the other workers take at once. a directory is created before the files
+ * in it are listed. when the queue is full, the main thread transfers the
+ * oldest task itself, and all of them after the listing.
+ */
+#define STREAM_QUEUE_SIZE   1024
+
+/* a copy of a queued file with its whole path, the listed items may be
+ * moved or dropped before it is done.
+ */
+typedef struct {
+    file_item_t item;
+    split_t split;
+} stream_file_t;
+
+static stream_file_t* new_stream_file(worker_t* w, const file_item_t* item)
+{
+    const char* file = file_item_path(item, &w->local, w->ol) + w->ol;
+    size_t len = xstr_size(&w->local) - w->ol;
+    stream_file_t* sf = malloc(sizeof(stream_file_t) + sizeof(path_node_t) + len + 1);
+    path_node_t* node = (path_node_t*)(sf + 1);
+
+    node->parent = NULL;
+    node->depth = 1;
+    node->len = (uint32_t)len;
+    memcpy(node->name, file, len + 1);
+    sf->item = *item;
+    sf->item.node = node;
+    return sf;
+}
+
+static void stream_push(transfer_t* t, task_t* task)
+{
+    task_t oldest;
+
+    if (t->nworkers == 1) {
+        run_task_progress(&t->workers[0], task);
+        return;
+    }
+    xmutex_lock(&t->mutex);
+    if (t->qcount < t->qcap) {
+        t->queue[(t->qhead + t->qcount++) % t->qcap] = *task;
+        xcond_signal(&t->cond);
+        xmutex_unlock(&t->mutex);
+        return;
+    }
+    oldest = t->queue[t->qhead];
+    t->queue[t->qhead] = *task;
+    t->qhead = (t->qhead + 1) % t->qcap;
+    xmutex_unlock(&t->mutex);
+
+    worker_run(&t->workers[0], &oldest);
+}
+
+/* take the oldest task, return -1 if the queue is closed and empty. */
+static int stream_pop(transfer_t* t, task_t* task)
+{
+    xmutex_lock(&t->mutex);
+    while (t->qcount == 0 && !t->closed) {
+        xcond_wait(&t->cond, &t->mutex);
+    }
+    if (t->qcount == 0) {
+        xmutex_unlock(&t->mutex);
+        return -1;
+    }
+    *task = t->queue[t->qhead];
+    t->qhead = (t->qhead + 1) % t->qcap;
+    --t->qcount;
+    xmutex_unlock(&t->mutex);
+    return 0;
+}
+
+static void stream_routine(void* arg)
+{
+    worker_t* w = arg;
+    task_t task;
+
+    while (stream_pop(w->t, &task) == 0) {
+        worker_run(w, &task);
+    }
+}
+
+/* queue the newer items of a listed directory. */
+static void stream_items(file_table_t* items, size_t first, size_t last, void* arg)
+{
+    transfer_t* t = arg;
+    worker_t* w = &t->workers[0];
+
+    for (size_t i = first; i < last; ++i) {
+        file_item_t* item;
+        file_item_t row;
+        stream_file_t* sf;
+        task_t task;
+        uint64_t offset;
+        int delta;
+
+        if (!(items->flags[i] & FILE_NEWER) || !get_ftype_str(items->mode[i])) {
+            continue;
+        }
+        file_table_get(items, i, &row);
+        sf = new_stream_file(w, &row);
+        item = &sf->item;
+
+        if (LIBSSH2_SFTP_S_ISDIR(item->mode)) {
+            add_tasks(&task, NULL, item, 0, 0);
+            task.owner = sf;
+            if (t->nworkers == 1) {
+                run_task_progress(w, &task);
+            } else {
+                worker_run(w, &task);
+            }
+            continue;
+        }
+
+        offset = get_resume_offset(t->cfg, w->sftp, item);
+        delta = offset == 0 && !t->reverse && t->cfg->delta_transfer
+                && item->exist_size >= DELTA_MIN_SIZE;
+        if (offset > 0 || (!delta && can_split(item, t->split_size))) {
+            size_t n = t->split_size
+                    ? (size_t)((item->size - offset + t->split_size - 1) / t->split_size) : 1;
+            task_t* tasks = malloc(n * sizeof(task_t));
+
+            n = add_tasks(tasks, &sf->split, item, offset, t->split_size);
+            for (size_t k = 0; k < n; ++k) {
+                tasks[k].owner = sf;
+                stream_push(t, &tasks[k]);
+            }
+            free(tasks);
+        } else {
+            add_tasks(&task, NULL, item, 0, 0);
+            task.delta = delta;
+            task.owner = sf;
+            stream_push(t, &task);
+        }
+    }
+}
+
+/* open the workers of a pipelined transfer and start the ones besides the
+ * main thread.
+ */
+static void stream_begin(transfer_t* t, config_t* cfg, sftp_t* sftp, int reverse, int jobs)
+{
+    memset(t, 0, sizeof(transfer_t));
+    t->cfg = cfg;
+    t->reverse = reverse;
+    xmutex_init(&t->mutex);
+    xcond_init(&t->cond);
+
+    open_workers(t, sftp, jobs > 1 ? jobs : 1);
+    t->nthreads = 1;
+    if (t->nworkers > 1) {
+        sftp->progress = 0;
+        t->split_size = (uint64_t)cfg->split_size * 1024 * 1024;
+        t->qcap = STREAM_QUEUE_SIZE;
+        t->queue = malloc(t->qcap * sizeof(task_t));
+        for (; t->nthreads < t->nworkers; ++t->nthreads) {
+            if (xthread_create(&t->workers[t->nthreads].thread, stream_routine,
+                    &t->workers[t->nthreads]) != 0) {
+                break;
+            }
+        }
+    }
+}
+
+/* transfer the rest of the queue and close the workers. */
+static void stream_end(transfer_t* t, sftp_t* sftp)
+{
+    task_t task;
+
+    if (t->nworkers > 1) {
+        xmutex_lock(&t->mutex);
+        t->closed = 1;
+        xcond_broadcast(&t->cond);
+        xmutex_unlock(&t->mutex);
+
+        while (stream_pop(t, &task) == 0) {
+            worker_run(&t->workers[0], &task);
+        }
+        while (--t->nthreads > 0) {
+            xthread_join(&t->workers[t->nthreads].thread);
+        }
+        sftp->progress = 1;
+    }
+
+    for (int i = 0; i < t->nworkers; ++i) {
+        worker_destroy(&t->workers[i]);
+    }
+    free(t->workers);
+    free(t->queue);
+    xcond_destroy(&t->cond);
+    xmutex_destroy(&t->mutex);
+}
+
+void transfer_stream(config_t* cfg, sftp_t* sftp, int reverse, int jobs)
+{
+    transfer_t t;
+
+    stream_begin(&t, cfg, sftp, reverse, jobs);
+    if (reverse) {
+        iterate_directory_stream(cfg->remote_path, cfg->local_path, cfg->ignores,
+            cfg->follow_link, cfg->resume_transfer, 1, sftp, stream_items, &t);
+    } else {
+        iterate_directory_stream(cfg->local_path, cfg->remote_path, cfg->ignores,
+            cfg->follow_link, cfg->resume_transfer, 0, sftp, stream_items, &t);
+    }
+    stream_end(&t, sftp);
+}
+
+void transfer_listing(listing_t* l, config_t* cfg, sftp_t* sftp, int reverse, int jobs)
+{
+    transfer_t t;
+    file_table_t* items;
+
+    stream_begin(&t, cfg, sftp, reverse, jobs);
+    while (iterate_listing_next(l, &items) == 0) {
+        stream_items(items, 0, items->count, &t);
+    }
+    stream_end(&t, sftp);
+}
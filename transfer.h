@@ -0,0 +1,45 @@
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+#include "config.h"
+#include "match.h"
+#include "ssh_session.h"
+
+/* the sessions opened for parallel jobs, which are kept open across the
+ * transfers given it.
+ */
+typedef struct transfer_pool transfer_pool_t;
+
+transfer_pool_t* transfer_pool_new(void);
+/* keep the idle sessions of <p> alive, the broken ones are closed and
+ * opened again when needed.
+ */
+void transfer_pool_keepalive(transfer_pool_t* p);
+void transfer_pool_free(transfer_pool_t* p);
+
+/* upload (or download if <reverse>) the newer files in <items>.
+ * if <jobs> > 1, <jobs> - 1 more sessions are opened and the files are
+ * spread across them, directories are created before the files in them.
+ * with <pool>, the sessions are taken from and left open in it, otherwise
+ * they are closed after the transfer.
+ * files larger than <cfg->split_size> MiB are split into parts which are
+ * transferred by different sessions. with <cfg->resume_transfer>, a
+ * partial destination file goes on from the end of its verified content.
+ * the files go in <cfg->transfer_order>, the ones of <cfg->priorities>
+ * before the others.
+ */
+void transfer_items(file_table_t* items, config_t* cfg, sftp_t* sftp, int reverse, int jobs,
+        transfer_pool_t* pool);
+
+/* list, compare and transfer the newer files as <transfer_items> does, but
+ * one directory at a time, so the transfer does not wait for the whole
+ * listing. it does not send small files by tar, and keeps the path order.
+ */
+void transfer_stream(config_t* cfg, sftp_t* sftp, int reverse, int jobs);
+
+/* transfer the newer files of <l> as <transfer_stream> does, a batch of
+ * them is merged while the ones before are transferred.
+ */
+void transfer_listing(listing_t* l, config_t* cfg, sftp_t* sftp, int reverse, int jobs);
+
+#endif // _TRANSFER_H_
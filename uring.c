@@ -0,0 +1,243 @@
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+
+#include "uring.h"
+
+/* a request slot, the index is the user data of its sqe */
+typedef struct {
+    struct statx stx;
+    struct stat* st;
+    void* data;
+} uring_slot_t;
+
+struct uring {
+    int fd;
+    /* submission ring */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    /* completion ring */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    unsigned entries;
+    unsigned queued;    /* not submitted yet */
+    unsigned inflight;  /* queued or submitted but not reaped */
+    uring_slot_t* slots;
+    unsigned* free_slots;
+    unsigned nfree;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* check if the kernel knows IORING_OP_STATX */
+static int statx_supported(int fd)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    int ret = 0;
+
+    if (io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0
+            && probe->last_op >= IORING_OP_STATX) {
+        ret = !!(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ret;
+}
+
+uring_t* uring_open(unsigned entries)
+{
+    struct io_uring_params p;
+    uring_t* r;
+    char* sq;
+    char* cq;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = io_uring_setup(entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!statx_supported(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(uring_t));
+    r->fd = fd;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = 0;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        uring_close(r);
+        return NULL;
+    }
+    if (r->cq_ring_size) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            uring_close(r);
+            return NULL;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        uring_close(r);
+        return NULL;
+    }
+
+    sq = r->sq_ring;
+    cq = r->cq_ring ? r->cq_ring : r->sq_ring;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(sq + p.sq_off.array);
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    /* the completion ring is larger, so it never overflows */
+    r->entries = p.sq_entries;
+    r->slots = malloc(r->entries * sizeof(uring_slot_t));
+    r->free_slots = malloc(r->entries * sizeof(unsigned));
+    for (unsigned i = 0; i < r->entries; ++i) {
+        r->free_slots[i] = r->entries - 1 - i;
+    }
+    r->nfree = r->entries;
+    return r;
+}
+
+void uring_close(uring_t* r)
+{
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->fd);
+    free(r->slots);
+    free(r->free_slots);
+    free(r);
+}
+
+unsigned uring_space(uring_t* r)
+{
+    return r->nfree;
+}
+
+void uring_stat(uring_t* r, int dirfd, const char* name, int follnk, struct stat* st,
+        void* data)
+{
+    unsigned slot = r->free_slots[--r->nfree];
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[index];
+
+    r->slots[slot].st = st;
+    r->slots[slot].data = data;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dirfd;
+    sqe->addr = (unsigned long)name;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_MTIME | STATX_SIZE;
+    sqe->off = (unsigned long)&r->slots[slot].stx;
+    sqe->statx_flags = follnk ? 0 : AT_SYMLINK_NOFOLLOW;
+    sqe->user_data = slot;
+
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++r->queued;
+    ++r->inflight;
+}
+
+int uring_reap(uring_t* r, void** data, int* res)
+{
+    unsigned head;
+    struct io_uring_cqe* cqe;
+    uring_slot_t* slot;
+
+    if (r->inflight == 0) {
+        return 1;
+    }
+    head = *r->cq_head;
+    while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        int n = io_uring_enter(r->fd, r->queued, 1, IORING_ENTER_GETEVENTS);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        r->queued -= (unsigned)n;
+    }
+
+    cqe = &r->cqes[head & *r->cq_mask];
+    slot = &r->slots[cqe->user_data];
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    if (*res == 0) {
+        memset(slot->st, 0, sizeof(*slot->st));
+        slot->st->st_mode = slot->stx.stx_mode;
+        slot->st->st_mtime = slot->stx.stx_mtime.tv_sec;
+        slot->st->st_size = (off_t)slot->stx.stx_size;
+    }
+    *data = slot->data;
+    r->free_slots[r->nfree++] = (unsigned)cqe->user_data;
+    --r->inflight;
+    return 0;
+}
+
+#endif // HAVE_IO_URING
@@ -0,0 +1,30 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/stat.h>
+
+/* a minimal io_uring to stat files in batches, only built on Linux with
+ * HAVE_IO_URING.
+ */
+typedef struct uring uring_t;
+
+/* return NULL if io_uring or its statx is not available. */
+uring_t* uring_open(unsigned entries);
+void uring_close(uring_t* r);
+
+/* return the number of requests which can be queued. */
+unsigned uring_space(uring_t* r);
+
+/* queue a stat of <name> relative to the directory <dirfd>, only the type,
+ * mode, mtime and size of <st> are set. <data> is returned by <uring_reap>.
+ */
+void uring_stat(uring_t* r, int dirfd, const char* name, int follnk, struct stat* st,
+        void* data);
+
+/* submit the queued requests and wait for one of them, its <data> and its
+ * result (0 or -errno) are returned. return 1 if nothing is in flight, -1
+ * if the ring fails.
+ */
+int uring_reap(uring_t* r, void** data, int* res);
+
+#endif // _URING_H_
@@ -0,0 +1,417 @@
+#ifdef __linux__
+#define _GNU_SOURCE /* ppoll */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#endif
+
+#include "watch.h"
+#include "match.h"
+#include "transfer.h"
+#include "xstring.h"
+
+#ifdef __linux__
+
+#define WATCH_EVENTS    (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE \
+                            | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct {
+    config_t* cfg;
+    int fd;
+    char** dirs;        /* relative path of the directory of each watch */
+    int ndirs;
+    xlist_t* touched;   /* relative paths of the touched files */
+    int overflow;       /* events are lost, the whole tree is synced */
+    int jobs;
+    transfer_pool_t* pool;  /* the sessions besides the main one */
+    char* skip;         /* relative path of the manifest file, or NULL */
+    size_t skiplen;
+} watch_t;
+
+/* set by SIGINT or SIGTERM, the touched files are uploaded before it stops */
+static volatile sig_atomic_t stopping;
+
+static void on_stop(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+static void free_name(void* v)
+{
+    free(*(char**)v);
+}
+
+static void touch(watch_t* w, const char* file, size_t len)
+{
+    char* name = malloc(len + 1);
+
+    memcpy(name, file, len);
+    name[len] = '\0';
+    *(char**)xlist_alloc_back(w->touched) = name;
+}
+
+static void set_dir(watch_t* w, int wd, const char* dir)
+{
+    if (wd >= w->ndirs) {
+        int n = w->ndirs ? w->ndirs : 64;
+
+        while (n <= wd) {
+            n *= 2;
+        }
+        w->dirs = realloc(w->dirs, n * sizeof(char*));
+        memset(w->dirs + w->ndirs, 0, (n - w->ndirs) * sizeof(char*));
+        w->ndirs = n;
+    }
+    free(w->dirs[wd]);
+    w->dirs[wd] = strdup(dir);
+}
+
+/* watch the directory <path> and the ones in it, the part of <path> after
+ * <off> is its relative path. with <touched> all files in it are taken as
+ * touched.
+ */
+static void add_dir(watch_t* w, xstr_t* path, size_t off, int touched)
+{
+    DIR* dir;
+    struct dirent* ent;
+    struct stat st;
+    size_t end = xstr_size(path);
+    int wd;
+
+    wd = inotify_add_watch(w->fd, xstr_data(path), WATCH_EVENTS);
+    if (wd < 0) {
+        fprintf(stderr, "watch (%s) failed (%s).\n", xstr_data(path), strerror(errno));
+        return;
+    }
+    set_dir(w, wd, xstr_data(path) + off);
+
+    /* added after the watch, a file created in between is not missed */
+    dir = opendir(xstr_data(path));
+    if (!dir) {
+        return;
+    }
+    while (!!(ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) {
+            continue;
+        }
+        xstr_append(path, ent->d_name);
+
+        if ((w->cfg->follow_link ? stat(xstr_data(path), &st)
+                    : lstat(xstr_data(path), &st)) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                xstr_push_back(path, '/');
+                if (!ignore_match(w->cfg->ignores, xstr_data(path) + off)) {
+                    if (touched) {
+                        touch(w, xstr_data(path) + off, xstr_size(path) - off - 1);
+                    }
+                    if (!ignore_prunes(w->cfg->ignores, xstr_data(path) + off)) {
+                        add_dir(w, path, off, touched);
+                    }
+                }
+            } else if (touched) {
+                touch(w, xstr_data(path) + off, xstr_size(path) - off);
+            }
+        }
+        xstr_erase_after(path, end);
+    }
+    closedir(dir);
+}
+
+/* return the path of the manifest <file> relative to the tree <top>, or
+ * NULL if it is not in the tree.
+ */
+static char* manifest_path(const char* top, const char* file)
+{
+    char* dir = realpath(".", NULL);
+    char* root = realpath(top, NULL);
+    char* rel = NULL;
+    size_t len;
+
+    if (dir && root) {
+        len = strlen(root);
+        if (len == 1) {
+            len = 0; /* the tree is "/" */
+        }
+        if (!strncmp(dir, root, len) && (dir[len] == '\0' || dir[len] == '/')) {
+            const char* sub = dir[len] ? dir + len + 1 : "";
+
+            rel = malloc(strlen(sub) + strlen(file) + 2);
+            sprintf(rel, sub[0] ? "%s/%s" : "%s%s", sub, file);
+        }
+    }
+    free(dir);
+    free(root);
+    return rel;
+}
+
+/* saving the manifest must not trigger another upload, whatever the
+ * ignored files are. it is written to "<file>.tmp" and renamed.
+ */
+static int is_manifest(watch_t* w, const char* file)
+{
+    return w->skip && !strncmp(file, w->skip, w->skiplen)
+        && (file[w->skiplen] == '\0' || !strcmp(file + w->skiplen, ".tmp"));
+}
+
+static void read_events(watch_t* w, xstr_t* path, size_t off)
+{
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        struct inotify_event* ev;
+
+        for (char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event*)p;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                w->overflow = 1;
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= w->ndirs || !w->dirs[ev->wd]) {
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                free(w->dirs[ev->wd]);
+                w->dirs[ev->wd] = NULL;
+                continue;
+            }
+            if (ev->len == 0) {
+                continue; /* the directory itself */
+            }
+
+            xstr_assign_at(path, off, w->dirs[ev->wd]);
+            xstr_append(path, ev->name);
+            if (is_manifest(w, xstr_data(path) + off)) {
+                continue;
+            }
+            touch(w, xstr_data(path) + off, xstr_size(path) - off);
+
+            /* a new directory may have files before it is watched */
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+                xstr_push_back(path, '/');
+                if (!ignore_match(w->cfg->ignores, xstr_data(path) + off)
+                        && !ignore_prunes(w->cfg->ignores, xstr_data(path) + off)) {
+                    add_dir(w, path, off, 1);
+                }
+            }
+        }
+    }
+}
+
+static int cmp_name(const void* l, const void* r)
+{
+    return strcmp(*(char* const*)l, *(char* const*)r);
+}
+
+static void upload_items(watch_t* w, file_table_t* items, sftp_t* sftp, manifest_t* m)
+{
+    time_t start = time(NULL);
+
+    transfer_items(items, w->cfg, sftp, 0, w->jobs, w->pool);
+    if (m) {
+        iterate_directory_record(items, m, start);
+        manifest_save(m);
+    }
+}
+
+static void upload_touched(watch_t* w, sftp_t* sftp, manifest_t* m)
+{
+    config_t* cfg = w->cfg;
+    file_table_t* items;
+    char** names;
+    size_t n = 0;
+
+    if (w->overflow) {
+        fprintf(stderr, "too many events, sync the whole tree.\n");
+        w->overflow = 0;
+        xlist_clear(w->touched);
+
+        items = iterate_directory(cfg->local_path, cfg->ignores, cfg->follow_link, NULL);
+        iterate_directory_setextra(items, cfg->remote_path, cfg->follow_link,
+                cfg->resume_transfer, sftp, m);
+        upload_items(w, items, sftp, m);
+        iterate_directory_free(items);
+        return;
+    }
+
+    names = malloc(xlist_size(w->touched) * sizeof(char*));
+    for (xlist_iter_t i = xlist_begin(w->touched);
+            i != xlist_end(w->touched); i = xlist_iter_next(i)) {
+        names[n++] = *(char**)xlist_iter_value(i);
+    }
+    qsort(names, n, sizeof(char*), cmp_name);
+    if (n > 1) {
+        size_t k = 1;
+
+        for (size_t i = 1; i < n; ++i) {
+            if (strcmp(names[i], names[k - 1])) {
+                names[k++] = names[i];
+            }
+        }
+        n = k;
+    }
+
+    /* the touched files are uploaded whatever their mtime, a directory
+     * only if it is missing.
+     */
+    items = iterate_files(cfg->local_path, names, n, cfg->ignores, cfg->follow_link);
+    iterate_directory_stat(items, cfg->remote_path, cfg->follow_link,
+            cfg->resume_transfer, sftp);
+    for (size_t i = 0; i < items->count; ++i) {
+        if (!LIBSSH2_SFTP_S_ISDIR(items->mode[i]) || !(items->flags[i] & FILE_EXIST)) {
+            items->flags[i] |= FILE_NEWER;
+        } else {
+            items->flags[i] &= ~FILE_NEWER;
+        }
+    }
+    upload_items(w, items, sftp, m);
+
+    iterate_directory_free(items);
+    xlist_clear(w->touched);
+    free(names);
+}
+
+static int64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int watch_upload(config_t* cfg, sftp_t* sftp, manifest_t* m, int jobs)
+{
+    watch_t w;
+    xstr_t path;
+    size_t off;
+    int64_t deadline = 0;
+    struct sigaction sa, oldint, oldterm;
+    sigset_t stops, mask;
+    int ret = 0;
+
+    memset(&w, 0, sizeof(w));
+    w.cfg = cfg;
+    w.jobs = jobs;
+    w.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w.fd < 0) {
+        fprintf(stderr, "inotify_init failed (%s).\n", strerror(errno));
+        return -1;
+    }
+    w.touched = xlist_new(sizeof(char*), free_name);
+    w.pool = transfer_pool_new();
+    if (m) {
+        w.skip = manifest_path(cfg->local_path, m->file);
+        w.skiplen = w.skip ? strlen(w.skip) : 0;
+    }
+
+    xstr_init_ex(&path, 512);
+    xstr_append(&path, cfg->local_path);
+    if (xstr_back(&path) != '/') {
+        xstr_push_back(&path, '/');
+    }
+    off = xstr_size(&path);
+    add_dir(&w, &path, off, 0);
+
+    /* the stop signals are taken only while waiting for events, so they
+     * neither interrupt an upload nor get lost before the wait.
+     */
+    stopping = 0;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &oldint);
+    sigaction(SIGTERM, &sa, &oldterm);
+    sigemptyset(&stops);
+    sigaddset(&stops, SIGINT);
+    sigaddset(&stops, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stops, &mask);
+
+    fprintf(stderr, "watching [%s], press Ctrl+C to stop.\n", cfg->local_path);
+    libssh2_keepalive_config(sftp->ssh, 1, 30);
+
+    while (!stopping) {
+        struct pollfd pfd;
+        struct timespec ts;
+        int timeout;
+        int idle = 30;
+
+        if (!xlist_empty(w.touched) || w.overflow) {
+            timeout = (int)(deadline - now_ms());
+            if (timeout <= 0) {
+                upload_touched(&w, sftp, m);
+                continue;
+            }
+        } else {
+            /* keep the sessions alive while nothing happens */
+            libssh2_keepalive_send(sftp->ssh, &idle);
+            transfer_pool_keepalive(w.pool);
+            timeout = (idle > 0 ? idle : 1) * 1000;
+        }
+
+        pfd.fd = w.fd;
+        pfd.events = POLLIN;
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+        if (ppoll(&pfd, 1, &ts, &mask) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed (%s).\n", strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (pfd.revents & POLLIN) {
+            int waiting = !xlist_empty(w.touched) || w.overflow;
+
+            read_events(&w, &path, off);
+            if (!waiting) {
+                deadline = now_ms() + cfg->watch_delay;
+            }
+        }
+    }
+
+    /* upload what is touched before it stops, the caller saves <m> */
+    if (stopping) {
+        fprintf(stderr, "stopped watching.\n");
+        read_events(&w, &path, off);
+        if (!xlist_empty(w.touched) || w.overflow) {
+            upload_touched(&w, sftp, m);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGTERM, &oldterm, NULL);
+
+    transfer_pool_free(w.pool);
+    xstr_destroy(&path);
+    xlist_free(w.touched);
+    for (int i = 0; i < w.ndirs; ++i) {
+        free(w.dirs[i]);
+    }
+    free(w.dirs);
+    free(w.skip);
+    close(w.fd);
+    return ret;
+}
+
+#else
+
+int watch_upload(config_t* cfg, sftp_t* sftp, manifest_t* m, int jobs)
+{
+    fprintf(stderr, "watch mode is not supported on this platform.\n");
+    return -1;
+}
+
+#endif
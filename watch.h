@@ -0,0 +1,17 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include "config.h"
+#include "manifest.h"
+#include "ssh_session.h"
+
+/* follow the local tree of <cfg> by inotify and upload the touched files
+ * over <jobs> sessions, which are kept open, the events in
+ * <cfg->watch_delay> ms after the first one are uploaded together. <m> gets
+ * the uploaded files if not NULL, its file is never uploaded. it runs until
+ * SIGINT or SIGTERM, then uploads the files touched so far and returns 0.
+ * return -1 if the tree can not be watched.
+ */
+int watch_upload(config_t* cfg, sftp_t* sftp, manifest_t* m, int jobs);
+
+#endif // _WATCH_H_
@@ -0,0 +1,71 @@
+#include "xthread.h"
+
+#ifdef _WIN32
+
+static DWORD WINAPI xthread_start(LPVOID arg)
+{
+    xthread_t* th = arg;
+
+    th->routine(th->arg);
+    return 0;
+}
+
+int xthread_create(xthread_t* th, xthread_routine routine, void* arg)
+{
+    th->routine = routine;
+    th->arg = arg;
+    th->handle = CreateThread(NULL, 0, xthread_start, th, 0, NULL);
+    return th->handle ? 0 : -1;
+}
+
+void xthread_join(xthread_t* th)
+{
+    WaitForSingleObject(th->handle, INFINITE);
+    CloseHandle(th->handle);
+}
+
+void xmutex_init(xmutex_t* m) { InitializeCriticalSection(m); }
+void xmutex_destroy(xmutex_t* m) { DeleteCriticalSection(m); }
+void xmutex_lock(xmutex_t* m) { EnterCriticalSection(m); }
+void xmutex_unlock(xmutex_t* m) { LeaveCriticalSection(m); }
+
+void xcond_init(xcond_t* c) { InitializeConditionVariable(c); }
+void xcond_destroy(xcond_t* c) { (void)c; }
+void xcond_wait(xcond_t* c, xmutex_t* m) { SleepConditionVariableCS(c, m, INFINITE); }
+void xcond_signal(xcond_t* c) { WakeConditionVariable(c); }
+void xcond_broadcast(xcond_t* c) { WakeAllConditionVariable(c); }
+
+#else
+
+static void* xthread_start(void* arg)
+{
+    xthread_t* th = arg;
+
+    th->routine(th->arg);
+    return NULL;
+}
+
+int xthread_create(xthread_t* th, xthread_routine routine, void* arg)
+{
+    th->routine = routine;
+    th->arg = arg;
+    return pthread_create(&th->handle, NULL, xthread_start, th) == 0 ? 0 : -1;
+}
+
+void xthread_join(xthread_t* th)
+{
+    pthread_join(th->handle, NULL);
+}
+
+void xmutex_init(xmutex_t* m) { pthread_mutex_init(m, NULL); }
+void xmutex_destroy(xmutex_t* m) { pthread_mutex_destroy(m); }
+void xmutex_lock(xmutex_t* m) { pthread_mutex_lock(m); }
+void xmutex_unlock(xmutex_t* m) { pthread_mutex_unlock(m); }
+
+void xcond_init(xcond_t* c) { pthread_cond_init(c, NULL); }
+void xcond_destroy(xcond_t* c) { pthread_cond_destroy(c); }
+void xcond_wait(xcond_t* c, xmutex_t* m) { pthread_cond_wait(c, m); }
+void xcond_signal(xcond_t* c) { pthread_cond_signal(c); }
+void xcond_broadcast(xcond_t* c) { pthread_cond_broadcast(c); }
+
+#endif
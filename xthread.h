@@ -0,0 +1,49 @@
+#ifndef _XTHREAD_H_
+#define _XTHREAD_H_
+
+/* minimal thread, mutex and condition variable wrappers. */
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+typedef void (*xthread_routine)(void* arg);
+
+typedef struct {
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    xthread_routine routine;
+    void* arg;
+} xthread_t;
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION xmutex_t;
+typedef CONDITION_VARIABLE xcond_t;
+#else
+typedef pthread_mutex_t xmutex_t;
+typedef pthread_cond_t xcond_t;
+#endif
+
+/* start <routine> in a new thread, return 0 on success.
+ * <th> must be valid until <xthread_join> returns.
+ */
+int xthread_create(xthread_t* th, xthread_routine routine, void* arg);
+void xthread_join(xthread_t* th);
+
+void xmutex_init(xmutex_t* m);
+void xmutex_destroy(xmutex_t* m);
+void xmutex_lock(xmutex_t* m);
+void xmutex_unlock(xmutex_t* m);
+
+void xcond_init(xcond_t* c);
+void xcond_destroy(xcond_t* c);
+void xcond_wait(xcond_t* c, xmutex_t* m);
+void xcond_signal(xcond_t* c);
+void xcond_broadcast(xcond_t* c);
+
+#endif // _XTHREAD_H_